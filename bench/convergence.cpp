@@ -0,0 +1,189 @@
+//
+//	Convergence benchmark of the constraint solvers.
+//	Builds the curtain (pinned, 20x20) and sphere-drape (unpinned, 41x41)
+//	scenes of config.hpp on the CPU solver, runs them to an interesting state
+//	with the default solver, then takes one more step with N sweeps of each
+//	scheme and reports the RMS distance to the converged positions of that
+//	step (REFERENCE_SWEEPS Jacobi sweeps, the same for every scheme), the
+//	constraint error left, and the time of the first step whose constraint
+//	error is down to that of Jacobi's most sweeps.
+//	The multigrid row runs N V-cycles, its time is per V-cycle. The
+//	projective row runs N Projective Dynamics iterations.
+//	The integrator table then simulates SIMULATED_SECONDS of each scene with
+//	the explicit Verlet step and the implicit one at a few step scales, and
+//	reports the wall time per simulated second and the mean cloth height.
+//
+//	Usage: ClothBenchmark [frames] [threads]
+//
+#include "cloth_solver.hpp"
+#include "config.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#define REFERENCE_SWEEPS 4096
+#define SIMULATED_SECONDS 4.f
+
+struct Scene {
+	const char* name;
+	int row, col;
+	float width, height;
+	bool pinned;
+};
+
+struct Scheme {
+	const char* name;
+	float chebyshev_rho;
+	bool multigrid;		// N counts V-cycles instead of sweeps
+	bool projective;	// N counts Projective Dynamics iterations
+};
+
+static ClothSolver* build(const Scene& scene, unsigned int threads) {
+	// same layout as build_fabric() in main.cpp
+	std::vector<Vec3f> vertices;
+	for (int i = 0; i <= scene.row; i++)
+		for (int j = 0; j <= scene.col; j++)
+			vertices.push_back(Vec3f(-scene.width / 2.f + scene.width / scene.col * j, CLOTH_TOP,
+				scene.height / 2.f - scene.height / scene.row * i));
+
+	std::vector<unsigned int> pins;
+	if (scene.pinned)
+		for (int k = 0; k <= 4; k++)
+			pins.push_back(k * scene.col / 4);
+
+	return new ClothSolver(scene.row, scene.col, scene.width, scene.height, vertices, pins, threads);
+}
+
+// Settles scene, then takes one step with sweeps of scheme
+static ClothSolver* run(const Scene& scene, unsigned int threads, int frames,
+	const Scheme& scheme, int sweeps, double* seconds) {
+	ClothSolver* solver = build(scene, threads);
+	for (int f = 0; f < frames; f++)
+		solver->step();
+
+	// The TAU of each scheme is kept, only the sweep count changes
+	solver->set_chebyshev(scheme.chebyshev_rho);
+	solver->set_multigrid(scheme.multigrid);
+	solver->set_projective(scheme.projective);
+	solver->set_iterations(sweeps);
+	auto start = std::chrono::steady_clock::now();
+	solver->step();
+	if (seconds)
+		*seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return solver;
+}
+
+static double rms_distance(const ClothSolver& a, const ClothSolver& b, int count) {
+	double sum = 0.0;
+	for (int k = 0; k < count; k++) {
+		Float3 p = a.get_position(k), q = b.get_position(k);
+		double x = p.x - q.x, y = p.y - q.y, z = p.z - q.z;
+		sum += x * x + y * y + z * z;
+	}
+	return sqrt(sum / count);
+}
+
+// Wall milliseconds per simulated second, step_scale 0 is the explicit step
+static double integrate(const Scene& scene, unsigned int threads, int step_scale,
+	double* cg_per_step, double* mean_height) {
+	ClothSolver* solver = build(scene, threads);
+	if (step_scale > 0)
+		solver->set_implicit(step_scale);
+	const int steps = int(SIMULATED_SECONDS / solver->time_step() + 0.5f);
+
+	long cg = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int s = 0; s < steps; s++) {
+		solver->step(false);
+		cg += solver->cg_iterations();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const int count = (scene.row + 1) * (scene.col + 1);
+	double height = 0.0;
+	for (int k = 0; k < count; k++)
+		height += solver->get_position(k).y;
+	*cg_per_step = double(cg) / steps;
+	*mean_height = height / count;
+	delete solver;
+	return seconds * 1e3 / SIMULATED_SECONDS;
+}
+
+int main(int argc, char* argv[]) {
+	int frames = argc > 1 ? atoi(argv[1]) : 120;
+	unsigned int threads = argc > 2 ? (unsigned int)atoi(argv[2]) : 0;
+
+	const Scene scenes[] = {
+		{ "curtain", 19, 19, 19.f, 19.f, true },
+		{ "sphere-drape", 40, 40, 40.f, 40.f, false }
+	};
+	const Scheme schemes[] = {
+		{ "jacobi", 0.f, false, false },
+		{ "chebyshev", CHEBYSHEV_RHO, false, false },
+		{ "multigrid", 0.f, true, false },
+		{ "projective", 0.f, false, true }
+	};
+	const int sweeps[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+	for (const Scene& scene : scenes) {
+		const int count = (scene.row + 1) * (scene.col + 1);
+		const Scheme jacobi = schemes[0];
+		ClothSolver* reference = run(scene, threads, frames, jacobi, REFERENCE_SWEEPS, NULL);
+
+		printf("%s, %dx%d, after %d frames\n", scene.name, scene.row, scene.col, frames);
+		printf("%-14s", "sweeps");
+		for (int n : sweeps) printf("%10d", n);
+		printf("%12s%12s%12s\n", "error", "ms/sweep", "ms to match");
+
+		// the constraint error of the most jacobi sweeps, schemes[0] sets it
+		float target = 0.f;
+		for (const Scheme& scheme : schemes) {
+			printf("%-14s", scheme.name);
+			double seconds = 0.0, step = 0.0, match = -1.0;
+			int total = 0;
+			float error = 0.f;
+			for (int n : sweeps) {
+				step = 0.0;
+				ClothSolver* solver = run(scene, threads, frames, scheme, n, &step);
+				seconds += step;
+				total += n;
+				printf("%10.2e", rms_distance(*solver, *reference, count));
+				error = solver->constraint_error();
+				if (match < 0.0 && &scheme != &schemes[0] && error <= target)
+					match = step;
+				delete solver;
+			}
+			// jacobi gets there with its most sweeps
+			if (&scheme == &schemes[0]) {
+				target = error;
+				match = step;
+			}
+			// constraint error after the most sweeps
+			printf("%12.5f%12.4f", error, seconds * 1e3 / total);
+			if (match < 0.0)
+				printf("%12s\n", "never");
+			else
+				printf("%12.4f\n", match * 1e3);
+		}
+		printf("\n");
+		delete reference;
+	}
+
+	const int step_scales[] = { 0, 1, 4, 8 };
+	for (const Scene& scene : scenes) {
+		printf("%s, %dx%d, %.0f simulated seconds\n", scene.name, scene.row, scene.col, SIMULATED_SECONDS);
+		printf("%-14s%12s%12s%12s%12s\n", "integrator", "time step", "ms/sim-s", "cg/step", "mean y");
+		for (int scale : step_scales) {
+			double cg = 0.0, height = 0.0;
+			double ms = integrate(scene, threads, scale, &cg, &height);
+			char name[32];
+			snprintf(name, sizeof(name), scale ? "implicit x%d" : "verlet", scale);
+			printf("%-14s%12.4f%12.2f%12.1f%12.3f\n", name, scale ? DELTA_TIME * scale : DELTA_TIME, ms, cg, height);
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,200 @@
+#ifndef CLOTH_SOLVER_HPP
+#define CLOTH_SOLVER_HPP 1
+
+#include "vector.hpp"
+#include "thread_pool.hpp"
+#include "constraint_simd.hpp"
+#include "projective_system.hpp"
+
+#include <memory>
+#include <vector>
+
+struct Float3 {
+	float x, y, z;
+};
+
+//
+//	Structure-of-arrays vertex buffer
+//	Rows are padded to a multiple of 16 floats and SOA_PADDING floats are
+//	kept before and after the grid, see ConstraintArgs.
+//
+#define SOA_PADDING 32
+
+struct Float3Array {
+	AlignedFloats xs, ys, zs;
+
+	void resize(size_t n) {
+		xs.assign(n + 2 * SOA_PADDING, 0.f);
+		ys.assign(n + 2 * SOA_PADDING, 0.f);
+		zs.assign(n + 2 * SOA_PADDING, 0.f);
+	}
+
+	float* x() { return xs.data() + SOA_PADDING; }
+	float* y() { return ys.data() + SOA_PADDING; }
+	float* z() { return zs.data() + SOA_PADDING; }
+	const float* x() const { return xs.data() + SOA_PADDING; }
+	const float* y() const { return ys.data() + SOA_PADDING; }
+	const float* z() const { return zs.data() + SOA_PADDING; }
+};
+
+//
+//	Coarse grid of the multigrid hierarchy
+//	Every other row and column of the grid above it, at twice its rest
+//	distances. positions / new_positions ping-pong like the fine grid,
+//	restricted keeps the injected positions the correction is measured from
+//	and force is the full approximation scheme term that makes the coarse
+//	sweeps stand still once the grid above has converged.
+//
+struct GridLevel {
+	int row, col, stride;
+	float dx, dy;
+	Float3Array positions, new_positions, restricted, force;
+	AlignedInts active;		// 0 next to a pinned fine vertex
+	AlignedInts has_left1, has_right1, has_left2, has_right2;
+};
+
+// Spring of the implicit integrator from a vertex to one stencil neighbour
+struct ImplicitSpring {
+	float dx, dy, dz;	// unit direction to the neighbour
+	float c;			// transverse stiffness fraction
+	float k;			// 0 past the cloth border
+};
+
+//
+//	CPU Cloth Solver
+//	Native implementation of the update_position / update_old_position /
+//	constraint / calculate_normals pipeline in kernels.cl.
+//	Every pass is run over the cloth rows on a work-stealing thread pool,
+//	the constraint pass uses the widest SIMD kernel the CPU supports.
+//
+class ClothSolver {
+public:
+	// row, col are the number of quads along each side (like CLOTH_ROW, CLOTH_COL)
+	ClothSolver(int row, int col, float width, float height,
+		const std::vector<Vec3f>& vertices, const std::vector<unsigned int>& pins,
+		unsigned int thread_count = 0, SimdIsa max_isa = SIMD_AVX512);
+
+	// Advances the cloth by one DELTA_TIME step, normals are only needed
+	// on steps that are displayed
+	void step(bool normals = true);
+
+	// Constraint sweeps per step, SOLVER_ITERATIONS by default
+	void set_iterations(int count) { iterations = count; }
+	// Jacobi sweeps stop early once the largest vertex correction of a sweep,
+	// relative to the rest distance, falls below tolerance; the iteration
+	// count becomes the cap. Checked every ADAPTIVE_CHECK_INTERVAL sweeps,
+	// 0 disables it.
+	void set_tolerance(float value);
+	int iterations_used() const { return sweeps_last; }	// of the last step
+	// Chebyshev acceleration of the Jacobi sweeps, rho = 0 disables it
+	void set_chebyshev(float rho) { chebyshev_rho = rho; }
+	// Compliance based constraints, see XPBD_STRETCH_COMPLIANCE in config.hpp
+	void set_xpbd(float stretch, float shear, float bend);
+	// Backward Euler on springs instead of Verlet and constraints, each step
+	// then advances step_scale * DELTA_TIME, see implicit_step()
+	void set_implicit(int step_scale);
+	float time_step() const;
+	int cg_iterations() const { return cg_last; }	// of the last implicit step
+
+	// Geometric multigrid V-cycles of Jacobi sweeps, the iteration count
+	// becomes the number of V-cycles. PBD constraints only.
+	void set_multigrid(bool enable);
+	int multigrid_levels() const { return 1 + (int)levels.size(); }
+	// Rest detection of the Jacobi sweeps: REST_TILE x REST_TILE tiles that
+	// stayed under REST_THRESHOLD for REST_FRAMES steps sleep and are held
+	// like pins, unless a neighbouring tile is awake. set_position() wakes the
+	// tile it moves a vertex in. A step with every tile asleep does nothing.
+	void set_rest_detection(bool enable);
+	int live_tiles() const { return tiles_live; }	// simulated by the last step
+	// Projective Dynamics local/global iterations on the SPRING_* springs
+	// instead of constraint sweeps, the global system is factored here
+	void set_projective(bool enable);
+
+	// Vertex access by mesh index (j + (col+1)*i)
+	void set_position(unsigned int idx, float x, float y, float z);
+	Float3 get_position(unsigned int idx) const;
+	Float3 get_old_position(unsigned int idx) const;	// position before the last step
+	Float3 get_normal(unsigned int idx) const;
+
+	// Mean violation of the stencil constraints relative to their rest length,
+	// measured the way the active constraint type measures distances
+	float constraint_error() const;
+
+	unsigned int thread_count() const { return pool.size(); }
+	SimdIsa simd_isa() const { return isa; }
+
+private:
+	void update_position(int first_row, int last_row);
+	void update_old_position(int first_row, int last_row);
+	void constraint(const Float3Array& in, Float3Array& out, const AlignedInts& mask, int first_row, int last_row,
+		float omega = 0.f);
+	void copy_rows(const Float3Array& from, Float3Array& to, int first_row, int last_row);
+	void level_constraint(GridLevel& level, bool even, bool forced, int first_row, int last_row);
+	void smooth(int level, int sweeps);
+	void multigrid_cycle();
+	void calculate_normals(int first_row, int last_row);
+	void projective_local(int first_row, int last_row);
+	void projective_scatter(int first_row, int last_row);
+	void implicit_step();
+	void implicit_prepare(int first_row, int last_row);
+	void implicit_multiply(int first_row, int last_row);
+	void implicit_update(float alpha, int first_row, int last_row);
+	void implicit_finish(int first_row, int last_row);
+	double sum_rows() const;
+	float max_correction(const Float3Array& from, const Float3Array& to, int grain);
+	void classify_tiles();
+	int tile_of(int i, int j) const;
+
+	int index(int i, int j) const { return j + stride * i; }
+	int index(unsigned int idx) const { return index(idx / (col + 1), idx % (col + 1)); }
+
+	int row, col, stride;
+	float dx, dy;
+	int iterations;
+	float tolerance;
+	int sweeps_last;
+	bool xpbd;
+	bool multigrid;
+	float chebyshev_rho;
+	float alpha_stretch, alpha_shear, alpha_bend;	// compliance / dt^2
+	bool implicit;
+	float implicit_dt;	// implicit time step
+	int cg_last;
+
+	Float3Array old_positions;
+	Float3Array positions;
+	Float3Array new_positions;
+	Float3Array normals;
+	AlignedFloats lambda;	// XPBD_CONSTRAINTS multipliers per vertex
+	std::vector<GridLevel> levels;	// multigrid, finest coarse grid first
+	// implicit: velocity change, CG residual, preconditioned residual,
+	// search direction, A * direction and the Jacobi preconditioner
+	Float3Array cg_dv, cg_r, cg_z, cg_dir, cg_q, cg_diag;
+	// The spring Jacobians only depend on the positions, implicit_prepare()
+	// keeps the 12 of every vertex for the CG products of the step
+	std::vector<ImplicitSpring> springs;
+	std::vector<double> row_sums;	// per row dot products, summed in order
+	std::vector<float> row_max;	// per row largest correction of the adaptive check
+	// rest detection: displacement of the last step per row and tile column,
+	// quiet steps per tile, and active restricted to the simulated tiles
+	bool rest;
+	int tiles_down, tiles_across, tiles_live;
+	std::vector<float> row_motion;
+	std::vector<int> tile_quiet;
+	std::vector<char> tile_live;
+	AlignedInts sweep_mask;
+	const AlignedInts* moving;	// active or sweep_mask
+	std::unique_ptr<ProjectiveSystem> projective;
+	std::vector<float> projective_xyz;	// right-hand side, then solution of the global step
+
+	// constraint masks, see ConstraintArgs
+	AlignedInts active;
+	AlignedInts has_left1, has_right1, has_left2, has_right2;
+
+	SimdIsa isa;
+	ConstraintRowFn constraint_row;
+
+	ThreadPool pool;
+};
+
+#endif
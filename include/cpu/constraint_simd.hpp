@@ -0,0 +1,119 @@
+#ifndef CONSTRAINT_SIMD_HPP
+#define CONSTRAINT_SIMD_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#define SIMD_ALIGNMENT 64
+
+//
+//	Allocator for the structure-of-arrays buffers, every array starts
+//	on a 64 byte boundary so whole AVX-512 registers can be loaded.
+//
+template <class T>
+class AlignedAllocator {
+public:
+	typedef T value_type;
+
+	AlignedAllocator() {}
+	template <class U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		size_t bytes = (n * sizeof(T) + SIMD_ALIGNMENT - 1) / SIMD_ALIGNMENT * SIMD_ALIGNMENT;
+#if defined(_MSC_VER)
+		void* p = _aligned_malloc(bytes, SIMD_ALIGNMENT);
+#else
+		void* p = aligned_alloc(SIMD_ALIGNMENT, bytes);
+#endif
+		if (!p) throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, size_t) {
+#if defined(_MSC_VER)
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	template <class U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+	template <class U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float> > AlignedFloats;
+typedef std::vector<int32_t, AlignedAllocator<int32_t> > AlignedInts;
+
+// Instruction sets the constraint kernel is built for
+enum SimdIsa {
+	SIMD_SCALAR,
+	SIMD_AVX2,		// 8 vertices per instruction
+	SIMD_AVX512		// 16 vertices per instruction
+};
+
+// Best instruction set supported by the running CPU and OS
+SimdIsa detect_simd_isa();
+const char* simd_isa_name(SimdIsa isa);
+
+//
+//	Arguments of one constraint pass over structure-of-arrays positions.
+//	Vertex (i, j) lives at [i * stride + j]; rows are padded to a multiple
+//	of 16 floats and the pointers have at least 16 readable floats on each
+//	side, so neighbours at j-2 .. j+17 can always be loaded and masked off.
+//
+struct ConstraintArgs {
+	const float* in_x;
+	const float* in_y;
+	const float* in_z;
+	float* out_x;
+	float* out_y;
+	float* out_z;
+
+	const int32_t* active;		// per vertex: -1 if the constraint moves it, 0 if pinned or padding
+	const int32_t* has_left1;	// per column: -1 if j > 0
+	const int32_t* has_right1;	// per column: -1 if j < col
+	const int32_t* has_left2;	// per column: -1 if j > 1
+	const int32_t* has_right2;	// per column: -1 if j < col - 1
+
+	int row, col, stride;
+	float dx, dy, diagl, dblDiagl;
+	float tau;
+	float sphere_radius;
+
+	// Chebyshev: out = omega * (gamma * (x - in) + in - out) + out, where out
+	// still holds the iterate before in
+	int chebyshev;
+	float omega, gamma;
+
+	// Multigrid: FAS forcing term added to every projected vertex of a
+	// coarse grid, null on the cloth itself
+	const float* force_x;
+	const float* force_y;
+	const float* force_z;
+
+	// XPBD, see constraint_row_xpbd
+	float* lambda;			// multiplier k of vertex idx at [k * lambda_stride + idx]
+	int lambda_stride;
+	float alpha_stretch, alpha_shear, alpha_bend;	// compliance / dt^2
+};
+
+typedef void (*ConstraintRowFn)(const ConstraintArgs& args, int i);
+
+// Projects the stencil constraints of cloth row i
+void constraint_row_scalar(const ConstraintArgs& args, int i);
+void constraint_row_avx2(const ConstraintArgs& args, int i);
+void constraint_row_avx512(const ConstraintArgs& args, int i);
+// Compliance based projection like the p.xpbd path of kernels.cl, scalar only
+void constraint_row_xpbd(const ConstraintArgs& args, int i);
+
+// Chebyshev weight of Jacobi sweep k given omega, the weight of sweep k - 1.
+// 1 for the first CHEBYSHEV_DELAY sweeps, rho is the spectral radius estimate.
+float chebyshev_omega(int k, float rho, float omega);
+
+// Picks the widest kernel that is both requested and supported
+ConstraintRowFn select_constraint_row(SimdIsa requested, SimdIsa* selected);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef PROJECTIVE_SYSTEM_HPP
+#define PROJECTIVE_SYSTEM_HPP 1
+
+#include <vector>
+
+// Row and column offsets of the 12 springs of a vertex, in the order of the
+// constraint stencil: +-1 rows and columns, diagonals, +-2 diagonals
+extern const int stencil_offsets[12][2];
+
+//
+//	Projective Dynamics global system
+//	With unit vertex masses, time step h and spring weights w the global step
+//	of Projective Dynamics solves
+//		(I / h^2 + sum w (e_i - e_j)(e_i - e_j)^T) x = s / h^2 - sum w p_ij
+//	for the predicted positions s and the springs projected to their rest
+//	length p_ij. The matrix only depends on the grid, the pins and the
+//	weights, so it is factored once. Vertices are numbered j + (col+1)*i,
+//	which makes it a band matrix of half bandwidth 2*(col+1)+2 (the +-2
+//	diagonals), and its Cholesky factor keeps the band. Pinned vertices get
+//	identity rows, the springs to them move to the right-hand side.
+//
+class ProjectiveSystem {
+public:
+	ProjectiveSystem(int row, int col, const std::vector<unsigned int>& pins,
+		float time_step, float stretch, float shear, float bend);
+
+	int size() const { return n; }
+	int bandwidth() const { return band; }
+
+	// L row by row, (i, k) at i * (band + 1) + band - (i - k) for i - band <= k <= i.
+	// Entries left of the first column are 0.
+	const std::vector<float>& factor() const { return lower; }
+
+	// Solves L L^T x = b in place, xyz holds b (and then x) as x, y, z triples
+	void solve(float* xyz) const;
+
+private:
+	int n, band;
+	std::vector<float> lower;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP 1
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+//	Work-stealing Thread Pool
+//	parallel_for() splits a range of cloth rows evenly over the workers.
+//	Each worker drains its own slice in chunks of `grain` rows and then
+//	steals chunks from the other slices until every slice is empty.
+//
+class ThreadPool {
+public:
+	// thread_count == 0 uses every hardware thread
+	ThreadPool(unsigned int thread_count = 0);
+	~ThreadPool();
+
+	unsigned int size() const { return worker_count; }
+
+	// Calls body(begin, end) on sub-ranges of [first, last) and
+	// returns after the whole range has been processed.
+	void parallel_for(int first, int last, int grain, const std::function<void(int, int)>& body);
+
+private:
+	// One slice per worker, padded so that the counters do not share a cache line
+	struct Slice {
+		std::atomic<int> next;
+		int end;
+		char padding[56];
+	};
+
+	void worker_loop(unsigned int id);
+	void drain(unsigned int id);
+
+	unsigned int worker_count;
+	std::vector<std::thread> threads;
+	std::unique_ptr<Slice[]> slices;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(int, int)>* job;
+	int job_grain;
+	unsigned long generation;
+	unsigned int running;
+	bool stopping;
+};
+
+#endif
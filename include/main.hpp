@@ -10,10 +10,16 @@
 // Includes
 #include "vector.hpp"
 #include "trimesh.hpp"
+#include "constraint_graph.hpp"
+#include "quadratic_bending.hpp"
 #include "shader.hpp"
 #include "matrix.hpp"
 #include "config.hpp"
+#include "cloth_params.hpp"
+#include "cloth_solver.hpp"
+#include "work_group_tuner.hpp"
 #include <cstring> // memcpy
+#include <chrono>
 #include <cmath>
 
 // Constants
@@ -71,6 +77,51 @@ typedef struct frustum {
 		return proj;
 	}
 } Frustum;
+
+// Solver backends
+enum Backend {
+	BACKEND_OPENCL,	// kernels.cl on a GPU device
+	BACKEND_CPU		// native multithreaded solver
+};
+
+// Constraint projection schemes
+enum SolverMode {
+	SOLVER_JACOBI,			// constraint ping-pong between two buffers
+	SOLVER_MULTIGRID,		// V-cycles of Jacobi sweeps over coarser grids
+	SOLVER_PROJECTIVE		// Projective Dynamics with a prefactored global system
+};
+
+// Device layout of the positions and normals, see position_t in kernels.cl
+enum Storage {
+	STORAGE_FLOAT3,		// float3, 16 bytes with the padding
+	STORAGE_PACKED,		// three floats, 12 bytes with vload3 / vstore3
+	STORAGE_COMPACT		// fixed point positions and octahedral normals
+};
+
+// Coarse grid of the multigrid solver, see restrict_level in kernels.cl
+struct CoarseGrid {
+	ClothParams params;
+	cl_mem positions, new_positions, restricted, force;
+	cl_mem pins;	// vertices next to a pinned vertex of the grid above
+	cl_kernel even, odd;	// constraint_coarse ping-pong, even reads new_positions
+};
+
+// Another build of the multi-launch step on the grid stencil, with the
+// Verlet state in its own layout. swap_step_build() trades it with the
+// kernels and buffers in use, so execute_kernel() runs it as it is.
+struct StepBuild {
+	Storage storage;
+	cl_program program;
+	cl_kernel update, old, even, odd, tiled_even, tiled_odd, normals, copy_tiles, pin_targets;
+	cl_mem old_positions, positions, new_positions, normals_buffer;
+};
+
+// One row of a startup report, a and b time the same work two ways in seconds
+struct TimingRow {
+	const char* name;
+	std::function<double()> a, b;
+};
+
 bool pause = true;
 //	Global state variables
 namespace Globals {
@@ -80,6 +131,50 @@ namespace Globals {
 	//GLuint verts_vbo[1], colors_vbo[1], normals_vbo[1], faces_ibo[1], tris_vao;
 	std::vector<TriMesh> meshes;
 	std::vector<unsigned int> cloth_pins;
+	bool custom_pins = false; // pins given with --pins
+	bool pins_released = false; // p key, the pins let go of the cloth
+
+	// cloth grid, chosen at runtime
+	int cloth_row = CLOTH_ROW;
+	int cloth_col = CLOTH_COL;
+	float cloth_width = CLOTH_WIDTH;
+	float cloth_height = CLOTH_HEIGHT;
+
+	Backend backend = BACKEND_OPENCL;
+	unsigned int cpu_threads = 0; // 0 = all hardware threads
+	SimdIsa cpu_simd = SIMD_AVX512; // widest constraint kernel to use, if supported
+
+	bool tiling = true; // local-memory constraint kernel when the device allows it
+	int substeps = 0; // fixed steps per rendered frame, 0 = real time
+	float step_budget = STEP_BUDGET; // ms of stepping per rendered frame
+	double accumulator = 0.0; // simulated time owed to the wall clock
+	double step_time = 0.0; // average wall time of one step, in seconds
+
+	bool fused = true; // single launch step when it beats the multi-launch one
+	bool autotune = true; // benchmark the work-group sizes on the device
+	bool retune = false; // ignore the tuning cache
+	std::string tuning_cache = "work_groups.cache";
+	SolverMode solver_mode = SOLVER_JACOBI;
+	int solver_iterations = 0; // 0 = default of the solver mode
+	float tolerance = 0.f; // correction that ends the Jacobi sweeps early, 0 = fixed count
+	float chebyshev_rho = 0.f; // spectral radius estimate of the Jacobi sweeps, 0 = no acceleration
+	bool rest = false; // skip the tiles of the cloth that stopped moving
+	Storage storage = STORAGE_FLOAT3; // layout of the device positions and normals
+	bool bandwidth = false; // print the memory bandwidth of the step kernels at startup
+	int batch = 0; // identical cloths of --batch N, 0 = a single cloth
+	std::string batch_file; // --batch FILE, one cloth per line
+	std::string batch_output; // positions of every batched cloth, written on release
+	bool deterministic = false; // same bits on every run, strict math and fixed launches
+	std::string mesh_file; // --mesh FILE, an OBJ cloth instead of the grid
+	bool csr = false; // --topology csr, the constraint graph kernels on the grid too
+	bool quadratic_bending = false; // --bending quadratic, the bending operator instead of the +-2 diagonals
+	float tear_strain = 0.f; // --tear, stretch that snaps a constraint, 0 = no tearing
+	bool aerodynamics = false; // --wind, drag and lift of the faces
+	float wind[3] = { 0.f, 0.f, 0.f }; // velocity of the air
+	bool xpbd = false; // compliance based constraints
+	float compliance[3] = { XPBD_STRETCH_COMPLIANCE, XPBD_SHEAR_COMPLIANCE, XPBD_BEND_COMPLIANCE };
+	bool implicit = false; // backward Euler springs instead of Verlet and constraints
+	int step_scale = IMPLICIT_STEP_SCALE; // implicit time step in DELTA_TIMEs
 
 	Frustum frus;
 	Vec3f n;
@@ -104,7 +199,28 @@ namespace Kernel {
 	cl_command_queue commandQueue;
 
 	std::vector<cl_float3> pos;
+	std::vector<cl_float3> prev; // positions one step before pos
 	std::vector<cl_float3> n;
+	// Layouts other than float3: pos, prev and n as the device holds them for
+	// the reads
+	std::vector<char> pos_codes, prev_codes, n_codes;
+	ClothParams params;
+	cl_mem pins;
+	cl_mem weights; // pin flag of every vertex, 0 holds it, 1 leaves it free, see is_pinned in kernels.cl
+	std::vector<cl_float> pin_weights; // host copy of weights
+	cl_mem lambda; // XPBD multipliers
+	cl_mem bending; // weights of --bending quadratic, see QuadraticBending::grid_table
+	cl_mem correction; // largest correction of the last measuring sweep, float bits in an int
+	cl_int correction_host = 0; // read back copy of correction
+	cl_event correction_read = NULL; // pending read of correction_host
+	// Rest detection, see rest_classify in kernels.cl
+	cl_mem tile_motion; // largest displacement of the last step per tile, float bits
+	cl_mem tile_quiet; // steps each tile has stayed under REST_THRESHOLD
+	cl_mem tiles; // count, then the tiles to dispatch
+	size_t tile_count = 0; // tiles of the grid
+	cl_int rest_wake = 0; // rest_classify wake flag for the next step
+	cl_int tiles_host = 0; // read back count of tiles
+	cl_event tiles_read = NULL; // pending read of tiles_host
 	cl_mem old_positions;
 	cl_mem positions;
 	cl_mem new_positions;
@@ -114,23 +230,194 @@ namespace Kernel {
 	cl_kernel updateOldPositionKernel;
 	cl_kernel constraintOddKernel;
 	cl_kernel constraintEvenKernel;
+	cl_kernel constraintTiledOddKernel;
+	cl_kernel constraintTiledEvenKernel;
+	size_t tile_size = 0; // work-group side of the tiled kernels, 0 if not used
 	cl_kernel calculateNoramlsKernel;
+	cl_kernel stepFusedKernel;
+	size_t fused_size = 0; // work-items of the fused step, 0 = multi-launch step
+	std::vector<CoarseGrid> levels; // multigrid, finest coarse grid first
+	cl_kernel restrictLevelKernel;
+	cl_kernel restrictForceKernel;
+	cl_kernel prolongateLevelKernel;
+	// Implicit integrator, see implicit.cl
+	cl_mem cg_dv, cg_r, cg_z, cg_dir, cg_q, cg_diag;
+	cl_mem dot_partials; // one sum per work-group of dot_partial
+	cl_mem cg_scalars; // r.z and p.Ap between the CG launches
+	size_t dot_group = 0; // work-items per dot_partial / dot_final work-group
+	size_t dot_groups = 0;
+	cl_kernel implicitPrepareKernel;
+	cl_kernel implicitMultiplyKernel;
+	cl_kernel dotPartialKernel;
+	cl_kernel dotFinalKernel;
+	cl_kernel cgStepKernel;
+	cl_kernel cgDirectionKernel;
+	cl_kernel implicitFinishKernel;
+	// Projective Dynamics, see projective_local in kernels.cl
+	cl_mem pd_rhs, pd_y; // right-hand side and forward substitution result
+	cl_mem pd_factor; // banded Cholesky factor of ProjectiveSystem
+	cl_int pd_band = 0;
+	size_t pd_group = 0; // work-items of the single projective_solve work-group
+	cl_kernel projectiveLocalKernel;
+	cl_kernel projectiveSolveKernel;
+	cl_kernel restClassifyKernel;
+	cl_kernel restCompactKernel;
+	cl_kernel copyTilesKernel;
+	// Batched cloths, see batch.cl. The Verlet state and normal buffers hold
+	// every instance, the host mirrors only instance 0
+	std::vector<InstanceParams> instances;
+	std::vector<cl_int> batch_pins; // pins of every instance back to back
+	cl_mem instance_params;
+	cl_mem instance_pins;
+	cl_kernel batchPredictKernel;
+	cl_kernel batchConstraintOddKernel;
+	cl_kernel batchConstraintEvenKernel;
+	cl_kernel batchNormalsKernel;
+	// Constraint graph of --mesh and --topology csr, see mesh.cl
+	ConstraintGraph* graph = nullptr;
+	cl_mem graph_offsets, graph_neighbors, graph_rest;
+	cl_mem graph_face_offsets, graph_face_list, graph_faces;
+	cl_kernel meshConstraintOddKernel;
+	cl_kernel meshConstraintEvenKernel;
+	cl_kernel meshNormalsKernel;
+	// Tearing, see tear.cl
+	cl_mem tear; // counters, links and log, one int without --tear
+	cl_mem tear_slot, tear_face, tear_faces; // the packed index buffer
+	cl_mem tear_holes, tear_pairs, tear_moved; // compaction scratch
+	cl_mem tear_cut; // snapped edges of every face
+	cl_int tear_live = 0; // faces in the packed index buffer
+	std::vector<Vec3i> tear_rest; // every face of the cloth, for reset_tear()
+	cl_kernel tearFacesKernel;
+	cl_kernel tearPairKernel;
+	cl_kernel tearMoveKernel;
+	// Kinematic pins, see pin_targets in kernels.cl
+	std::vector<PinTarget> targets; // one per pin, uploaded when a curve changes
+	cl_mem pin_targets;
+	cl_float pin_time = 0.f; // simulated seconds of the pin curves
+	cl_float pin_until = -1.f; // the curves move until then
+	cl_kernel pinTargetsKernel;
+
+	// Tuned launches, variant 1 of the constraint is the tiled kernel
+	WorkGroupTuner* tuner = nullptr;
+	LaunchConfig launch_update;
+	LaunchConfig launch_old;
+	LaunchConfig launch_constraint;
+	LaunchConfig launch_normals;
+}
+
+// Native solver variables
+namespace CPU {
+	ClothSolver* solver = nullptr;
 }
 
+// Function to parse the command line
+void parse_args(int argc, char* argv[]);
+int solver_iterations();
+void limit_projective();
+float chebyshev_rho();
+float adaptive_tolerance();
+bool rest_detection();
+SimdIsa cpu_simd();
+bool batched();
+size_t batch_size();
+bool csr_topology();
+bool tearing();
+float time_step();
 // Function to set up geometry
 void init_meshes();
+void build_fabric(TriMesh& fabric);
+void load_fabric(TriMesh& fabric);
+void resize_cloth(int row, int col);
 void move_pins(int key);
+void release_pins();
+bool runtime_pins();
+void set_pin(size_t vertex, bool pinned);
+size_t picked_vertex();
+void toggle_picked_pin();
+void build_pin_targets();
+void set_pin_target_args();
+void release_pin_targets();
+void upload_pin_targets(float until);
+cl_float3 pin_target_at(const PinTarget& target, float time);
 float cl_float3_dist(cl_float3& v1, cl_float3& v2);
 // Functions to set up kernels
-void init_kernel();
-cl_program build_prog(std::string& filename);
+bool init_kernel();
+size_t max_tile_size();
+void set_tile_arg(size_t tile);
+void tune_work_groups();
+size_t fused_group_size();
+void choose_step_mode();
+void build_multigrid();
+void release_multigrid();
+void multigrid_cycle(size_t width, size_t height);
+void build_implicit();
+void release_implicit();
+void implicit_step(size_t width, size_t height);
+void enqueue_dot(cl_mem a, cl_mem b, cl_int slot);
+void build_projective();
+void release_projective();
+void load_batch();
+void build_batch();
+void release_batch();
+void batch_step(size_t width, size_t height, bool display);
+void enqueue_batch(cl_kernel kernel, size_t width, size_t height);
+void save_batch();
+void build_graph();
+void release_graph();
+void graph_step(size_t width, size_t height, bool display);
+void graph_report();
+void bending_report();
+void wind_report();
+std::vector<cl_int> initial_tear();
+void build_tear();
+void release_tear();
+void reset_tear();
+void compact_faces();
+double time_steps(int frames);
+void reset_cloth_buffers();
+cl_program build_prog(const std::string& filename, bool deterministic, Storage storage);
 void release_kernel();
+void init_host_buffers();
 void set_buffer_kernel();
-void execute_kernel();
+void create_state_buffers();
+void release_buffer_kernel();
+size_t position_bytes();
+size_t normal_bytes();
+void set_storage_range();
+const char* storage_name();
+void encode_positions(const std::vector<cl_float3>& in, std::vector<char>& out);
+void decode_positions(const std::vector<char>& in, std::vector<cl_float3>& out);
+void decode_normals(const std::vector<char>& in, std::vector<cl_float3>& out);
+void write_positions(cl_mem buffer, const std::vector<cl_float3>& in);
+void storage_report();
+double time_kernel(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height);
+void compare_timings(const std::string& title, const char* a, const char* b,
+	const std::vector<TimingRow>& rows, double limit);
+TimingRow kernel_row(const char* name, cl_kernel a, cl_kernel b, const LaunchConfig& config);
+void bandwidth_report();
+WorkGroup other_work_group(cl_kernel kernel, const WorkGroup& local);
+void determinism_report();
+void set_step_args();
+StepBuild create_step_build(Storage storage, bool deterministic);
+void swap_step_build(StepBuild& build);
+void release_step_build(StepBuild& build);
+void simulate_frame(double frame_time);
+void update_fabric(float alpha);
+void execute_kernel(bool display = true);
+void enqueue_kernel(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height);
+void enqueue_grid(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height);
+bool update_rest_tiles();
 void get_result_from_kernel();
 void clSetKernelArgAssert(cl_int err);
 void clCreateKernelAssert(cl_int err);
 void clEnqueueNDRangeKernelAssert(cl_int err);
+// Functions to run the native CPU solver
+void init_cpu_solver();
+ClothSolver* create_cpu_solver(unsigned int threads, SimdIsa isa);
+void cpu_determinism_report();
+void execute_cpu_solver(bool display = true);
+void get_result_from_cpu_solver();
+void release_cpu_solver();
 // Functions to set up transformation matrices
 void init_mat();
 void set_view_mat();
@@ -0,0 +1,46 @@
+#ifndef CONSTRAINT_GRAPH_HPP
+#define CONSTRAINT_GRAPH_HPP 1
+
+#include "vector.hpp"
+#include <vector>
+
+//
+//	Constraint Graph
+//	Distance constraints of an arbitrary triangle mesh in compressed sparse
+//	rows. Every edge of the faces is a stretch constraint, and every edge
+//	shared by exactly two faces adds a bending constraint between the two
+//	vertices opposite it. The constraints of vertex v are entries
+//	offsets[v] .. offsets[v+1] of neighbors and rest, sorted by neighbour;
+//	each one is listed at both of its ends, so a Jacobi sweep only gathers.
+//	The rest lengths are the distances in the mesh as given. The faces
+//	around every vertex are listed the same way, for the vertex normals.
+//
+class ConstraintGraph {
+public:
+	ConstraintGraph(const std::vector<Vec3f>& vertices, const std::vector<Vec3i>& faces);
+
+	int size() const { return int(first.size()) - 1; }
+	int edges() const { return edge_count; }
+	int bends() const { return bend_count; }
+	int max_degree() const;
+	float mean_edge() const { return edge_mean; }
+
+	const std::vector<int>& offsets() const { return first; }
+	const std::vector<int>& neighbors() const { return adjacent; }
+	const std::vector<float>& rest() const { return lengths; }
+
+	// faces() of vertex v are entries face_offsets[v] .. face_offsets[v+1]
+	// of face_list, faces() holds three vertex indices per face
+	const std::vector<int>& face_offsets() const { return face_first; }
+	const std::vector<int>& face_list() const { return incident; }
+	const std::vector<int>& faces() const { return corners; }
+
+private:
+	int edge_count, bend_count;
+	float edge_mean;
+	std::vector<int> first, adjacent;
+	std::vector<float> lengths;
+	std::vector<int> face_first, incident, corners;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef QUADRATIC_BENDING_HPP
+#define QUADRATIC_BENDING_HPP 1
+
+#include "vector.hpp"
+#include <map>
+#include <vector>
+
+//
+//	Quadratic Bending
+//	Isometric bending energy of a triangle mesh, E = 1/2 x^T Q x per axis,
+//	after Bergou et al. Every edge shared by two faces adds 3 / (A0 + A1)
+//	K K^T over its two ends and the two vertices opposite it, where K holds
+//	the cotangent weights of the edge and A0, A1 are the face areas. Q only
+//	depends on the rest shape, so it is built once and stays valid as long
+//	as the cloth bends without stretching. Its rows sum to 0: the energy
+//	ignores rigid motions and every flat configuration.
+//
+class QuadraticBending {
+public:
+	QuadraticBending(const std::vector<Vec3f>& vertices, const std::vector<Vec3i>& faces);
+
+	int size() const { return int(rows.size()); }
+
+	// Q_vu / Q_vv, 0 when u is not coupled to v or v has no bending edge
+	float weight(int v, int u) const;
+
+	// Weights of the stencil for every bend_class of a row x col grid with
+	// rest distances dx and dy, QUADRATIC_BEND_TERMS per class in the order
+	// of bend_di and bend_dj in kernels.cl
+	static std::vector<float> grid_table(int row, int col, float dx, float dy);
+
+private:
+	std::vector<std::map<int, double>> rows;
+};
+
+#endif
@@ -34,6 +34,8 @@
 #include <cassert>
 #include <cmath>
 #include <iostream>
+#include <map>
+#include <tuple>
 
 //
 //	Triangle Mesh Class
@@ -50,6 +52,8 @@ public:
 	std::vector<Vec3f> colors;
 	std::vector<Vec3i> faces;
 	std::vector<Vec2f> uvs;
+	bool faces_dirty;
+	std::vector<size_t> dirty_faces;
 
 	Vec3f scalingVec;
 	Vec3f translatingVec;
@@ -63,6 +67,11 @@ public:
 	void bindElementBuffers();
 	void unbindElementBuffers();
 
+	// The index buffer is uploaded whole after faces_changed(), otherwise
+	// only the slots passed to face_changed() since the last draw
+	void faces_changed() { faces_dirty = true; }
+	void face_changed(size_t slot) { dirty_faces.push_back(slot); }
+
 	// Create texture
 	void bindTexture(std::string file);
 
@@ -80,6 +89,11 @@ public:
 	// Loads an OBJ file
 	bool load_obj( std::string file );
 
+	// Merges the vertices at the same position, which load_obj gives every
+	// face of its own, in the order the faces first use them. The normals
+	// and uvs are cleared.
+	void weld();
+
 	// Prints details about the mesh
 	void print_details();
 	void print_AABB_size();
@@ -0,0 +1,77 @@
+#ifndef WORK_GROUP_TUNER_HPP
+#define WORK_GROUP_TUNER_HPP 1
+
+#include <CL/cl.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+// Work-group shape of a 2D launch, {0, 0} leaves the choice to the driver
+struct WorkGroup {
+	size_t x, y;
+};
+
+// Tuned launch of one kernel
+struct LaunchConfig {
+	int variant;		// index of the winning TuneVariant
+	WorkGroup local;
+
+	// Global size padded to whole work-groups, the kernels skip the padding
+	void global_size(size_t width, size_t height, size_t* global) const;
+	// Local size argument of clEnqueueNDRangeKernel
+	const size_t* local_size() const;
+};
+
+// One way of running a kernel, e.g. the plain and the tiled constraint
+struct TuneVariant {
+	cl_kernel kernel;
+	std::vector<WorkGroup> candidates = {};	// empty = default_candidates()
+	std::function<void(const WorkGroup&)> prepare = nullptr;	// sets arguments that depend on the shape
+};
+
+//
+//	Work-group Tuner
+//	tune() times every candidate work-group of every variant on the
+//	device and keeps the fastest. Winners are cached in a text file keyed
+//	by device name, driver version, build, kernel and NDRange size, so later
+//	runs on the same device and program start with the tuned configuration.
+//
+class WorkGroupTuner {
+public:
+	WorkGroupTuner(cl_device_id device, cl_command_queue queue, const std::string& cache_file);
+
+	// retune ignores the cached entries, and overwrites them on save()
+	void set_retune(bool retune) { this->retune = retune; }
+
+	// Everything besides the size that changes what the kernels cost: the
+	// build options, the kernel source and the modes. Only its hash is kept.
+	void set_build(const std::string& build);
+
+	// Looks name at width x height up in the cache, benchmarks otherwise.
+	// The kernels must have all their arguments set.
+	LaunchConfig tune(const std::string& name, const std::vector<TuneVariant>& variants,
+		size_t width, size_t height);
+
+	// Shapes from 1 to 256 work-items that fit kernel on the device
+	std::vector<WorkGroup> default_candidates(cl_kernel kernel) const;
+
+	bool save() const;
+
+	const std::string& device_key() const { return device; }
+
+private:
+	double time_launch(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height) const;
+	void load();
+
+	cl_device_id device_id;
+	cl_command_queue queue;
+	std::string cache_file;
+	std::string device;	// "<device name>\t<driver version>"
+	std::string build;	// hash of set_build(), hex
+	std::map<std::string, LaunchConfig> cache;
+	bool retune;
+	bool dirty;
+};
+
+#endif
@@ -0,0 +1,78 @@
+// Batched simulation, --batch, included by kernels.cl. Instance k is a
+// whole grid stored after the k grids before it in every buffer, and the
+// third NDRange dimension walks the instances, so one launch steps the
+// whole batch. The instances share the grid of ClothParams; tau, damping,
+// gravity and the pins come from their InstanceParams, the pins of
+// instance k are pins[pin_first..pin_first + pin_count) as vertex indices
+// within the grid. Verlet and Jacobi PBD sweeps only.
+
+size_t instance_base(ClothParams p)
+{
+    return get_global_id(2) * (size_t)((p.row + 1) * (p.col + 1));
+}
+
+// Prediction and the old position in one launch, every work-item only
+// touches its own vertex
+__kernel void batch_predict(__global position_t* old_positions,
+                            __global position_t* positions,
+                            __global position_t* new_position,
+                            ClothParams p,
+                            __global const InstanceParams* instances,
+                            __global const int* pins)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    if (i > p.row || j > p.col)
+        return;
+
+    InstanceParams inst = instances[get_global_id(2)];
+    size_t idx = instance_base(p) + index(i, j);
+    float3 x = load_position(positions, idx, p);
+    float3 prev = load_position(old_positions, idx, p);
+    store_position(old_positions, idx, x, p);
+    if (in_pins(pins + inst.pin_first, inst.pin_count, index(i, j))) {
+        store_position(new_position, idx, x, p);
+        return;
+    }
+
+    float dt = DELTA_TIME;
+    float3 gravity = {0.0f, -inst.gravity, 0.f};
+    store_position(new_position, idx, x + (1.f - inst.kd) * (x - prev) + gravity * dt * dt, p);
+}
+
+// Jacobi step of every instance, the same ping-pong as constraint
+__kernel void batch_constraint(__global position_t* new_position,
+                               __global position_t* positions,
+                               ClothParams p,
+                               __global const InstanceParams* instances,
+                               __global const int* pins,
+                               __global float* lambda,
+                               __constant float* bending)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    if (i > p.row || j > p.col)
+        return;
+
+    InstanceParams inst = instances[get_global_id(2)];
+    size_t idx = instance_base(p) + index(i, j);
+    if (in_pins(pins + inst.pin_first, inst.pin_count, index(i, j))) {
+        store_position(positions, idx, load_position(new_position, idx, p), p);
+        return;
+    }
+    p.tau = inst.tau;
+    store_position(positions, idx, solve_stencil_stored(new_position, p, i, j, idx, p.col + 1, lambda, bending, 0), p);
+}
+
+__kernel void batch_normals(__global position_t* positions,
+                            __global normal_t* normals,
+                            ClothParams p)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    if (i > p.row || j > p.col)
+        return;
+
+    size_t base = instance_base(p);
+    store_normal(normals, base + index(i, j), vertex_normal(positions + base * POSITION_ELEMENTS, p, i, j));
+}
@@ -0,0 +1,54 @@
+#ifndef _CLOTH_PARAMS_HPP
+#define _CLOTH_PARAMS_HPP
+
+// Runtime description of the cloth grid.
+// Shared by the host and kernels.cl and passed to every kernel by value,
+// so the same program can simulate any grid size without being rebuilt.
+typedef struct {
+	int row;		// number of quads along each side
+	int col;
+	float dx;		// rest distance between neighbouring columns
+	float dy;		// rest distance between neighbouring rows
+	int pin_count;	// number of entries in the pins buffer
+	float tau;		// fraction of the constraint error corrected per sweep
+	int xpbd;		// compliance based constraints instead of tau
+	float alpha_stretch;	// XPBD compliance / dt^2 of the +-1 row and column constraints
+	float alpha_shear;	// of the diagonals
+	float alpha_bend;	// of the +-2 diagonals
+	float time_step;	// of the implicit integrator, DELTA_TIME for Verlet
+	float k_stretch;	// implicit spring stiffness of the +-1 row and column springs
+	float k_shear;	// of the diagonals
+	float k_bend;	// of the +-2 diagonals
+	int projective;	// Projective Dynamics local step in the stencil, weights k_*
+	int rest_tiles;	// work-groups walk the tile list of rest detection, see grid_vertex
+	float origin[3];	// --storage compact: position of the fixed point value 0
+	float quantum[3];	// and the step of one unit, per axis
+	float quadratic_bend;	// --bending quadratic: QUADRATIC_BEND, 0 keeps the +-2 diagonals
+	float tear_strain;	// --tear: stretch past which a constraint snaps, 0 never
+	int aerodynamics;	// --wind: drag and lift of the faces in update_position
+	float wind[3];	// velocity of the air
+} ClothParams;
+
+// Parameters of one cloth of --batch, see batch.cl
+typedef struct {
+	float tau;		// replaces ClothParams tau
+	float kd;		// damping of the Verlet velocity
+	float gravity;
+	int pin_first;	// first entry of the instance in the batch pins buffer
+	int pin_count;
+} InstanceParams;
+
+// Kinematic target of one pin, see pin_targets in kernels.cl. The vertex
+// follows the curve from start at time t0 to end at t1 of simulated time,
+// and stays at end after it. A target is a single segment; longer paths
+// start a new segment from where the pin is, as move_pins does.
+typedef struct {
+	int vertex;
+	int curve;		// PIN_CURVE_LINEAR or PIN_CURVE_EASE
+	float t0;
+	float t1;
+	float start[3];
+	float end[3];
+} PinTarget;
+
+#endif
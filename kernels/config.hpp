@@ -2,6 +2,8 @@
 #define _CONFIG_HPP
 
 // cloth info
+// CLOTH_WIDTH, CLOTH_HEIGHT, CLOTH_ROW and CLOTH_COL are only the defaults,
+// the grid is chosen at runtime with --cloth and --cloth-size.
 #define _PINNED
 #define CLOTH_TOP 10.f
 
@@ -18,17 +20,101 @@
 #endif
 
 #define DELTA_TIME (1.0f / 60.0f)
+#define MAX_FRAME_TIME 0.25f	// longest frame fed to the step accumulator, in seconds
+#define STEP_BUDGET 12.f	// milliseconds of stepping per rendered frame
 #define GRAVITY 5.f
 #define TAU 0.010f	// stiffness - Carpet
 //#define TAU 0.115f	// stiffness - Carpet
 //#define TAU 0.015f	// stiffness - Tablecloth
 //#define TAU 0.003f	// stiffness -  Swimming suit
 #define SOLVER_ITERATIONS 9
+// Adaptive iteration count of the Jacobi sweeps, off unless --tolerance. Every
+// ADAPTIVE_CHECK_INTERVAL sweeps the largest vertex correction of the last
+// sweep, relative to the rest distance, is compared against the tolerance;
+// the sweeps stop below it or at ADAPTIVE_MAX_ITERATIONS.
+#define ADAPTIVE_TOLERANCE 3e-4f
+#define ADAPTIVE_CHECK_INTERVAL 3
+#define ADAPTIVE_MAX_ITERATIONS (3 * SOLVER_ITERATIONS)
+// Rest detection of the Jacobi sweeps, --rest. Tiles of REST_TILE x REST_TILE
+// vertices whose largest displacement per step, relative to the rest
+// distance, stays below REST_THRESHOLD for REST_FRAMES steps fall asleep;
+// only awake tiles and their neighbours are dispatched.
+#define REST_TILE 8
+#define REST_THRESHOLD 3e-4f
+#define REST_FRAMES 30
+// --storage compact: bits per axis of the fixed point positions, three fit
+// in 64, and the steps compared against the float3 build at startup
+#define STORAGE_FIXED_BITS 21
+#define STORAGE_REPORT_STEPS 120
+// --deterministic: steps of the run-to-run comparison at startup
+#define DETERMINISM_REPORT_STEPS 120
+// --topology csr: % over the stencil kernels above which the startup report warns
+#define CSR_MAX_OVERHEAD 20.0
+// Chebyshev acceleration of the Jacobi sweeps, enabled with --chebyshev RHO
+#define CHEBYSHEV_RHO 0.95f	// estimated spectral radius of one Jacobi sweep, 0.99 diverges
+#define CHEBYSHEV_GAMMA 0.9f	// under-relaxation of every sweep
+#define CHEBYSHEV_DELAY 2	// plain sweeps before the weight schedule starts
+// Geometric multigrid, --solver multigrid. Each coarse level halves the grid,
+// rounding odd sides up, while both sides stay at least MULTIGRID_MIN_SIDE
+// quads long.
+#define MULTIGRID_CYCLES 2	// V-cycles per step
+#define MULTIGRID_SMOOTH_SWEEPS 2	// Jacobi sweeps before restricting and after prolongating
+#define MULTIGRID_COARSE_SWEEPS 8	// Jacobi sweeps on the coarsest grid
+#define MULTIGRID_MIN_SIDE 4
+#define MULTIGRID_RESTRICT_WEIGHT 2.f	// of the fine sweep fed to the coarse grid, 3 and up diverge
+// XPBD material, compliance (inverse stiffness) of each constraint family.
+// The result no longer depends on the iteration count, only its accuracy.
+#define XPBD_SOLVER_ITERATIONS 3
+#define XPBD_STRETCH_COMPLIANCE 5e-4f
+#define XPBD_SHEAR_COMPLIANCE 5e-4f
+#define XPBD_BEND_COMPLIANCE 5e-3f
+#define XPBD_OMEGA 1.5f	// over-relaxation of the averaged vertex correction
+#define XPBD_CONSTRAINTS 12	// multipliers per vertex, one per stencil neighbour
+// Spring material of the implicit integrator and of Projective Dynamics,
+// one spring per constraint stencil neighbour
+#define SPRING_STRETCH_STIFFNESS 3000.f	// per unit vertex mass
+#define SPRING_SHEAR_STIFFNESS 1000.f
+#define SPRING_BEND_STIFFNESS 100.f
+// Quadratic bending, --bending quadratic: the constant isometric bending
+// operator of QuadraticBending replaces the +-2 diagonal folds of the stencil.
+// A sweep applies QUADRATIC_BEND of the step to the minimum of the operator,
+// as stiff as the four folds it replaces, each correcting TAU of its
+// violation per sweep; 0.7 and up diverge.
+#define QUADRATIC_BEND (4.f * TAU)
+#define QUADRATIC_BEND_TERMS 12	// stencil weights per vertex, see bend_di and bend_dj
+#define QUADRATIC_BEND_CLASSES 81	// border distances told apart by bend_class
+// Tearing, --tear: a constraint stretched past TEAR_STRAIN times its rest
+// length snaps for good, see tear.cl
+#define TEAR_STRAIN 2.f	// the default grid hangs at up to 1.5 next to its pins
+#define TEAR_HEADER 4	// counters at the start of the tear buffer
+// Aerodynamics, --wind: pressure on the faces from the air moving past them,
+// per unit speed squared and face area over the rest area of a vertex (air
+// density and the coefficient over the areal density of the cloth)
+#define AERO_DRAG 0.05f	// along the relative wind
+#define AERO_LIFT 0.025f	// across it
+#define AERO_MAX_COST 10.0	// % of a step above which the startup report warns
+// Kinematic pins, see pin_targets: the curve a pin follows to its target
+#define PIN_CURVE_LINEAR 0
+#define PIN_CURVE_EASE 1	// smoothstep, no jolt at either end
+#define PIN_MOVE_TIME 0.25f	// seconds a pin key takes to slide the curtain rings
+// Implicit (backward Euler) integrator, --integrator implicit, solved with
+// Jacobi preconditioned conjugate gradients
+#define IMPLICIT_STEP_SCALE 4	// time step in DELTA_TIMEs, --step-scale
+#define IMPLICIT_CG_ITERATIONS 30
+#define IMPLICIT_CG_TOLERANCE 1e-3f	// residual norm, relative to the first one, that ends the solve
+// Projective Dynamics, --solver projective: local/global iterations per step
+// against the prefactored global system
+#define PD_ITERATIONS 4
+// Largest cloth of --solver projective, larger ones use jacobi. One work-group
+// runs the substitutions of the banded factor, which grows with ROW * COL^2
+// (about 1 GB at 512x512), and ClothBenchmark shows the springs do not reach
+// the constraint error of the jacobi sweeps at any size
+#define PROJECTIVE_MAX_VERTICES 4225	// 64x64 quads
 #define KD 0.02f	// damping constant - Carpet
 //#define KD 0.02f		// damping constant - Tablecloth
 //#define KD 0.015f	// damping constant - Shirt
 
-#define BLOCK_SIZE 1
+#define BLOCK_SIZE 0	// work-group side with --autotune off, 0 lets the driver choose
 
 #define SPHERE_SCALE 5.0f
 
@@ -0,0 +1,256 @@
+// Implicit (backward Euler) integrator, included by kernels.cl.
+// Springs run along the 12 constraint stencil neighbours and vertices have
+// unit mass. With h = p.time_step each step solves
+//     (I - h^2 K) dv = h (f + h K v),  K = df/dx
+// matrix-free: every product recomputes the spring Jacobians
+//     J = k (d d^T + c (I - d d^T)),  c = max(0, 1 - rest / length)
+// from the positions. Dropping the compressive part of c keeps the system
+// positive definite, and it is solved with Jacobi preconditioned CG. The
+// host enqueues a fixed number of CG iterations without reading anything
+// back; the scalars buffer carries the dot products between launches:
+//     [0] r.z of the first iteration, [1], [2] r.z ping-pong, [3] p.Ap
+// Once r.z falls below IMPLICIT_CG_TOLERANCE^2 of [0] the remaining
+// iterations leave dv alone.
+
+#define IMPLICIT_SPRINGS 12
+
+__constant int spring_di[IMPLICIT_SPRINGS] = { -1, 1, 0, 0, -1, 1, -1, 1, -2, 2, -2, 2 };
+__constant int spring_dj[IMPLICIT_SPRINGS] = { 0, 0, 1, -1, -1, -1, 1, 1, -2, -2, 2, 2 };
+
+float spring_rest(ClothParams p, int s)
+{
+    float diag = sqrt(p.dx * p.dx + p.dy * p.dy);
+    return s < 2 ? p.dy : s < 4 ? p.dx : s < 8 ? diag : 2.f * diag;
+}
+
+float spring_stiffness(ClothParams p, int s)
+{
+    return s < 4 ? p.k_stretch : s < 8 ? p.k_shear : p.k_bend;
+}
+
+// J w of the spring along e
+float3 spring_apply(float3 e, float rest, float k, float3 w)
+{
+    float len = length(e);
+    float3 d = len > 0.f ? e / len : (float3)(0.f, 0.f, 0.f);
+    float c = len > 0.f ? fmax(0.f, 1.f - rest / len) : 0.f;
+    return k * ((1.f - c) * dot(d, w) * d + c * w);
+}
+
+bool cg_frozen(__global const float* scalars, int slot)
+{
+    return scalars[slot] <= IMPLICIT_CG_TOLERANCE * IMPLICIT_CG_TOLERANCE * scalars[0];
+}
+
+// Right-hand side and preconditioner, the solve starts from dv = 0
+__kernel void implicit_prepare(__global const float3* old_positions,
+                               __global const float3* positions,
+                               __global float3* dv,
+                               __global float3* r,
+                               __global float3* z,
+                               __global float3* dir,
+                               __global float3* diag,
+                               ClothParams p,
+                               __global const float* weights)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    float3 zero = {0.f, 0.f, 0.f};
+    dv[idx] = zero;
+    if (is_pinned(weights, idx)) {
+        r[idx] = z[idx] = dir[idx] = zero;
+        diag[idx] = (float3)(1.f, 1.f, 1.f);
+        return;
+    }
+
+    float h = p.time_step;
+    float3 x = positions[idx];
+    float3 v = (x - old_positions[idx]) / h;
+    float3 f = {0.f, -GRAVITY, 0.f};
+    float3 kv = zero;
+    float3 g = zero;
+    for (int s = 0; s < IMPLICIT_SPRINGS; s++) {
+        int a = i + spring_di[s], b = j + spring_dj[s];
+        if (a < 0 || a > p.row || b < 0 || b > p.col)
+            continue;
+        size_t n = index(a, b);
+        float rest = spring_rest(p, s), k = spring_stiffness(p, s);
+        float3 e = positions[n] - x;
+        float len = length(e);
+        float3 d = len > 0.f ? e / len : zero;
+        float c = len > 0.f ? fmax(0.f, 1.f - rest / len) : 0.f;
+
+        f += k * (len - rest) * d;
+        // pinned neighbours do not move, their velocity is 0
+        float3 vn = is_pinned(weights, n) ? zero : (positions[n] - old_positions[n]) / h;
+        kv += spring_apply(e, rest, k, vn - v);
+        g += k * ((1.f - c) * d * d + c);
+    }
+
+    float3 rhs = h * (f + h * kv);
+    float3 dg = 1.f + h * h * g;
+    r[idx] = rhs;
+    diag[idx] = dg;
+    z[idx] = dir[idx] = rhs / dg;
+}
+
+// out = (I - h^2 K) in, pinned vertices are filtered out of the solve
+__kernel void implicit_multiply(__global const float3* in,
+                                __global float3* out,
+                                __global const float3* positions,
+                                ClothParams p,
+                                __global const float* weights)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    if (is_pinned(weights, idx)) {
+        out[idx] = (float3)(0.f, 0.f, 0.f);
+        return;
+    }
+
+    float3 x = positions[idx];
+    float3 u = in[idx];
+    float3 ku = {0.f, 0.f, 0.f};
+    for (int s = 0; s < IMPLICIT_SPRINGS; s++) {
+        int a = i + spring_di[s], b = j + spring_dj[s];
+        if (a < 0 || a > p.row || b < 0 || b > p.col)
+            continue;
+        size_t n = index(a, b);
+        ku += spring_apply(positions[n] - x, spring_rest(p, s), spring_stiffness(p, s), in[n] - u);
+    }
+    out[idx] = u - p.time_step * p.time_step * ku;
+}
+
+// Per work-group partial sums of a.b over count vertices, the work-items
+// stride over the whole range. scratch holds one float per work-item.
+__kernel void dot_partial(__global const float3* a,
+                          __global const float3* b,
+                          int count,
+                          __global float* partial,
+                          __local float* scratch)
+{
+    size_t lid = get_local_id(0);
+    size_t size = get_local_size(0);
+    float sum = 0.f;
+    for (size_t k = get_global_id(0); k < (size_t)count; k += get_global_size(0))
+        sum += dot(a[k], b[k]);
+    scratch[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t half = size / 2; half > 0; half /= 2) {
+        if (lid < half)
+            scratch[lid] += scratch[lid + half];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0)
+        partial[get_group_id(0)] = scratch[0];
+}
+
+// Sums the partials in a single work-group into scalars[slot]
+__kernel void dot_final(__global const float* partial,
+                        int count,
+                        __global float* scalars,
+                        int slot,
+                        __local float* scratch)
+{
+    size_t lid = get_local_id(0);
+    size_t size = get_local_size(0);
+    float sum = 0.f;
+    for (size_t k = lid; k < (size_t)count; k += size)
+        sum += partial[k];
+    scratch[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t half = size / 2; half > 0; half /= 2) {
+        if (lid < half)
+            scratch[lid] += scratch[lid + half];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0)
+        scalars[slot] = scratch[0];
+}
+
+// dv += alpha dir, r -= alpha q, z = r / diag with alpha = r.z / p.Ap
+__kernel void cg_step(__global float3* dv,
+                      __global float3* r,
+                      __global float3* z,
+                      __global const float3* dir,
+                      __global const float3* q,
+                      __global const float3* diag,
+                      __global const float* scalars,
+                      int rz_slot,
+                      ClothParams p)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    float pq = scalars[3];
+    if (cg_frozen(scalars, rz_slot) || pq <= 0.f)
+        return;
+
+    float alpha = scalars[rz_slot] / pq;
+    dv[idx] += alpha * dir[idx];
+    r[idx] -= alpha * q[idx];
+    z[idx] = r[idx] / diag[idx];
+}
+
+// dir = z + beta dir with beta = new r.z / old r.z
+__kernel void cg_direction(__global const float3* z,
+                           __global float3* dir,
+                           __global const float* scalars,
+                           int rz_slot,
+                           int rz_old_slot,
+                           ClothParams p)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    if (cg_frozen(scalars, rz_old_slot))
+        return;
+
+    dir[idx] = z[idx] + scalars[rz_slot] / scalars[rz_old_slot] * dir[idx];
+}
+
+// v = (1 - KD)^(h / DELTA_TIME) (v + dv), then the same sphere collision
+// as the constraints
+__kernel void implicit_finish(__global float3* old_positions,
+                              __global float3* positions,
+                              __global const float3* dv,
+                              ClothParams p,
+                              __global const float* weights)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    float3 x = positions[idx];
+    float3 output = x;
+    if (!is_pinned(weights, idx)) {
+        float h = p.time_step;
+        float damping = pow(1.f - KD, h / DELTA_TIME);
+        output += damping * (x - old_positions[idx] + h * dv[idx]);
+
+        float r = 5.5f;
+        float dist = fast_length((float4)(output, 1.f));
+        if (dist < r)
+            output -= output * ((dist - r) / dist);
+    }
+    old_positions[idx] = x;
+    positions[idx] = output;
+}
@@ -1,50 +1,314 @@
 #include "config.hpp"
+#include "cloth_params.hpp"
 
-#define index(i, j) j+(CLOTH_COL+1)*i
-#define offset(v_offset, h_offset) new_position[(CLOTH_COL+1)*(i+v_offset) + j+h_offset] 
+// --deterministic: no contraction into mad/fma, and length for fast_length,
+// whose precision is left to the implementation
+#ifdef DETERMINISTIC
+#pragma OPENCL FP_CONTRACT OFF
+#define fast_length(v) length(v)
+#endif
 
+#define index(i, j) (j)+(p.col+1)*(i)
 
-__kernel void update_position(__global float3* old_positions,
-                              __global float3* positions,
-                              __global float3* new_position)
+// Pin flag of every vertex, 0 holds it where it is and 1 leaves it free;
+// the free vertices all have unit mass, other values are not inverse masses.
+// The host changes the pins at runtime by writing this buffer alone, see
+// set_pin.
+bool is_pinned(__global const float* weights, size_t idx)
 {
-    int i = get_global_id(0);
-    int j = get_global_id(1);
+    return weights[idx] == 0.f;
+}
+
+// A pin list, for the solvers that build the pins in when they start: the
+// coarse grids of the multigrid, Projective Dynamics and the batch
+bool in_pins(__global const int* pins, int pin_count, size_t idx)
+{
+    for (int k = 0; k < pin_count; k++)
+        if (pins[k] == (int)idx)
+            return true;
+    return false;
+}
+
+// Storage of the Verlet state and the normals, --storage. The kernels
+// compute in float; position_t and normal_t are the buffer elements, a
+// vertex takes one float3 of each, three of each when PACKED_STORAGE is
+// defined, or one position_t and two normal_t when COMPACT_STORAGE is.
+#ifdef COMPACT_STORAGE
+// STORAGE_FIXED_BITS fixed point per axis, x = origin + quantum * s, packed
+// into one word and saturating at the ends of the range the host chose
+typedef ulong position_t;
+// Octahedral unit vectors, two snorm16
+typedef short normal_t;
+#define POSITION_ELEMENTS 1
+#define NORMAL_ELEMENTS 2
+
+#define FIXED_HALF (1 << (STORAGE_FIXED_BITS - 1))
+#define FIXED_MASK ((1ul << STORAGE_FIXED_BITS) - 1)
+
+float fixed_value(position_t w, int axis)
+{
+    return (float)((int)((w >> (axis * STORAGE_FIXED_BITS)) & FIXED_MASK) - FIXED_HALF);
+}
+
+position_t fixed_bits(float v, int axis)
+{
+    return (position_t)(clamp(convert_int_rte(v), -FIXED_HALF, FIXED_HALF - 1) + FIXED_HALF) << (axis * STORAGE_FIXED_BITS);
+}
+
+float3 load_position(__global const position_t* b, size_t idx, ClothParams p)
+{
+    position_t w = b[idx];
+    return (float3)(p.origin[0] + p.quantum[0] * fixed_value(w, 0),
+                    p.origin[1] + p.quantum[1] * fixed_value(w, 1),
+                    p.origin[2] + p.quantum[2] * fixed_value(w, 2));
+}
+
+void store_position(__global position_t* b, size_t idx, float3 x, ClothParams p)
+{
+    b[idx] = fixed_bits((x.x - p.origin[0]) / p.quantum[0], 0) |
+             fixed_bits((x.y - p.origin[1]) / p.quantum[1], 1) |
+             fixed_bits((x.z - p.origin[2]) / p.quantum[2], 2);
+}
+
+// n projected onto |x| + |y| + |z| = 1, the lower half folded over the upper
+void store_normal(__global normal_t* b, size_t idx, float3 n)
+{
+    float l1 = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    float ex = n.x / l1, ey = n.y / l1;
+    if (n.z < 0.f) {
+        float fx = (1.f - fabs(ey)) * (ex >= 0.f ? 1.f : -1.f);
+        ey = (1.f - fabs(ex)) * (ey >= 0.f ? 1.f : -1.f);
+        ex = fx;
+    }
+    vstore2(convert_short2_sat_rte((float2)(ex, ey) * 32767.f), idx, b);
+}
+#elif defined(PACKED_STORAGE)
+// Three floats without the padding of float3, 12 bytes instead of 16
+typedef float position_t;
+typedef float normal_t;
+#define POSITION_ELEMENTS 3
+#define NORMAL_ELEMENTS 3
+
+float3 load_position(__global const position_t* b, size_t idx, ClothParams p)
+{
+    return vload3(idx, b);
+}
+
+void store_position(__global position_t* b, size_t idx, float3 x, ClothParams p)
+{
+    vstore3(x, idx, b);
+}
+
+void store_normal(__global normal_t* b, size_t idx, float3 n)
+{
+    vstore3(n, idx, b);
+}
+#else
+typedef float3 position_t;
+typedef float3 normal_t;
+#define POSITION_ELEMENTS 1
+#define NORMAL_ELEMENTS 1
+
+float3 load_position(__global const position_t* b, size_t idx, ClothParams p)
+{
+    return b[idx];
+}
+
+void store_position(__global position_t* b, size_t idx, float3 x, ClothParams p)
+{
+    b[idx] = x;
+}
+
+void store_normal(__global normal_t* b, size_t idx, float3 n)
+{
+    b[idx] = n;
+}
+#endif
+
+// Vertex (i, j) of the work-item. With p.rest_tiles every work-group is a
+// REST_TILE x REST_TILE tile taken from the compacted list tiles[1..tiles[0]]
+// of rest detection; returns the tile, or -1 for the (whole) work-groups
+// past the end of the list.
+int grid_vertex(__global const int* tiles, ClothParams p, int* i, int* j)
+{
+    if (!p.rest_tiles) {
+        *i = get_global_id(0);
+        *j = get_global_id(1);
+        return 0;
+    }
+    int g = get_group_id(0);
+    if (g >= tiles[0])
+        return -1;
+    int t = tiles[1 + g];
+    int across = p.col / REST_TILE + 1;
+    *i = t / across * REST_TILE + get_local_id(0);
+    *j = t % across * REST_TILE + get_local_id(1);
+    return t;
+}
+
+// Work-group maximum of the non-negative c into *result, as float bits
+// (which order like ints) so it can use atomic_max. Every work-item of the
+// group has to call it.
+void record_max(__global int* result, __local int* group_max, float c)
+{
+    bool leader = get_local_id(0) == 0 && get_local_id(1) == 0;
+    if (leader)
+        *group_max = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    atomic_max(group_max, as_int(c));
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (leader)
+        atomic_max(result, *group_max);
+}
+
+// The XPBD multipliers start from zero every step
+void reset_lambda(__global float* lambda, ClothParams p, size_t idx)
+{
+    if (!p.xpbd)
+        return;
+    size_t n = (p.row + 1) * (p.col + 1);
+    for (int k = 0; k < XPBD_CONSTRAINTS; k++)
+        lambda[k * n + idx] = 0.f;
+}
+
+// Aerodynamics, --wind: the faces around a grid vertex are the fan between
+// these neighbours, each with the stencil term of its edge to the vertex
+__constant int fan_di[7] = { 1, 1, 0, -1, -1, 0, 1 };
+__constant int fan_dj[7] = { 0, 1, 1, 0, -1, -1, 0 };
+__constant int fan_term[7] = { 1, 7, 2, 0, 4, 3, 1 };
+
+// Force of the air moving at air relative to the face x0 x1 x2: the pressure
+// on the side facing the wind, with drag along the wind and lift across it
+float3 face_force(float3 x0, float3 x1, float3 x2, float3 air)
+{
+    float3 n = cross(x1 - x0, x2 - x0);
+    float twice_area = fast_length(n);
+    float speed = fast_length(air);
+    if (twice_area <= 0.f || speed <= 0.f)
+        return (float3)(0.f, 0.f, 0.f);
+    float3 d = air / speed;
+    n /= twice_area;
+    float c = dot(n, d);
+    if (c < 0.f) {
+        n = -n;
+        c = -c;
+    }
+    return (0.5f * twice_area * speed * speed * c) * (AERO_DRAG * d + AERO_LIFT * (n - c * d));
+}
+
+// Acceleration of vertex (i, j) by a third of the force on each face around
+// it. All three corners compute a face from the same state and get the same
+// force, so no face buffer and no atomics are needed. links drops the faces
+// along a snapped edge of the vertex, see holds.
+float3 aerodynamics(__global position_t* positions, __global position_t* old_positions,
+                    ClothParams p, int i, int j, int links)
+{
+    float3 wind = (float3)(p.wind[0], p.wind[1], p.wind[2]);
+    size_t idx = index(i, j);
+    float3 x = load_position(positions, idx, p);
+    float3 v = x - load_position(old_positions, idx, p);
+    float3 force = {0.0f, 0.0f, 0.0f};
+    for (int f = 0; f < 6; f++) {
+        int ia = i + fan_di[f], ja = j + fan_dj[f];
+        int ib = i + fan_di[f + 1], jb = j + fan_dj[f + 1];
+        if (ia < 0 || ia > p.row || ja < 0 || ja > p.col || ib < 0 || ib > p.row || jb < 0 || jb > p.col ||
+            !((links >> fan_term[f]) & 1) || !((links >> fan_term[f + 1]) & 1))
+            continue;
+        float3 xa = load_position(positions, index(ia, ja), p);
+        float3 xb = load_position(positions, index(ib, jb), p);
+        float3 va = xa - load_position(old_positions, index(ia, ja), p);
+        float3 vb = xb - load_position(old_positions, index(ib, jb), p);
+        force += face_force(x, xa, xb, wind - (v + va + vb) / (3.f * DELTA_TIME));
+    }
+    // unit mass per rest area of the grid
+    return force / (3.f * p.dx * p.dy);
+}
+
+// Moves the pinned vertices along their curves, one work-item per pin. The
+// weights keep every solver off them, so the host only launches this while
+// a curve is moving.
+__kernel void pin_targets(__global position_t* positions,
+                          ClothParams p,
+                          __global const PinTarget* targets,
+                          int count,
+                          float time)
+{
+    int k = get_global_id(0);
+    if (k >= count)
+        return;
+
+    PinTarget t = targets[k];
+    float s = t.t1 > t.t0 ? clamp((time - t.t0) / (t.t1 - t.t0), 0.f, 1.f) : 1.f;
+    if (t.curve == PIN_CURVE_EASE)
+        s = s * s * (3.f - 2.f * s);
+    float3 start = (float3)(t.start[0], t.start[1], t.start[2]);
+    float3 end = (float3)(t.end[0], t.end[1], t.end[2]);
+    store_position(positions, t.vertex, start + (end - start) * s, p);
+}
+
+__kernel void update_position(__global position_t* old_positions,
+                              __global position_t* positions,
+                              __global position_t* new_position,
+                              ClothParams p,
+                              __global const float* weights,
+                              __global const int* tiles,
+                              __global const int* tear)
+{
+    int i, j;
+    if (grid_vertex(tiles, p, &i, &j) < 0)
+        return;
     size_t idx = index(i, j);
-    if (i < 0 || j < 0 || i > CLOTH_ROW || j > CLOTH_COL)
+    if (i < 0 || j < 0 || i > p.row || j > p.col)
         return;
     
-#ifdef _PINNED
-    if (idx == 0 || idx == 4 || idx == 9 || idx == 14 || idx == 19)
-        new_position[idx] = positions[idx];
-#endif
+    float3 x = load_position(positions, idx, p);
+    if (is_pinned(weights, idx)) {
+        store_position(new_position, idx, x, p);
+        return;
+    }
 
     float dt = DELTA_TIME;
     float3 gravity = {0.0f, -GRAVITY, 0.f};
     float kd = KD;
 
-    float3 vel = (1.f - kd) * (positions[idx] - old_positions[idx]);
+    float3 vel = (1.f - kd) * (x - load_position(old_positions, idx, p));
     float3 acc = gravity*dt*dt;
+    if (p.aerodynamics)
+        acc += aerodynamics(positions, old_positions, p, i, j,
+                            p.tear_strain > 0.f ? tear[TEAR_HEADER + idx] : -1) * dt * dt;
     
-    new_position[idx] = positions[idx] + vel + acc;
+    store_position(new_position, idx, x + vel + acc, p);
 }
 
-__kernel void update_old_position(__global float3* old_positions,
-                                  __global float3* positions)
+// With rest detection it also records the displacement of the last step
+// per tile in tile_motion
+__kernel void update_old_position(__global position_t* old_positions,
+                                  __global position_t* positions,
+                                  ClothParams p,
+                                  __global float* lambda,
+                                  __global const int* tiles,
+                                  __global int* tile_motion)
 {
-    int i = get_global_id(0);
-    int j = get_global_id(1);
-    size_t idx = index(i, j);
-    
-    if (i < 0 || j < 0 || i > CLOTH_ROW || j > CLOTH_COL)
+    __local int group_max;
+    int i, j;
+    int t = grid_vertex(tiles, p, &i, &j);
+    if (t < 0)
         return;
-    
-    old_positions[idx] = positions[idx];
+    size_t idx = index(i, j);
+
+    float motion = 0.f;
+    if (i <= p.row && j <= p.col) {
+        float3 x = load_position(positions, idx, p);
+        motion = fast_length(x - load_position(old_positions, idx, p));
+        store_position(old_positions, idx, x, p);
+        reset_lambda(lambda, p, idx);
+    }
+    if (p.rest_tiles)
+        record_max(tile_motion + t, &group_max, motion);
 }
 
-float3 dynamic_inverse(float3 first, float3 second, float restDist)
+float3 dynamic_inverse(float3 first, float3 second, float restDist, float tau)
 {
-    float tau = TAU;
 
     float3 v = second - first;
     float dist = fast_length((float4)(v, 1.f));  // distance from first to second
@@ -52,103 +316,453 @@ float3 dynamic_inverse(float3 first, float3 second, float restDist)
     return tau*deformationRate*v;
 }
 
-__kernel void constraint(__global float3* new_position,
-                         __global float3* positions)
+// XPBD: lambda is this vertex's copy of the multiplier of the constraint,
+// the other end keeps its own, so only Jacobi sweeps, where both ends see the
+// same state, may use it. Unit masses at both ends. The step of the
+// multiplier goes to dlambda; the stencil adds it to lambda scaled like the
+// position correction, see STENCIL_NAME.
+float3 compliant_inverse(float3 first, float3 second, float restDist, float alpha, float lambda, float* dlambda)
+{
+    float3 v = second - first;
+    float dist = fast_length(v);
+    if (dist < 1e-6f)
+        return (float3)(0.f, 0.f, 0.f);
+    *dlambda = (restDist - dist - alpha * lambda) / (2.f + alpha);
+    return -*dlambda / dist * v;
+}
+
+// Projective Dynamics: weight times the spring from first to second
+// projected to its rest length
+float3 projective_target(float3 first, float3 second, float restDist, float weight)
+{
+    float3 v = second - first;
+    float dist = length(v);
+    if (dist <= 0.f)
+        return (float3)(0.f, 0.f, 0.f);
+    return (weight * restDist / dist) * v;
+}
+
+// Chebyshev semi-iterative mix of the Jacobi iterate x computed from cur with
+// prev, the iterate before cur. omega comes from the host schedule.
+float3 chebyshev(float3 x, float3 cur, float3 prev, float omega)
 {
+    return omega * (CHEBYSHEV_GAMMA * (x - cur) + cur - prev) + prev;
+}
+
+// Adaptive iteration count: measuring sweeps record the largest correction
+// |x - prev| of a free vertex relative to the shorter rest distance in
+// correction[0] with record_max, the host reads back that single float.
+float relative_correction(float3 x, float3 prev, ClothParams p)
+{
+    return fast_length(x - prev) / fmin(p.dx, p.dy);
+}
+
+// --bending quadratic: neighbours of the bending operator on the grid, the
+// 3x3 block and the knight moves along the triangle diagonals, in the order
+// of the weights of QuadraticBending::grid_table
+__constant int bend_di[QUADRATIC_BEND_TERMS] = { -1, 1, 0, 0, -1, 1, -1, 1, -2, -1, 1, 2 };
+__constant int bend_dj[QUADRATIC_BEND_TERMS] = { 0, 0, 1, -1, -1, -1, 1, 1, -1, -2, 2, 1 };
+
+// The weights of a vertex only depend on its distance to each border, up to 2
+int bend_class(ClothParams p, int i, int j)
+{
+    return (3 * min(i, 2) + min(p.row - i, 2)) * 9 + 3 * min(j, 2) + min(p.col - j, 2);
+}
+
+// --tear: whether stencil term k of a vertex still holds. links has a bit per
+// term, stretching the constraint past strain clears it for good. Both ends
+// of a constraint see the same Jacobi state and snap in the same sweep.
+bool holds(int* links, int k, float3 first, float3 second, float restDist, float strain)
+{
+    if (!((*links >> k) & 1))
+        return false;
+    if (strain <= 0.f || fast_length(second - first) <= strain * restDist)
+        return true;
+    *links &= ~(1 << k);
+    return false;
+}
+
+// Terms along the edges of the faces: up, down, right, left and the diagonal
+// build_fabric splits the quads along
+#define TEAR_FACE_TERMS ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << 7))
+
+// Stores the links of vertex (i, j) and logs the face edges among the terms
+// that just snapped for tear_faces, 12 idx + k. Both ends log an edge, so
+// the log after the links needs 6 entries per vertex at most.
+void record_tears(__global int* tear, ClothParams p, int i, int j, int links, int snapped)
+{
+    int n = (p.row + 1) * (p.col + 1);
+    int idx = index(i, j);
+    tear[TEAR_HEADER + idx] = links;
+    for (int k = 0; k < 12; k++)
+        if (((snapped & TEAR_FACE_TERMS) >> k) & 1)
+            tear[TEAR_HEADER + n + atomic_inc(tear)] = 12 * idx + k;
+}
+
+// Stencil projection reading the grid from global memory
+#define STENCIL_NAME solve_stencil
+#define STENCIL_SPACE __global
+#include "stencil.cl"
+
+// Stencil projection reading a tile from local memory
+#define STENCIL_NAME solve_stencil_local
+#define STENCIL_SPACE __local
+#include "stencil.cl"
+
+// Stencil projection reading the stored positions of the Verlet state
+#define STENCIL_NAME solve_stencil_stored
+#define STENCIL_SPACE __global
+#define STENCIL_TYPE position_t
+#define STENCIL_LOAD(k) load_position(src, k, p)
+#include "stencil.cl"
+
+// Rest detection: a tile that moved less than REST_THRESHOLD of the rest
+// distance for REST_FRAMES steps sleeps. wake 1 wakes the tiles holding a
+// pin, 2 every tile. One work-item per tile.
+__kernel void rest_classify(__global int* tile_motion,
+                            __global int* tile_quiet,
+                            ClothParams p,
+                            int wake,
+                            __global const int* pins)
+{
+    int t = get_global_id(0);
+    int across = p.col / REST_TILE + 1;
+    if (t >= (p.row / REST_TILE + 1) * across)
+        return;
+
+    float motion = as_float(tile_motion[t]);
+    tile_motion[t] = 0;
+    int quiet = motion < REST_THRESHOLD * fmin(p.dx, p.dy) ? min(tile_quiet[t] + 1, REST_FRAMES) : 0;
+    if (wake == 2)
+        quiet = 0;
+    for (int k = 0; wake == 1 && k < p.pin_count; k++) {
+        int i = pins[k] / (p.col + 1), j = pins[k] % (p.col + 1);
+        if (i / REST_TILE * across + j / REST_TILE == t)
+            quiet = 0;
+    }
+    tile_quiet[t] = quiet;
+}
+
+// Lists the tiles that are awake or next to one in tiles[1..], tiles[0]
+// must be 0 and ends up holding the count. The list order does not matter,
+// every tile is computed the same way wherever it lands.
+__kernel void rest_compact(__global const int* tile_quiet,
+                           __global int* tiles,
+                           ClothParams p)
+{
+    int t = get_global_id(0);
+    int down = p.row / REST_TILE + 1;
+    int across = p.col / REST_TILE + 1;
+    if (t >= down * across)
+        return;
+
+    int ti = t / across, tj = t % across;
+    bool live = false;
+    for (int a = max(0, ti - 1); a <= min(down - 1, ti + 1); a++)
+        for (int b = max(0, tj - 1); b <= min(across - 1, tj + 1); b++)
+            live = live || tile_quiet[a * across + b] < REST_FRAMES;
+    if (live)
+        tiles[1 + atomic_inc(tiles)] = t;
+}
+
+// new_position back to positions over the listed tiles, like the copy the
+// host enqueues without rest detection
+__kernel void copy_tiles(__global const position_t* new_position,
+                         __global position_t* positions,
+                         ClothParams p,
+                         __global const int* tiles)
+{
+    int i, j;
+    if (grid_vertex(tiles, p, &i, &j) < 0 || i > p.row || j > p.col)
+        return;
+    size_t idx = index(i, j);
+    store_position(positions, idx, load_position(new_position, idx, p), p);
+}
+
+// Jacobi step: reads every neighbour from new_position, writes positions.
+// positions still holds the iterate before new_position, omega > 0 mixes it
+// in as Chebyshev acceleration. measure != 0 records the corrections of the
+// sweep in correction[0], see relative_correction.
+__kernel void constraint(__global position_t* new_position,
+                         __global position_t* positions,
+                         ClothParams p,
+                         __global const float* weights,
+                         __global float* lambda,
+                         float omega,
+                         __global int* correction,
+                         int measure,
+                         __global const int* tiles,
+                         __constant float* bending,
+                         __global int* tear)
+{
+    __local int group_max;
+    int i, j;
+    if (grid_vertex(tiles, p, &i, &j) < 0)
+        return;
+    size_t idx = index(i, j);
+
+    // No early return, measuring sweeps reach the barriers with every work-item
+    float c = 0.f;
+    if (i <= p.row && j <= p.col && !is_pinned(weights, idx)) {
+        float3 cur = load_position(new_position, idx, p);
+        float3 x = solve_stencil_stored(new_position, p, i, j, idx, p.col + 1, lambda + idx, bending, tear);
+        if (omega > 0.f)
+            x = chebyshev(x, cur, load_position(positions, idx, p), omega);
+        store_position(positions, idx, x, p);
+        if (measure)
+            c = relative_correction(x, cur, p);
+    }
+    if (measure)
+        record_max(correction, &group_max, c);
+}
+
+// Jacobi step through local memory: each work-group loads its tile plus the
+// +-2 halo of the stencil once, then every work-item reads its 12 neighbours
+// from the tile. tile must hold (local size 0 + 4) * (local size 1 + 4) entries.
+__kernel void constraint_tiled(__global position_t* new_position,
+                               __global position_t* positions,
+                               ClothParams p,
+                               __global const float* weights,
+                               __local float3* tile,
+                               __global float* lambda,
+                               float omega,
+                               __global int* correction,
+                               int measure,
+                               __constant float* bending,
+                               __global int* tear)
+{
+    __local int group_max;
     int i = get_global_id(0);
     int j = get_global_id(1);
+    int li = get_local_id(0);
+    int lj = get_local_id(1);
+    int bi = get_local_size(0);
+    int bj = get_local_size(1);
+    int w = bj + 4;
+
+    // Cooperative load, halo cells outside the cloth are clamped and never read
+    int i0 = get_group_id(0) * bi - 2;
+    int j0 = get_group_id(1) * bj - 2;
+    for (int k = li * bj + lj; k < (bi + 4) * w; k += bi * bj) {
+        int ti = clamp(i0 + k / w, 0, p.row);
+        int tj = clamp(j0 + k % w, 0, p.col);
+        tile[k] = load_position(new_position, index(ti, tj), p);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // The global size is padded to whole tiles
     size_t idx = index(i, j);
+    float correct = 0.f;
+    if (i <= p.row && j <= p.col && !is_pinned(weights, idx)) {
+        int c = (li + 2) * w + lj + 2;
+        float3 x = solve_stencil_local(tile, p, i, j, c, w, lambda + idx, bending, tear);
+        if (omega > 0.f)
+            x = chebyshev(x, tile[c], load_position(positions, idx, p), omega);
+        store_position(positions, idx, x, p);
+        if (measure)
+            correct = relative_correction(x, tile[c], p);
+    }
+    if (measure)
+        record_max(correction, &group_max, correct);
+}
 
-#ifdef _PINNED
-    if (i < 0 || j < 0 || i > CLOTH_ROW || j > CLOTH_COL ||
-        idx == 0 || idx == 4 || idx == 9 || idx == 14 || idx == 19)
+// Multigrid: coarse grids keep every other row and column of the grid above
+// them (p is the coarse grid, fp the one above), and the last one of an odd
+// side, see fine_of. With S the Jacobi step and
+// x1, x2 = S(x1) the last two iterates of the grid above, a coarse grid
+// starts from R x2 and sweeps y <- S(y) + force, where
+//     force = w R(x2 - x1) - (S(R x1) - R x1),  w = MULTIGRID_RESTRICT_WEIGHT
+// so that R x1 stands still once the grid above has converged.
+
+// Row or column of the grid above under coarse row or column c. An odd side
+// of n quads has (n + 1) / 2 coarse ones, the last of which spans a single
+// quad above; the forcing term keeps R x1 still there all the same.
+int fine_of(int c, int fine_side)
+{
+    return min(2 * c, fine_side);
+}
+
+// Injects x1 into the coarse grid, the first sweep then computes S(R x1)
+__kernel void restrict_level(__global const float3* fine_prev,
+                             ClothParams fp,
+                             __global float3* new_position,
+                             __global float3* positions,
+                             __global float3* restricted,
+                             __global float3* force,
+                             ClothParams p)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    if (i > p.row || j > p.col)
         return;
-#else
-    if (i < 0 || j < 0 || i > CLOTH_ROW || j > CLOTH_COL)
+
+    size_t idx = index(i, j);
+    float3 x1 = fine_prev[fine_of(i, fp.row) * (fp.col + 1) + fine_of(j, fp.col)];
+    new_position[idx] = positions[idx] = restricted[idx] = x1;
+    force[idx] = (float3)(0.f, 0.f, 0.f);
+}
+
+// Forcing term from S(R x1) in positions, and the start y = R x2
+__kernel void restrict_force(__global const float3* fine_prev,
+                             __global const float3* fine,
+                             ClothParams fp,
+                             __global float3* new_position,
+                             __global float3* positions,
+                             __global const float3* restricted,
+                             __global float3* force,
+                             ClothParams p)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    if (i > p.row || j > p.col)
         return;
-#endif
-    
-    float3 output = new_position[idx];
-    //printf("new_position = %2.2v3hlf\n", output);
 
-    float3 delta = {0.0f, 0.0f, 0.0f};
-    
-    
-	const float dx = CLOTH_WIDTH / CLOTH_COL;
-    const float dy = CLOTH_HEIGHT / CLOTH_ROW;
-
-	if (i > 0)
-        delta += dynamic_inverse(output, offset(-1,  0), dy);
-	if (i < (CLOTH_ROW))
-		delta += dynamic_inverse(output, offset(+1,  0), dy);
-	if (j < (CLOTH_COL))
-		delta += dynamic_inverse(output, offset( 0, +1), dx);
-	if (j > 0)
-		delta += dynamic_inverse(output, offset( 0, -1), dx);
-    
-	const float diagl = sqrt(dy*dy + dx*dx);
-    
-	if (i > 0 && j > 0)
-		delta += dynamic_inverse(output, offset(-1, -1), diagl);
-	if (i < (CLOTH_ROW) && j > 0)
-		delta += dynamic_inverse(output, offset(+1, -1), diagl);
-	if (i > 0 && j < (CLOTH_COL))
-		delta += dynamic_inverse(output, offset(-1, +1), diagl);
-	if (i < (CLOTH_ROW) && j < (CLOTH_COL))
-		delta += dynamic_inverse(output, offset(+1, +1), diagl);
-	
-	const float dblDiagl = 2.0f * diagl;
-    
-	if (i > 1 && j > 1)
-		delta += dynamic_inverse(output, offset(-2, -2), dblDiagl);
-	if (i < (CLOTH_ROW-1) && j > 1)
-		delta += dynamic_inverse(output, offset(+2, -2), dblDiagl);
-	if (i > 1 && j < (CLOTH_COL-1))
-		delta += dynamic_inverse(output, offset(-2, +2), dblDiagl);
-	if (i < (CLOTH_ROW-1) && j < (CLOTH_COL-1))
-		delta += dynamic_inverse(output, offset(+2, +2), dblDiagl);
-
-	output += delta;
-
-    // COLLISION DETECTION
-//#ifndef _PINNED
-    float r = 5.5f;
-    float3 o = {0.0f, 0.0f, 0.0f};
-    
-    float3 v = o - output;
-    float dist = fast_length((float4)(v, 1.f));
-    if (dist < r)
-    {
-        float diff = (dist - r) / dist;
-        output += v * diff;
-    }
-//#endif
-    positions[idx] = output;
+    size_t idx = index(i, j);
+    size_t f = fine_of(i, fp.row) * (fp.col + 1) + fine_of(j, fp.col);
+    float3 step = fine[f] - fine_prev[f];
+    force[idx] = MULTIGRID_RESTRICT_WEIGHT * step - (positions[idx] - restricted[idx]);
+    new_position[idx] = positions[idx] = restricted[idx] + step;
 }
 
-float3 clamp_pos(__global float3* positions, int i, int j)
+// Jacobi step of a coarse grid, like constraint
+__kernel void constraint_coarse(__global float3* new_position,
+                                __global float3* positions,
+                                ClothParams p,
+                                __global const int* pins,
+                                __global const float3* force)
 {
-    i = max(0, min(CLOTH_ROW, i));
-    j = max(0, min(CLOTH_COL, j));
+    int i = get_global_id(0);
+    int j = get_global_id(1);
     size_t idx = index(i, j);
-    return positions[idx];
+
+    if (i > p.row || j > p.col ||
+        in_pins(pins, p.pin_count, idx))
+        return;
+
+    positions[idx] = solve_stencil(new_position, p, i, j, idx, p.col + 1, 0, 0, 0) + force[idx];
+}
+
+// Adds the bilinear interpolation of the coarse correction y - R x1 to x1,
+// odd rows and columns of the fine grid sit halfway between coarse vertices
+// except the last one of an odd side, which lies on one
+__kernel void prolongate_level(__global const float3* new_position,
+                               __global const float3* restricted,
+                               ClothParams p,
+                               __global const float3* fine_prev,
+                               __global float3* fine,
+                               ClothParams fp,
+                               __global const int* fine_pins)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t f = j + (fp.col + 1) * i;
+
+    if (i > fp.row || j > fp.col ||
+        in_pins(fine_pins, fp.pin_count, f))
+        return;
+
+    int i0 = i == fp.row ? (i + 1) / 2 : i / 2, i1 = (i + 1) / 2;
+    int j0 = j == fp.col ? (j + 1) / 2 : j / 2, j1 = (j + 1) / 2;
+    size_t c00 = index(i0, j0), c01 = index(i0, j1);
+    size_t c10 = index(i1, j0), c11 = index(i1, j1);
+    float3 e = (new_position[c00] - restricted[c00]) + (new_position[c01] - restricted[c01]) +
+               (new_position[c10] - restricted[c10]) + (new_position[c11] - restricted[c11]);
+    fine[f] = fine_prev[f] + 0.25f * e;
 }
 
-__kernel void calculate_normals(__global float3* positions,
-                                __global float3* normals)
+#include "implicit.cl"
+
+// Projective Dynamics, see ProjectiveSystem for the global system. The
+// prediction s stays in new_position, the iterate lives in positions.
+// Local step: right-hand side s / h^2 - sum w p_ij, plus w x_j for every
+// spring to a pinned vertex since pinned vertices are out of the system.
+__kernel void projective_local(__global float3* new_position,
+                               __global float3* positions,
+                               __global float3* rhs,
+                               ClothParams p,
+                               __global const int* pins)
 {
     int i = get_global_id(0);
     int j = get_global_id(1);
     size_t idx = index(i, j);
-    
-    if (i < 0 || j < 0 || i > CLOTH_ROW || j > CLOTH_COL)
+    if (i > p.row || j > p.col)
+        return;
+
+    if (in_pins(pins, p.pin_count, idx)) {
+        rhs[idx] = new_position[idx];
         return;
+    }
+
+    float3 b = new_position[idx] / (p.time_step * p.time_step) +
+               solve_stencil(positions, p, i, j, idx, p.col + 1, 0, 0, 0);
+    for (int k = 0; k < p.pin_count; k++) {
+        int pi = pins[k] / (p.col + 1), pj = pins[k] % (p.col + 1);
+        for (int s = 0; s < IMPLICIT_SPRINGS; s++)
+            if (i + spring_di[s] == pi && j + spring_dj[s] == pj)
+                b += spring_stiffness(p, s) * positions[pins[k]];
+    }
+    rhs[idx] = b;
+}
+
+// Global step L L^T x = rhs with the banded Cholesky factor, in a single
+// work-group since every row waits for the one before it. The items share
+// the updates of the band below (forward) or above (backward) each row;
+// rhs is overwritten by the forward pass. Free vertices get the result
+// with the sphere collision of the constraints.
+__kernel void projective_solve(__global float3* rhs,
+                               __global float3* y,
+                               __global const float* factor,
+                               int band,
+                               ClothParams p,
+                               __global float3* positions,
+                               __global const int* pins)
+{
+    size_t lid = get_local_id(0);
+    size_t size = get_local_size(0);
+    int n = (p.row + 1) * (p.col + 1);
+    size_t width = band + 1;
+
+    for (int i = 0; i < n; i++) {
+        float3 yi = rhs[i] / factor[i * width + band];
+        if (lid == 0)
+            y[i] = yi;
+        int last = min(n - 1, i + band);
+        for (int k = i + 1 + lid; k <= last; k += size)
+            rhs[k] -= factor[k * width + band - (k - i)] * yi;
+        barrier(CLK_GLOBAL_MEM_FENCE);
+    }
+
+    for (int i = n - 1; i >= 0; i--) {
+        float3 xi = y[i] / factor[i * width + band];
+        if (lid == 0 && !in_pins(pins, p.pin_count, i)) {
+            float r = 5.5f;
+            float3 output = xi;
+            float dist = fast_length((float4)(output, 1.f));
+            if (dist < r)
+                output -= output * ((dist - r) / dist);
+            positions[i] = output;
+        }
+        for (int k = max(0, i - band) + lid; k < i; k += size)
+            y[k] -= factor[i * width + band - (i - k)] * xi;
+        barrier(CLK_GLOBAL_MEM_FENCE);
+    }
+}
 
-	float3 output = positions[idx];
-	float3 down    = clamp_pos(positions, i + 1, j);
-	float3 up  = clamp_pos(positions, i - 1, j);
-	float3 right = clamp_pos(positions, i, j + 1);
-	float3 left  = clamp_pos(positions, i, j - 1);
+float3 clamp_pos(__global position_t* positions, ClothParams p, int i, int j)
+{
+    i = max(0, min(p.row, i));
+    j = max(0, min(p.col, j));
+    size_t idx = index(i, j);
+    return load_position(positions, idx, p);
+}
+
+float3 vertex_normal(__global position_t* positions, ClothParams p, int i, int j)
+{
+	float3 output = load_position(positions, index(i, j), p);
+	float3 down    = clamp_pos(positions, p, i + 1, j);
+	float3 up  = clamp_pos(positions, p, i - 1, j);
+	float3 right = clamp_pos(positions, p, i, j + 1);
+	float3 left  = clamp_pos(positions, p, i, j - 1);
     
 	float3 sum = {0.0f, 0.0f, 0.0f};
 
@@ -157,5 +771,131 @@ __kernel void calculate_normals(__global float3* positions,
     sum += cross(right - output, down - output);
     sum += cross(up - output, right - output);
     
-    normals[idx] = sum / fast_length(sum);
-}
\ No newline at end of file
+    return sum / fast_length(sum);
+}
+
+__kernel void calculate_normals(__global position_t* positions,
+                                __global normal_t* normals,
+                                ClothParams p,
+                                __global const int* tiles)
+{
+    int i, j;
+    if (grid_vertex(tiles, p, &i, &j) < 0)
+        return;
+    size_t idx = index(i, j);
+    
+    if (i < 0 || j < 0 || i > p.row || j > p.col)
+        return;
+
+    store_normal(normals, idx, vertex_normal(positions, p, i, j));
+}
+
+// Whole step in a single work-group, for cloths small enough that launch
+// overhead dominates. Every work-item strides over the grid, which lives in
+// local memory (a, and b for the Jacobi ping-pong) between the prediction
+// and the write back, and barriers stand in for the launch boundaries.
+// a and b must hold (row+1)*(col+1) entries.
+__kernel void step_fused(__global position_t* old_positions,
+                         __global position_t* positions,
+                         __global normal_t* normals,
+                         ClothParams p,
+                         __global const float* weights,
+                         int iterations,
+                         int write_normals,
+                         __local float3* a,
+                         __local float3* b,
+                         __global float* lambda,
+                         float chebyshev_rho,
+                         float tolerance,
+                         __constant float* bending)
+{
+    __local int group_max;
+    int w = p.col + 1;
+    int n = (p.row + 1) * w;
+    int first = get_local_id(0);
+    int stride = get_local_size(0);
+
+    if (first == 0)
+        group_max = 0;
+
+    // update_position and update_old_position
+    float3 acc = (float3)(0.0f, -GRAVITY, 0.f) * DELTA_TIME * DELTA_TIME;
+    for (int idx = first; idx < n; idx += stride) {
+        float3 pos = load_position(positions, idx, p);
+        float3 predicted = pos;
+        if (!is_pinned(weights, idx)) {
+            predicted += (1.f - KD) * (pos - load_position(old_positions, idx, p)) + acc;
+            if (p.aerodynamics)
+                predicted += aerodynamics(positions, old_positions, p, idx / w, idx % w, -1) * DELTA_TIME * DELTA_TIME;
+        }
+        if (!p.aerodynamics) {
+            store_position(old_positions, idx, pos, p);
+            reset_lambda(lambda, p, idx);
+        }
+        a[idx] = predicted;
+        b[idx] = predicted;
+    }
+    // the faces read the old positions of the neighbours
+    if (p.aerodynamics) {
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        for (int idx = first; idx < n; idx += stride) {
+            store_position(old_positions, idx, load_position(positions, idx, p), p);
+            reset_lambda(lambda, p, idx);
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // constraint sweeps, the Jacobi ones stop early once the corrections of
+    // a measuring sweep stay below tolerance (0 never measures)
+    __local float3* src = a;
+    __local float3* dst = b;
+    float omega = 0.f;
+    for (int it = 0; it < iterations; it++) {
+        bool measure = tolerance > 0.f && (it + 1) % ADAPTIVE_CHECK_INTERVAL == 0;
+        float largest = 0.f;
+        // same schedule as chebyshev_omega() on the host
+        if (chebyshev_rho > 0.f) {
+            float rho2 = chebyshev_rho * chebyshev_rho;
+            omega = it < CHEBYSHEV_DELAY ? 1.f :
+                    it == CHEBYSHEV_DELAY ? 2.f / (2.f - rho2) : 4.f / (4.f - rho2 * omega);
+        }
+        for (int idx = first; idx < n; idx += stride) {
+            if (is_pinned(weights, idx))
+                continue;
+            float3 x = solve_stencil_local(src, p, idx / w, idx % w, idx, w, lambda + idx, bending, 0);
+            if (omega > 0.f)
+                x = chebyshev(x, src[idx], dst[idx], omega);
+            dst[idx] = x;
+            if (measure)
+                largest = fmax(largest, relative_correction(x, src[idx], p));
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        __local float3* swap = src;
+        src = dst;
+        dst = swap;
+        if (measure) {
+            atomic_max(&group_max, as_int(largest));
+            barrier(CLK_LOCAL_MEM_FENCE);
+            float group = as_float(group_max);
+            barrier(CLK_LOCAL_MEM_FENCE);
+            if (first == 0)
+                group_max = 0;
+            if (group < tolerance)
+                break;
+        }
+    }
+
+    for (int idx = first; idx < n; idx += stride)
+        store_position(positions, idx, src[idx], p);
+    barrier(CLK_GLOBAL_MEM_FENCE);
+
+    // calculate_normals, skipped on substeps that are not displayed
+    if (!write_normals)
+        return;
+    for (int idx = first; idx < n; idx += stride)
+        store_normal(normals, idx, vertex_normal(positions, p, idx / w, idx % w));
+}
+
+#include "batch.cl"
+#include "mesh.cl"
+#include "tear.cl"
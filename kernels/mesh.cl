@@ -0,0 +1,67 @@
+// Constraint graph of an arbitrary triangle mesh, --mesh and --topology csr,
+// included by kernels.cl. The host builds it from the faces, see
+// ConstraintGraph: the constraints of vertex v are entries
+// offsets[v]..offsets[v+1] of neighbors and rest, each one listed at both
+// of its ends, so a Jacobi sweep gathers like the stencil does. A loaded
+// mesh runs as a grid of one row, index(0, j) = j, which keeps the
+// per-vertex kernels and the launches of the grid. Verlet and PBD Jacobi
+// sweeps only.
+
+// Jacobi step over the graph, the same ping-pong as constraint: reads
+// new_position, writes positions
+__kernel void mesh_constraint(__global position_t* new_position,
+                              __global position_t* positions,
+                              ClothParams p,
+                              __global const float* weights,
+                              __global const int* offsets,
+                              __global const int* neighbors,
+                              __global const float* rest)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col || is_pinned(weights, idx))
+        return;
+
+    float3 output = load_position(new_position, idx, p);
+    float3 delta = {0.0f, 0.0f, 0.0f};
+    int end = offsets[idx + 1];
+    for (int k = offsets[idx]; k < end; k++)
+        delta += dynamic_inverse(output, load_position(new_position, neighbors[k], p), rest[k], p.tau);
+    output += delta;
+
+    // The sphere of the stencil
+    float r = 5.5f;
+    float dist = fast_length((float4)(output, 1.f));
+    if (dist < r)
+        output -= output * ((dist - r) / dist);
+    store_position(positions, idx, output, p);
+}
+
+// Area weighted normal of the faces around the vertex, wound like
+// TriMesh::need_normals
+__kernel void mesh_normals(__global position_t* positions,
+                           __global normal_t* normals,
+                           ClothParams p,
+                           __global const int* face_offsets,
+                           __global const int* face_list,
+                           __global const int* faces)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    size_t idx = index(i, j);
+    if (i > p.row || j > p.col)
+        return;
+
+    float3 sum = {0.0f, 0.0f, 0.0f};
+    int end = face_offsets[idx + 1];
+    for (int k = face_offsets[idx]; k < end; k++) {
+        int f = 3 * face_list[k];
+        float3 p0 = load_position(positions, faces[f], p);
+        float3 p1 = load_position(positions, faces[f + 1], p);
+        float3 p2 = load_position(positions, faces[f + 2], p);
+        sum += cross(p0 - p1, p1 - p2);
+    }
+    float len = fast_length(sum);
+    store_normal(normals, idx, len > 0.f ? sum / len : (float3)(0.f, 1.f, 0.f));
+}
@@ -0,0 +1,130 @@
+// Stencil constraint projection of vertex (i, j), included by kernels.cl once
+// per address space the positions can be read from.
+//   STENCIL_NAME  - name of the generated function
+//   STENCIL_SPACE - address space of src (__global or __local)
+//   STENCIL_TYPE  - element type of src, float3 if not defined
+//   STENCIL_LOAD  - float3 at src[k], src[k] if not defined
+// src[c] holds vertex (i, j) and rows of src are w elements apart, so the
+// same body serves the whole grid in global memory and a tile in local memory.
+// lambda points at the first XPBD multiplier of vertex (i, j), the k-th one
+// is (row+1)*(col+1) floats further; it is only touched when p.xpbd is set.
+// bending holds the quadratic bending rows, see bend_class; it is only read
+// when p.quadratic_bend is set, which replaces the +-2 diagonal folds.
+// tear is the buffer of tear.cl, only touched when p.tear_strain is set: the
+// snapped terms of the vertex are skipped and the ones stretched too far snap.
+// With p.projective set it returns the Projective Dynamics local step of the
+// vertex instead, -sum w p_ij over its springs (see projective_local).
+
+#ifndef STENCIL_TYPE
+#define STENCIL_TYPE float3
+#endif
+#ifndef STENCIL_LOAD
+#define STENCIL_LOAD(k) src[k]
+#endif
+
+#define nbr(v_offset, h_offset) STENCIL_LOAD(c + w*(v_offset) + (h_offset))
+#define term(k, v_offset, h_offset, restDist, alpha, weight) \
+    if (!holds(&links, k, output, nbr(v_offset, h_offset), restDist, p.tear_strain)) \
+        {} \
+    else if (p.projective) \
+        delta -= projective_target(output, nbr(v_offset, h_offset), restDist, weight); \
+    else if (p.xpbd) { \
+        delta += compliant_inverse(output, nbr(v_offset, h_offset), restDist, alpha, lambda[(k) * n], dlambda + (k)); \
+        count++; \
+    } else \
+        delta += dynamic_inverse(output, nbr(v_offset, h_offset), restDist, p.tau)
+
+float3 STENCIL_NAME(STENCIL_SPACE STENCIL_TYPE* src, ClothParams p, int i, int j, int c, int w,
+                    __global float* lambda, __constant float* bending, __global int* tear)
+{
+    float3 output = STENCIL_LOAD(c);
+    int held = p.tear_strain > 0.f ? tear[TEAR_HEADER + index(i, j)] : -1;
+    int links = held;
+
+    float3 delta = {0.0f, 0.0f, 0.0f};
+    int count = 0;
+    float dlambda[XPBD_CONSTRAINTS] = {0.f};
+    int n = (p.row + 1) * (p.col + 1);
+    
+	const float dx = p.dx;
+    const float dy = p.dy;
+
+	if (i > 0)
+        { term(0, -1,  0, dy, p.alpha_stretch, p.k_stretch); }
+	if (i < (p.row))
+		{ term(1, +1,  0, dy, p.alpha_stretch, p.k_stretch); }
+	if (j < (p.col))
+		{ term(2,  0, +1, dx, p.alpha_stretch, p.k_stretch); }
+	if (j > 0)
+		{ term(3,  0, -1, dx, p.alpha_stretch, p.k_stretch); }
+    
+	const float diagl = sqrt(dy*dy + dx*dx);
+    
+	if (i > 0 && j > 0)
+		{ term(4, -1, -1, diagl, p.alpha_shear, p.k_shear); }
+	if (i < (p.row) && j > 0)
+		{ term(5, +1, -1, diagl, p.alpha_shear, p.k_shear); }
+	if (i > 0 && j < (p.col))
+		{ term(6, -1, +1, diagl, p.alpha_shear, p.k_shear); }
+	if (i < (p.row) && j < (p.col))
+		{ term(7, +1, +1, diagl, p.alpha_shear, p.k_shear); }
+	
+	const float dblDiagl = 2.0f * diagl;
+    
+	if (p.quadratic_bend > 0.f) {
+		// Linear in the positions, weights past the border are 0
+		__constant float* q = bending + QUADRATIC_BEND_TERMS * bend_class(p, i, j);
+		float3 curvature = {0.0f, 0.0f, 0.0f};
+		for (int s = 0; s < QUADRATIC_BEND_TERMS; s++)
+			if (q[s] != 0.f)
+				curvature += q[s] * (nbr(bend_di[s], bend_dj[s]) - output);
+		delta -= p.quadratic_bend * curvature;
+	} else {
+	if (i > 1 && j > 1)
+		{ term(8, -2, -2, dblDiagl, p.alpha_bend, p.k_bend); }
+	if (i < (p.row-1) && j > 1)
+		{ term(9, +2, -2, dblDiagl, p.alpha_bend, p.k_bend); }
+	if (i > 1 && j < (p.col-1))
+		{ term(10, -2, +2, dblDiagl, p.alpha_bend, p.k_bend); }
+	if (i < (p.row-1) && j < (p.col-1))
+		{ term(11, +2, +2, dblDiagl, p.alpha_bend, p.k_bend); }
+	}
+
+	if (links != held)
+		record_tears(tear, p, i, j, links, held & ~links);
+
+	if (p.projective)
+		return delta;
+
+	// XPBD corrections are averaged over the constraints of the vertex, and
+	// the multipliers take the same share so they match the positions
+	if (p.xpbd && count > 0) {
+		float share = XPBD_OMEGA / count;
+		delta *= share;
+		for (int k = 0; k < XPBD_CONSTRAINTS; k++)
+			lambda[k * n] += share * dlambda[k];
+	}
+	output += delta;
+
+    // COLLISION DETECTION
+//#ifndef _PINNED
+    float r = 5.5f;
+    float3 o = {0.0f, 0.0f, 0.0f};
+    
+    float3 v = o - output;
+    float dist = fast_length((float4)(v, 1.f));
+    if (dist < r)
+    {
+        float diff = (dist - r) / dist;
+        output += v * diff;
+    }
+//#endif
+    return output;
+}
+
+#undef nbr
+#undef term
+#undef STENCIL_NAME
+#undef STENCIL_SPACE
+#undef STENCIL_TYPE
+#undef STENCIL_LOAD
@@ -0,0 +1,124 @@
+// Tearing, --tear, included by kernels.cl. The Jacobi sweeps snap the
+// constraints stretched past p.tear_strain (see holds), the grid vertices
+// stay where they are: every tear runs along edges, so the vertices on
+// either side of it are already apart. A face leaves the index buffer of the
+// cloth once two of its three edges snapped, when one corner has come off
+// the other two; a single snapped edge leaves a face the shear and fold
+// constraints still hold. The device keeps the index buffer packed:
+//     faces[3 s ..] - vertices of the face in slot s, slots 0 .. live - 1
+//     slot[f]       - slot of face f of build_fabric, -1 once it tore
+//     face[s]       - face in slot s
+//     cut[f]        - snapped edges of face f, one bit per edge
+// The tear buffer holds TEAR_HEADER counters, the links of every vertex
+// (one bit per stencil term) and the log of snapped face edges:
+//     tear[0] - edges logged since the last compaction
+//     tear[1] - slots freed by tear_faces
+//     tear[2], tear[3] - pairs listed by tear_pair
+// A compaction launches one work-item per logged edge, then one per freed
+// slot, so frames without tears cost nothing.
+
+// Faces next to the edge of vertex (i, j) along stencil term k, at most two.
+// build_fabric splits quad (a, b) into faces 2 (a col + b), with the edge
+// down its left side, and 2 (a col + b) + 1, with the edge along its top.
+// bit tells the edge apart among the three of either face: 1 for the sides,
+// 2 for the top and bottom, 4 for the diagonal.
+int edge_faces(ClothParams p, int code, int* faces, int* bit)
+{
+    int idx = code / 12, k = code % 12;
+    int i = idx / (p.col + 1), j = idx % (p.col + 1);
+    int count = 0;
+    // upper left end of the edge
+    int a = k == 0 || k == 4 ? i - 1 : i;
+    int b = k == 3 || k == 4 ? j - 1 : j;
+    int quad = 2 * (a * p.col + b);
+    *bit = k < 2 ? 1 : k < 4 ? 2 : 4;
+    if (k == 0 || k == 1) {
+        if (b < p.col)
+            faces[count++] = quad;
+        if (b > 0)
+            faces[count++] = quad - 2 + 1;
+    } else if (k == 2 || k == 3) {
+        if (a < p.row)
+            faces[count++] = quad + 1;
+        if (a > 0)
+            faces[count++] = quad - 2 * p.col;
+    } else {
+        faces[count++] = quad;
+        faces[count++] = quad + 1;
+    }
+    return count;
+}
+
+// Marks the logged edges in the faces next to them and frees the slot of a
+// face whose second edge snapped, one work-item per edge. Both ends log an
+// edge, the bits count it once, and the work-item that sets the second bit
+// of a face is the only one to free it.
+__kernel void tear_faces(__global int* tear,
+                         ClothParams p,
+                         __global int* slot,
+                         __global int* holes,
+                         __global int* cut)
+{
+    int e = get_global_id(0);
+    if (e >= tear[0])
+        return;
+
+    int n = (p.row + 1) * (p.col + 1);
+    int faces[2], bit;
+    int count = edge_faces(p, tear[TEAR_HEADER + n + e], faces, &bit);
+    for (int f = 0; f < count; f++) {
+        int old = atomic_or(cut + faces[f], bit);
+        if ((old & bit) || old == 0 || (old & (old - 1)))
+            continue;
+        int s = atomic_xchg(slot + faces[f], -1);
+        if (s >= 0)
+            holes[atomic_inc(tear + 1)] = s;
+    }
+}
+
+// Pairs the freed slots below live - freed with the faces still held past
+// it, one work-item per freed slot: the k-th slot past the end and the k-th
+// freed slot. There are as many of both, in no particular order.
+__kernel void tear_pair(__global int* tear,
+                        __global const int* slot,
+                        __global const int* face,
+                        __global const int* holes,
+                        __global int* pairs,
+                        int live,
+                        int freed)
+{
+    int k = get_global_id(0);
+    if (k >= freed)
+        return;
+
+    int end = live - freed;
+    int s = end + k;
+    if (slot[face[s]] == s)
+        pairs[2 * atomic_inc(tear + 2)] = s;
+    if (holes[k] < end)
+        pairs[2 * atomic_inc(tear + 3) + 1] = holes[k];
+}
+
+// Moves the faces of the pairs into the freed slots and lists every move as
+// slot, then its three vertices, in moved for the host copy of the faces
+__kernel void tear_move(__global int* tear,
+                        __global int* slot,
+                        __global int* face,
+                        __global int* faces,
+                        __global const int* pairs,
+                        __global int* moved)
+{
+    int r = get_global_id(0);
+    if (r >= tear[2])
+        return;
+
+    int s = pairs[2 * r], h = pairs[2 * r + 1];
+    int f = face[s];
+    face[h] = f;
+    slot[f] = h;
+    moved[4 * r] = h;
+    for (int c = 0; c < 3; c++) {
+        faces[3 * h + c] = faces[3 * s + c];
+        moved[4 * r + 1 + c] = faces[3 * s + c];
+    }
+}
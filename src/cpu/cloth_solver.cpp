@@ -0,0 +1,931 @@
+#include "cloth_solver.hpp"
+#include "config.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#include <xmmintrin.h>
+	#define CLOTH_MXCSR 1
+#endif
+
+static inline void add_cross(float ax, float ay, float az, float bx, float by, float bz, float& x, float& y, float& z) {
+	x += ay * bz - az * by;
+	y += az * bx - ax * bz;
+	z += ax * by - ay * bx;
+}
+
+ClothSolver::ClothSolver(int row, int col, float width, float height,
+	const std::vector<Vec3f>& vertices, const std::vector<unsigned int>& pins,
+	unsigned int thread_count, SimdIsa max_isa)
+	: row(row), col(col), pool(thread_count) {
+	dx = width / col;
+	dy = height / row;
+	iterations = SOLVER_ITERATIONS;
+	tolerance = 0.f;
+	sweeps_last = 0;
+	rest = false;
+	tiles_down = tiles_across = tiles_live = 0;
+	moving = &active;
+	xpbd = false;
+	multigrid = false;
+	implicit = false;
+	implicit_dt = DELTA_TIME;
+	cg_last = 0;
+	chebyshev_rho = 0.f;
+	alpha_stretch = alpha_shear = alpha_bend = 0.f;
+	stride = (col + 1 + 15) / 16 * 16;
+
+	assert(vertices.size() == size_t(row + 1) * size_t(col + 1));
+
+	size_t count = size_t(row + 1) * size_t(stride);
+	positions.resize(count);
+	old_positions.resize(count);
+	new_positions.resize(count);
+	normals.resize(count);
+	active.assign(count, 0);
+
+	for (unsigned int k = 0; k < vertices.size(); k++) {
+		int idx = index(k);
+		positions.x()[idx] = vertices[k][0];
+		positions.y()[idx] = vertices[k][1];
+		positions.z()[idx] = vertices[k][2];
+		active[idx] = -1;
+	}
+	for (unsigned int pin : pins)
+		if (pin < vertices.size()) active[index(pin)] = 0;
+
+	std::copy(positions.xs.begin(), positions.xs.end(), old_positions.xs.begin());
+	std::copy(positions.ys.begin(), positions.ys.end(), old_positions.ys.begin());
+	std::copy(positions.zs.begin(), positions.zs.end(), old_positions.zs.begin());
+
+	has_left1.assign(stride, 0);
+	has_right1.assign(stride, 0);
+	has_left2.assign(stride, 0);
+	has_right2.assign(stride, 0);
+	for (int j = 0; j <= col; j++) {
+		has_left1[j] = j > 0 ? -1 : 0;
+		has_right1[j] = j < col ? -1 : 0;
+		has_left2[j] = j > 1 ? -1 : 0;
+		has_right2[j] = j < col - 1 ? -1 : 0;
+	}
+
+	constraint_row = select_constraint_row(max_isa, &isa);
+}
+
+void ClothSolver::set_xpbd(float stretch, float shear, float bend) {
+	const float dt2 = DELTA_TIME * DELTA_TIME;
+	xpbd = true;
+	alpha_stretch = stretch / dt2;
+	alpha_shear = shear / dt2;
+	alpha_bend = bend / dt2;
+	lambda.assign(XPBD_CONSTRAINTS * size_t(row + 1) * size_t(stride), 0.f);
+}
+
+static void set_edge_masks(GridLevel& level) {
+	level.has_left1.assign(level.stride, 0);
+	level.has_right1.assign(level.stride, 0);
+	level.has_left2.assign(level.stride, 0);
+	level.has_right2.assign(level.stride, 0);
+	for (int j = 0; j <= level.col; j++) {
+		level.has_left1[j] = j > 0 ? -1 : 0;
+		level.has_right1[j] = j < level.col ? -1 : 0;
+		level.has_left2[j] = j > 1 ? -1 : 0;
+		level.has_right2[j] = j < level.col - 1 ? -1 : 0;
+	}
+}
+
+void ClothSolver::set_multigrid(bool enable) {
+	multigrid = enable;
+	levels.clear();
+	if (!enable) return;
+
+	int fine_row = row, fine_col = col, fine_stride = stride;
+	float fine_dx = dx, fine_dy = dy;
+	// An odd side keeps its last row or column, see fine_of in kernels.cl
+	while ((fine_row + 1) / 2 >= MULTIGRID_MIN_SIDE && (fine_col + 1) / 2 >= MULTIGRID_MIN_SIDE) {
+		const AlignedInts& fine_active = levels.empty() ? active : levels.back().active;
+		GridLevel level;
+		level.row = (fine_row + 1) / 2;
+		level.col = (fine_col + 1) / 2;
+		level.stride = (level.col + 1 + 15) / 16 * 16;
+		level.dx = 2.f * fine_dx;
+		level.dy = 2.f * fine_dy;
+
+		size_t count = size_t(level.row + 1) * size_t(level.stride);
+		level.positions.resize(count);
+		level.new_positions.resize(count);
+		level.restricted.resize(count);
+		level.force.resize(count);
+		set_edge_masks(level);
+
+		// A coarse vertex that moved next to a pin would drag the pinned
+		// cloth along, and the pin would undo it on every post-smoothing
+		level.active.assign(count, 0);
+		for (int i = 0; i <= level.row; i++) {
+			for (int j = 0; j <= level.col; j++) {
+				bool free = true;
+				int fi = std::min(2 * i, fine_row), fj = std::min(2 * j, fine_col);
+				for (int a = std::max(0, fi - 1); a <= std::min(fine_row, fi + 1); a++)
+					for (int b = std::max(0, fj - 1); b <= std::min(fine_col, fj + 1); b++)
+						free = free && fine_active[a * fine_stride + b] != 0;
+				level.active[i * level.stride + j] = free ? -1 : 0;
+			}
+		}
+
+		fine_row = level.row; fine_col = level.col; fine_stride = level.stride;
+		fine_dx = level.dx; fine_dy = level.dy;
+		levels.push_back(std::move(level));
+	}
+}
+
+void ClothSolver::set_tolerance(float value) {
+	tolerance = std::max(0.f, value);
+	row_max.assign(tolerance > 0.f ? row + 1 : 0, 0.f);
+}
+
+void ClothSolver::set_rest_detection(bool enable) {
+	rest = enable;
+	tiles_down = enable ? row / REST_TILE + 1 : 0;
+	tiles_across = enable ? col / REST_TILE + 1 : 0;
+	tiles_live = tiles_down * tiles_across;
+	row_motion.assign(size_t(row + 1) * tiles_across, 0.f);
+	tile_quiet.assign(tiles_live, 0);
+	tile_live.assign(tiles_live, 1);
+	sweep_mask = active;
+	moving = &active;
+}
+
+int ClothSolver::tile_of(int i, int j) const {
+	return i / REST_TILE * tiles_across + j / REST_TILE;
+}
+
+// Same rules as rest_classify / rest_compact in kernels.cl
+void ClothSolver::classify_tiles() {
+	const float threshold = REST_THRESHOLD * std::min(dx, dy);
+	bool changed = false;
+	for (int t = 0; t < tiles_down * tiles_across; t++) {
+		float motion = 0.f;
+		int first = t / tiles_across * REST_TILE, last = std::min(row + 1, first + REST_TILE);
+		for (int i = first; i < last; i++)
+			motion = std::max(motion, row_motion[size_t(i) * tiles_across + t % tiles_across]);
+		tile_quiet[t] = motion < threshold ? std::min(tile_quiet[t] + 1, REST_FRAMES) : 0;
+	}
+	std::fill(row_motion.begin(), row_motion.end(), 0.f);
+
+	tiles_live = 0;
+	for (int ti = 0; ti < tiles_down; ti++) {
+		for (int tj = 0; tj < tiles_across; tj++) {
+			char live = 0;
+			for (int a = std::max(0, ti - 1); a <= std::min(tiles_down - 1, ti + 1); a++)
+				for (int b = std::max(0, tj - 1); b <= std::min(tiles_across - 1, tj + 1); b++)
+					live |= tile_quiet[a * tiles_across + b] < REST_FRAMES;
+			int t = ti * tiles_across + tj;
+			changed |= live != tile_live[t];
+			tile_live[t] = live;
+			tiles_live += live;
+		}
+	}
+
+	if (!changed) return;
+	for (int i = 0; i <= row; i++)
+		for (int j = 0; j <= col; j++)
+			sweep_mask[index(i, j)] = tile_live[tile_of(i, j)] ? active[index(i, j)] : 0;
+}
+
+void ClothSolver::set_implicit(int step_scale) {
+	implicit = step_scale > 0;
+	implicit_dt = DELTA_TIME * step_scale;
+
+	size_t count = size_t(row + 1) * size_t(stride);
+	Float3Array* buffers[6] = { &cg_dv, &cg_r, &cg_z, &cg_dir, &cg_q, &cg_diag };
+	for (Float3Array* buffer : buffers)
+		buffer->resize(implicit ? count : 0);
+	springs.resize(implicit ? 12 * count : 0);
+	row_sums.assign(row + 1, 0.0);
+}
+
+void ClothSolver::set_projective(bool enable) {
+	projective.reset();
+	projective_xyz.clear();
+	if (!enable) return;
+
+	std::vector<unsigned int> pins;
+	for (int i = 0; i <= row; i++)
+		for (int j = 0; j <= col; j++)
+			if (!active[index(i, j)]) pins.push_back(unsigned(j + (col + 1) * i));
+	projective.reset(new ProjectiveSystem(row, col, pins, DELTA_TIME,
+		SPRING_STRETCH_STIFFNESS, SPRING_SHEAR_STIFFNESS, SPRING_BEND_STIFFNESS));
+	projective_xyz.resize(3 * size_t(projective->size()));
+}
+
+float ClothSolver::time_step() const {
+	return implicit ? implicit_dt : DELTA_TIME;
+}
+
+void ClothSolver::set_position(unsigned int idx, float x, float y, float z) {
+	int k = index(idx);
+	if (rest && (positions.x()[k] != x || positions.y()[k] != y || positions.z()[k] != z))
+		tile_quiet[tile_of(idx / (col + 1), idx % (col + 1))] = 0;
+	positions.x()[k] = x;
+	positions.y()[k] = y;
+	positions.z()[k] = z;
+}
+
+Float3 ClothSolver::get_position(unsigned int idx) const {
+	int k = index(idx);
+	return Float3{ positions.x()[k], positions.y()[k], positions.z()[k] };
+}
+
+Float3 ClothSolver::get_old_position(unsigned int idx) const {
+	int k = index(idx);
+	return Float3{ old_positions.x()[k], old_positions.y()[k], old_positions.z()[k] };
+}
+
+Float3 ClothSolver::get_normal(unsigned int idx) const {
+	int k = index(idx);
+	return Float3{ normals.x()[k], normals.y()[k], normals.z()[k] };
+}
+
+void ClothSolver::step(bool normals) {
+	// A few rows per chunk keeps the stealing overhead low on large cloths
+	const int grain = std::max(1, (row + 1) / int(8 * pool.size()));
+
+	if (implicit) {
+		implicit_step();
+		if (normals)
+			pool.parallel_for(0, row + 1, grain, [this](int a, int b) { calculate_normals(a, b); });
+		return;
+	}
+
+	// Sleeping tiles are held like pins, with every tile asleep nothing moves
+	bool resting = rest && !multigrid && !projective;
+	if (resting) {
+		classify_tiles();
+		if (!tiles_live) {
+			sweeps_last = 0;
+			return;
+		}
+	}
+	moving = resting ? &sweep_mask : &active;
+
+	pool.parallel_for(0, row + 1, grain, [this](int a, int b) { update_position(a, b); });
+	pool.parallel_for(0, row + 1, grain, [this](int a, int b) { update_old_position(a, b); });
+
+	if (multigrid) {
+		for (int it = 0; it < iterations; it++)
+			multigrid_cycle();
+	} else if (projective) {
+		// The iterate starts at the prediction, which new_positions keeps.
+		// The triangular solves run in order on this thread.
+		pool.parallel_for(0, row + 1, grain, [this](int a, int b) { copy_rows(new_positions, positions, a, b); });
+		for (int it = 0; it < iterations; it++) {
+			pool.parallel_for(0, row + 1, grain, [this](int a, int b) { projective_local(a, b); });
+			projective->solve(projective_xyz.data());
+			pool.parallel_for(0, row + 1, grain, [this](int a, int b) { projective_scatter(a, b); });
+		}
+	} else {
+		// Same ping-pong as execute_kernel(): even iterations write positions.
+		// The buffer written still holds the iterate before the one read,
+		// which is all Chebyshev needs.
+		bool chebyshev = chebyshev_rho > 0.f && !xpbd;
+		float omega = 0.f;
+		int it = 0;
+		while (it < iterations) {
+			if (chebyshev)
+				omega = chebyshev_omega(it, chebyshev_rho, omega);
+			if (it % 2 == 0)
+				pool.parallel_for(0, row + 1, grain, [this, omega](int a, int b) { constraint(new_positions, positions, *moving, a, b, omega); });
+			else
+				pool.parallel_for(0, row + 1, grain, [this, omega](int a, int b) { constraint(positions, new_positions, *moving, a, b, omega); });
+			it++;
+
+			// The check of execute_kernel() on the sweep just taken. The device
+			// acts on it one interval later, so its read back never stalls the queue.
+			if (tolerance > 0.f && it % ADAPTIVE_CHECK_INTERVAL == 0 && it < iterations) {
+				bool even = it % 2 == 1;
+				if (max_correction(even ? new_positions : positions, even ? positions : new_positions, grain) < tolerance)
+					break;
+			}
+		}
+		sweeps_last = it;
+	}
+	if (multigrid || projective)
+		sweeps_last = iterations;
+
+	if (multigrid || (!projective && sweeps_last % 2 == 0))
+		pool.parallel_for(0, row + 1, grain, [this](int a, int b) { copy_rows(new_positions, positions, a, b); });
+
+	if (normals)
+		pool.parallel_for(0, row + 1, grain, [this](int a, int b) { calculate_normals(a, b); });
+}
+
+float ClothSolver::constraint_error() const {
+	const float diagl = sqrtf(dy * dy + dx * dx);
+	// each constraint once, from the vertex with the smaller row or column
+	const int offsets[6][2] = { { 1, 0 }, { 0, 1 }, { 1, -1 }, { 1, 1 }, { 2, -2 }, { 2, 2 } };
+	const float rest[6] = { dy, dx, diagl, diagl, 2.f * diagl, 2.f * diagl };
+	const float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+
+	double error = 0.0;
+	long count = 0;
+	for (int i = 0; i <= row; i++) {
+		for (int j = 0; j <= col; j++) {
+			for (int k = 0; k < 6; k++) {
+				int a = i + offsets[k][0], b = j + offsets[k][1];
+				if (a > row || b < 0 || b > col) continue;
+				int o = index(i, j), n = index(a, b);
+				float vx = px[n] - px[o], vy = py[n] - py[o], vz = pz[n] - pz[o];
+				// PBD measures fast_length((float4)(v, 1.f)), see scalar_term()
+				float dist = sqrtf(vx * vx + vy * vy + vz * vz + (xpbd ? 0.f : 1.f));
+				error += fabs(dist - rest[k]) / rest[k];
+				count++;
+			}
+		}
+	}
+	return count ? float(error / count) : 0.f;
+}
+
+void ClothSolver::update_position(int first_row, int last_row) {
+	const float dt = DELTA_TIME;
+	const float acc = -GRAVITY * dt * dt;
+	const float kd = KD;
+
+	for (int i = first_row; i < last_row; i++) {
+		int idx = index(i, 0);
+		const float* px = positions.x() + idx, * py = positions.y() + idx, * pz = positions.z() + idx;
+		const float* ox = old_positions.x() + idx, * oy = old_positions.y() + idx, * oz = old_positions.z() + idx;
+		float* nx = new_positions.x() + idx, * ny = new_positions.y() + idx, * nz = new_positions.z() + idx;
+		const int32_t* free = moving->data() + idx;
+
+		for (int j = 0; j <= col; j++) {
+			// pinned vertices stay where the host put them
+			float m = free[j] ? 1.f : 0.f;
+			nx[j] = px[j] + m * ((1.f - kd) * (px[j] - ox[j]));
+			ny[j] = py[j] + m * ((1.f - kd) * (py[j] - oy[j]) + acc);
+			nz[j] = pz[j] + m * ((1.f - kd) * (pz[j] - oz[j]));
+		}
+	}
+}
+
+void ClothSolver::update_old_position(int first_row, int last_row) {
+	// Displacement of the last step, for classify_tiles()
+	if (rest) {
+		for (int i = first_row; i < last_row; i++) {
+			int idx = index(i, 0);
+			float* motion = &row_motion[size_t(i) * tiles_across];
+			for (int j = 0; j <= col; j++) {
+				float x = positions.x()[idx + j] - old_positions.x()[idx + j];
+				float y = positions.y()[idx + j] - old_positions.y()[idx + j];
+				float z = positions.z()[idx + j] - old_positions.z()[idx + j];
+				float& m = motion[j / REST_TILE];
+				m = std::max(m, sqrtf(x * x + y * y + z * z));
+			}
+		}
+	}
+	copy_rows(positions, old_positions, first_row, last_row);
+
+	// The XPBD multipliers start from zero every step
+	if (xpbd) {
+		size_t n = size_t(row + 1) * size_t(stride);
+		for (int k = 0; k < XPBD_CONSTRAINTS; k++)
+			std::fill(lambda.begin() + k * n + index(first_row, 0), lambda.begin() + k * n + index(last_row, 0), 0.f);
+	}
+}
+
+void ClothSolver::copy_rows(const Float3Array& from, Float3Array& to, int first_row, int last_row) {
+	for (int i = first_row; i < last_row; i++) {
+		int idx = index(i, 0);
+		std::copy(from.x() + idx, from.x() + idx + col + 1, to.x() + idx);
+		std::copy(from.y() + idx, from.y() + idx + col + 1, to.y() + idx);
+		std::copy(from.z() + idx, from.z() + idx + col + 1, to.z() + idx);
+	}
+}
+
+// omega > 0 mixes in the Chebyshev way with the iterate held by out
+void ClothSolver::constraint(const Float3Array& in, Float3Array& out, const AlignedInts& mask, int first_row, int last_row,
+	float omega) {
+	ConstraintArgs args;
+	args.in_x = in.x(); args.in_y = in.y(); args.in_z = in.z();
+	args.out_x = out.x(); args.out_y = out.y(); args.out_z = out.z();
+	args.active = mask.data();
+	args.has_left1 = has_left1.data();
+	args.has_right1 = has_right1.data();
+	args.has_left2 = has_left2.data();
+	args.has_right2 = has_right2.data();
+	args.row = row; args.col = col; args.stride = stride;
+	args.dx = dx; args.dy = dy;
+	args.diagl = sqrtf(dy * dy + dx * dx);
+	args.dblDiagl = 2.0f * args.diagl;
+	args.tau = TAU;
+	args.sphere_radius = 5.5f;
+	args.chebyshev = omega > 0.f;
+	args.omega = omega;
+	args.gamma = CHEBYSHEV_GAMMA;
+	args.force_x = args.force_y = args.force_z = nullptr;
+	args.lambda = xpbd ? lambda.data() : nullptr;
+	args.lambda_stride = (row + 1) * stride;
+	args.alpha_stretch = alpha_stretch;
+	args.alpha_shear = alpha_shear;
+	args.alpha_bend = alpha_bend;
+
+	ConstraintRowFn row_fn = xpbd ? &constraint_row_xpbd : constraint_row;
+	for (int i = first_row; i < last_row; i++)
+		row_fn(args, i);
+}
+
+// Jacobi ping-pong on a coarse level, even sweeps write positions
+void ClothSolver::level_constraint(GridLevel& level, bool even, bool forced, int first_row, int last_row) {
+	const Float3Array& in = even ? level.new_positions : level.positions;
+	Float3Array& out = even ? level.positions : level.new_positions;
+
+	ConstraintArgs args;
+	args.in_x = in.x(); args.in_y = in.y(); args.in_z = in.z();
+	args.out_x = out.x(); args.out_y = out.y(); args.out_z = out.z();
+	args.active = level.active.data();
+	args.has_left1 = level.has_left1.data();
+	args.has_right1 = level.has_right1.data();
+	args.has_left2 = level.has_left2.data();
+	args.has_right2 = level.has_right2.data();
+	args.row = level.row; args.col = level.col; args.stride = level.stride;
+	args.dx = level.dx; args.dy = level.dy;
+	args.diagl = sqrtf(level.dy * level.dy + level.dx * level.dx);
+	args.dblDiagl = 2.0f * args.diagl;
+	args.tau = TAU;
+	args.sphere_radius = 5.5f;
+	args.chebyshev = 0;
+	args.omega = args.gamma = 0.f;
+	args.force_x = forced ? level.force.x() : nullptr;
+	args.force_y = forced ? level.force.y() : nullptr;
+	args.force_z = forced ? level.force.z() : nullptr;
+	args.lambda = nullptr;
+	args.lambda_stride = 0;
+	args.alpha_stretch = args.alpha_shear = args.alpha_bend = 0.f;
+
+	for (int i = first_row; i < last_row; i++)
+		constraint_row(args, i);
+}
+
+// sweeps Jacobi sweeps on level (0 = the cloth). For an even count the last
+// iterate ends up in new_positions and the one before it in positions.
+void ClothSolver::smooth(int level, int sweeps) {
+	int rows = level ? levels[level - 1].row + 1 : row + 1;
+	const int grain = std::max(1, rows / int(8 * pool.size()));
+
+	for (int it = 0; it < sweeps; it++) {
+		bool even = it % 2 == 0;
+		if (level == 0) {
+			if (even)
+				pool.parallel_for(0, rows, grain, [this](int a, int b) { constraint(new_positions, positions, active, a, b); });
+			else
+				pool.parallel_for(0, rows, grain, [this](int a, int b) { constraint(positions, new_positions, active, a, b); });
+		} else {
+			GridLevel& l = levels[level - 1];
+			pool.parallel_for(0, rows, grain, [this, &l, even](int a, int b) { level_constraint(l, even, true, a, b); });
+		}
+	}
+}
+
+//
+//	One full approximation scheme V-cycle. With S the Jacobi sweep of a grid
+//	and x1, x2 = S(x1) its last two iterates, the coarse grid starts from the
+//	injection of x2 and sweeps y <- S_c(y) + f with
+//		f = w R(x2 - x1) - (S_c(R x1) - R x1),  w = MULTIGRID_RESTRICT_WEIGHT
+//	so R x1 stands still when the grid above has converged. Its correction
+//	y - R x1 is interpolated back onto x1.
+//
+void ClothSolver::multigrid_cycle() {
+	const int coarsest = (int)levels.size();
+	// Even sweep counts, so x2 ends up in new_positions
+	const int pre = std::max(2, MULTIGRID_SMOOTH_SWEEPS + MULTIGRID_SMOOTH_SWEEPS % 2);
+	const int coarse_sweeps = std::max(2, MULTIGRID_COARSE_SWEEPS + MULTIGRID_COARSE_SWEEPS % 2);
+
+	for (int l = 0; l < coarsest; l++) {
+		smooth(l, pre);
+
+		const Float3Array& x1 = l ? levels[l - 1].positions : positions;
+		const Float3Array& x2 = l ? levels[l - 1].new_positions : new_positions;
+		int fine_stride = l ? levels[l - 1].stride : stride;
+		int fine_row = l ? levels[l - 1].row : row;
+		int fine_col = l ? levels[l - 1].col : col;
+		GridLevel& coarse = levels[l];
+		const int grain = std::max(1, (coarse.row + 1) / int(8 * pool.size()));
+
+		// restricted = R x1, force = R(x2 - x1) until S_c(R x1) is known
+		pool.parallel_for(0, coarse.row + 1, grain, [&](int a, int b) {
+			for (int i = a; i < b; i++) {
+				for (int j = 0; j <= coarse.col; j++) {
+					int c = i * coarse.stride + j, f = std::min(2 * i, fine_row) * fine_stride + std::min(2 * j, fine_col);
+					coarse.restricted.x()[c] = coarse.new_positions.x()[c] = coarse.positions.x()[c] = x1.x()[f];
+					coarse.restricted.y()[c] = coarse.new_positions.y()[c] = coarse.positions.y()[c] = x1.y()[f];
+					coarse.restricted.z()[c] = coarse.new_positions.z()[c] = coarse.positions.z()[c] = x1.z()[f];
+					coarse.force.x()[c] = x2.x()[f] - x1.x()[f];
+					coarse.force.y()[c] = x2.y()[f] - x1.y()[f];
+					coarse.force.z()[c] = x2.z()[f] - x1.z()[f];
+				}
+			}
+		});
+
+		// positions = S_c(R x1), then the forcing term and y = R x2
+		pool.parallel_for(0, coarse.row + 1, grain, [this, &coarse](int a, int b) { level_constraint(coarse, true, false, a, b); });
+		pool.parallel_for(0, coarse.row + 1, grain, [&coarse](int a, int b) {
+			for (int i = a; i < b; i++) {
+				for (int j = 0; j <= coarse.col; j++) {
+					int c = i * coarse.stride + j;
+					float* p[3] = { coarse.positions.x(), coarse.positions.y(), coarse.positions.z() };
+					float* n[3] = { coarse.new_positions.x(), coarse.new_positions.y(), coarse.new_positions.z() };
+					float* r[3] = { coarse.restricted.x(), coarse.restricted.y(), coarse.restricted.z() };
+					float* f[3] = { coarse.force.x(), coarse.force.y(), coarse.force.z() };
+					for (int k = 0; k < 3; k++) {
+						float step = f[k][c];
+						f[k][c] = MULTIGRID_RESTRICT_WEIGHT * step - (p[k][c] - r[k][c]);
+						p[k][c] = n[k][c] = r[k][c] + step;
+					}
+				}
+			}
+		});
+	}
+
+	smooth(coarsest, coarsest ? coarse_sweeps : pre);
+
+	for (int l = coarsest; l > 0; l--) {
+		const GridLevel& coarse = levels[l - 1];
+		const Float3Array& x1 = l > 1 ? levels[l - 2].positions : positions;
+		Float3Array& fine = l > 1 ? levels[l - 2].new_positions : new_positions;
+		const AlignedInts& fine_active = l > 1 ? levels[l - 2].active : active;
+		int fine_stride = l > 1 ? levels[l - 2].stride : stride;
+		int fine_rows = l > 1 ? levels[l - 2].row + 1 : row + 1;
+		int fine_col = l > 1 ? levels[l - 2].col : col;
+		const int grain = std::max(1, fine_rows / int(8 * pool.size()));
+
+		// Bilinear interpolation of the coarse correction, odd rows and
+		// columns of the fine grid sit halfway between two coarse vertices
+		// except the last one of an odd side
+		pool.parallel_for(0, fine_rows, grain, [&](int a, int b) {
+			for (int i = a; i < b; i++) {
+				int i0 = i == fine_rows - 1 ? (i + 1) / 2 : i / 2, i1 = (i + 1) / 2;
+				for (int j = 0; j <= fine_col; j++) {
+					int f = i * fine_stride + j;
+					if (!fine_active[f]) continue;
+					int j0 = j == fine_col ? (j + 1) / 2 : j / 2, j1 = (j + 1) / 2;
+					int c[4] = { i0 * coarse.stride + j0, i0 * coarse.stride + j1, i1 * coarse.stride + j0, i1 * coarse.stride + j1 };
+					float ex = 0.f, ey = 0.f, ez = 0.f;
+					for (int k = 0; k < 4; k++) {
+						ex += coarse.new_positions.x()[c[k]] - coarse.restricted.x()[c[k]];
+						ey += coarse.new_positions.y()[c[k]] - coarse.restricted.y()[c[k]];
+						ez += coarse.new_positions.z()[c[k]] - coarse.restricted.z()[c[k]];
+					}
+					fine.x()[f] = x1.x()[f] + 0.25f * ex;
+					fine.y()[f] = x1.y()[f] + 0.25f * ey;
+					fine.z()[f] = x1.z()[f] + 0.25f * ez;
+				}
+			}
+		});
+
+		smooth(l - 1, pre);
+	}
+}
+
+// Right-hand side of the Projective Dynamics global step from the iterate in
+// positions and the prediction s in new_positions, see ProjectiveSystem:
+//	s / h^2 - sum w p_ij + sum over pinned neighbours of w x_j
+// Same as projective_local in kernels.cl.
+void ClothSolver::projective_local(int first_row, int last_row) {
+	const float inertia = 1.f / (DELTA_TIME * DELTA_TIME);
+	const float diagl = sqrtf(dx * dx + dy * dy);
+	const float rest[12] = { dy, dy, dx, dx, diagl, diagl, diagl, diagl, 2.f * diagl, 2.f * diagl, 2.f * diagl, 2.f * diagl };
+	const float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+	const float* sx = new_positions.x(), * sy = new_positions.y(), * sz = new_positions.z();
+
+	for (int i = first_row; i < last_row; i++) {
+		float* b = &projective_xyz[3 * size_t((col + 1) * i)];
+		for (int j = 0; j <= col; j++, b += 3) {
+			int o = index(i, j);
+			if (!active[o]) {
+				b[0] = sx[o]; b[1] = sy[o]; b[2] = sz[o];
+				continue;
+			}
+
+			float x = inertia * sx[o], y = inertia * sy[o], z = inertia * sz[o];
+			for (int s = 0; s < 12; s++) {
+				int a = i + stencil_offsets[s][0], c = j + stencil_offsets[s][1];
+				if (a < 0 || a > row || c < 0 || c > col) continue;
+				int n = index(a, c);
+				float w = s < 4 ? SPRING_STRETCH_STIFFNESS : s < 8 ? SPRING_SHEAR_STIFFNESS : SPRING_BEND_STIFFNESS;
+				float ex = px[n] - px[o], ey = py[n] - py[o], ez = pz[n] - pz[o];
+				float length = sqrtf(ex * ex + ey * ey + ez * ez);
+				if (length > 0.f) {
+					float f = w * rest[s] / length;
+					x -= f * ex; y -= f * ey; z -= f * ez;
+				}
+				if (!active[n]) {
+					x += w * px[n]; y += w * py[n]; z += w * pz[n];
+				}
+			}
+			b[0] = x; b[1] = y; b[2] = z;
+		}
+	}
+}
+
+// Global step result back into positions, with the sphere collision of the constraints
+void ClothSolver::projective_scatter(int first_row, int last_row) {
+	const float r = 5.5f;
+	float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+
+	for (int i = first_row; i < last_row; i++) {
+		const float* b = &projective_xyz[3 * size_t((col + 1) * i)];
+		for (int j = 0; j <= col; j++, b += 3) {
+			int o = index(i, j);
+			if (!active[o]) continue;
+			float x = b[0], y = b[1], z = b[2];
+			float dist = sqrtf(x * x + y * y + z * z + 1.f);
+			if (dist < r) {
+				float diff = (dist - r) / dist;
+				x -= diff * x; y -= diff * y; z -= diff * z;
+			}
+			px[o] = x; py[o] = y; pz[o] = z;
+		}
+	}
+}
+
+//
+//	Implicit integrator
+//	Backward Euler on springs along the 12 constraint stencil neighbours,
+//	with unit vertex masses and h the time step:
+//		(I - h^2 K) dv = h (f + h K v),  K = df/dx
+//	K is never assembled, the products sum the spring Jacobians
+//		J = k (d d^T + c (I - d d^T)),  c = max(0, 1 - rest / length)
+//	of the 12 neighbours from the directions and c cached per step.
+//	Dropping the compressive part of c keeps the system positive definite,
+//	and it is solved with Jacobi preconditioned CG.
+//	Same passes as the implicit_* kernels in kernels.cl.
+//
+
+// Flushes denormals to zero while in scope. CG carries the velocity change
+// far from where it is forced, and the tails it leaves across the cloth
+// sink into the denormal range, which costs x86 a microcode assist per
+// operation. GPUs flush them anyway.
+struct FlushDenormals {
+#ifdef CLOTH_MXCSR
+	unsigned int saved;
+	FlushDenormals() : saved(_mm_getcsr()) { _mm_setcsr(saved | 0x8040); }	// FTZ | DAZ
+	~FlushDenormals() { _mm_setcsr(saved); }
+#endif
+};
+
+static inline ImplicitSpring make_spring(float ex, float ey, float ez, float rest, float k) {
+	float length = sqrtf(ex * ex + ey * ey + ez * ez);
+	float inv = length > 0.f ? 1.f / length : 0.f;
+	return ImplicitSpring{ ex * inv, ey * inv, ez * inv, std::max(0.f, 1.f - rest * inv), k };
+}
+
+static inline double row_dot(const Float3Array& a, const Float3Array& b, int first, int count) {
+	double sum = 0.0;
+	for (int k = first; k < first + count; k++)
+		sum += double(a.x()[k]) * b.x()[k] + double(a.y()[k]) * b.y()[k] + double(a.z()[k]) * b.z()[k];
+	return sum;
+}
+
+// J w
+static inline void spring_apply(const ImplicitSpring& s, float wx, float wy, float wz, float& x, float& y, float& z) {
+	float along = (1.f - s.c) * (s.dx * wx + s.dy * wy + s.dz * wz);
+	x += s.k * (along * s.dx + s.c * wx);
+	y += s.k * (along * s.dy + s.c * wy);
+	z += s.k * (along * s.dz + s.c * wz);
+}
+
+// Each pass leaves the dot product CG needs next in row_sums
+void ClothSolver::implicit_step() {
+	const int grain = std::max(1, (row + 1) / int(8 * pool.size()));
+	const float tolerance = IMPLICIT_CG_TOLERANCE * IMPLICIT_CG_TOLERANCE;
+
+	pool.parallel_for(0, row + 1, grain, [this](int a, int b) { implicit_prepare(a, b); });
+
+	double rz = sum_rows();
+	const double rz0 = rz;
+	cg_last = 0;
+	while (cg_last < IMPLICIT_CG_ITERATIONS && rz > tolerance * rz0) {
+		pool.parallel_for(0, row + 1, grain, [this](int a, int b) { implicit_multiply(a, b); });
+		double pq = sum_rows();
+		if (pq <= 0.0) break;
+		float alpha = float(rz / pq);
+
+		pool.parallel_for(0, row + 1, grain, [this, alpha](int a, int b) { implicit_update(alpha, a, b); });
+		double rz_next = sum_rows();
+		float beta = float(rz_next / rz);
+		rz = rz_next;
+
+		pool.parallel_for(0, row + 1, grain, [this, beta](int a, int b) {
+			FlushDenormals flush;
+			for (int i = a; i < b; i++) {
+				int first = index(i, 0), last = first + col + 1;
+				for (int k = first; k < last; k++) {
+					cg_dir.x()[k] = cg_z.x()[k] + beta * cg_dir.x()[k];
+					cg_dir.y()[k] = cg_z.y()[k] + beta * cg_dir.y()[k];
+					cg_dir.z()[k] = cg_z.z()[k] + beta * cg_dir.z()[k];
+				}
+			}
+		});
+		cg_last++;
+	}
+
+	pool.parallel_for(0, row + 1, grain, [this](int a, int b) { implicit_finish(a, b); });
+}
+
+// Right-hand side and preconditioner, the solve starts from dv = 0
+void ClothSolver::implicit_prepare(int first_row, int last_row) {
+	FlushDenormals flush;
+	const float h = implicit_dt;
+	const float inv_h = 1.f / h;
+	const float diagl = sqrtf(dx * dx + dy * dy);
+	const float rest[12] = { dy, dy, dx, dx, diagl, diagl, diagl, diagl, 2.f * diagl, 2.f * diagl, 2.f * diagl, 2.f * diagl };
+	const float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+	const float* ox = old_positions.x(), * oy = old_positions.y(), * oz = old_positions.z();
+
+	for (int i = first_row; i < last_row; i++) {
+		for (int j = 0; j <= col; j++) {
+			int o = index(i, j);
+			ImplicitSpring* sp = &springs[12 * size_t(o)];
+			cg_dv.x()[o] = cg_dv.y()[o] = cg_dv.z()[o] = 0.f;
+			if (!active[o]) {
+				cg_r.x()[o] = cg_r.y()[o] = cg_r.z()[o] = 0.f;
+				cg_z.x()[o] = cg_z.y()[o] = cg_z.z()[o] = 0.f;
+				cg_dir.x()[o] = cg_dir.y()[o] = cg_dir.z()[o] = 0.f;
+				cg_diag.x()[o] = cg_diag.y()[o] = cg_diag.z()[o] = 1.f;
+				continue;
+			}
+
+			// pinned neighbours do not move, their velocity is 0
+			float vx = (px[o] - ox[o]) * inv_h, vy = (py[o] - oy[o]) * inv_h, vz = (pz[o] - oz[o]) * inv_h;
+			float fx = 0.f, fy = -GRAVITY, fz = 0.f;
+			float kx = 0.f, ky = 0.f, kz = 0.f;	// K v
+			float gx = 0.f, gy = 0.f, gz = 0.f;	// diagonal of sum J
+			for (int s = 0; s < 12; s++) {
+				int a = i + stencil_offsets[s][0], b = j + stencil_offsets[s][1];
+				if (a < 0 || a > row || b < 0 || b > col) {
+					sp[s] = ImplicitSpring{ 0.f, 0.f, 0.f, 0.f, 0.f };
+					continue;
+				}
+				int n = index(a, b);
+				float k = s < 4 ? SPRING_STRETCH_STIFFNESS : s < 8 ? SPRING_SHEAR_STIFFNESS : SPRING_BEND_STIFFNESS;
+				float ex = px[n] - px[o], ey = py[n] - py[o], ez = pz[n] - pz[o];
+				const ImplicitSpring& spring = sp[s] = make_spring(ex, ey, ez, rest[s], k);
+
+				float stretch = k * (sqrtf(ex * ex + ey * ey + ez * ez) - rest[s]);
+				fx += stretch * spring.dx; fy += stretch * spring.dy; fz += stretch * spring.dz;
+
+				float m = active[n] ? inv_h : 0.f;
+				spring_apply(spring, (px[n] - ox[n]) * m - vx, (py[n] - oy[n]) * m - vy, (pz[n] - oz[n]) * m - vz, kx, ky, kz);
+
+				gx += k * ((1.f - spring.c) * spring.dx * spring.dx + spring.c);
+				gy += k * ((1.f - spring.c) * spring.dy * spring.dy + spring.c);
+				gz += k * ((1.f - spring.c) * spring.dz * spring.dz + spring.c);
+			}
+
+			cg_r.x()[o] = h * (fx + h * kx);
+			cg_r.y()[o] = h * (fy + h * ky);
+			cg_r.z()[o] = h * (fz + h * kz);
+			cg_diag.x()[o] = 1.f + h * h * gx;
+			cg_diag.y()[o] = 1.f + h * h * gy;
+			cg_diag.z()[o] = 1.f + h * h * gz;
+			cg_z.x()[o] = cg_dir.x()[o] = cg_r.x()[o] / cg_diag.x()[o];
+			cg_z.y()[o] = cg_dir.y()[o] = cg_r.y()[o] / cg_diag.y()[o];
+			cg_z.z()[o] = cg_dir.z()[o] = cg_r.z()[o] / cg_diag.z()[o];
+		}
+		row_sums[i] = row_dot(cg_r, cg_z, index(i, 0), col + 1);
+	}
+}
+
+// q = (I - h^2 K) dir and its dot with dir, pinned vertices are filtered
+// out of the solve
+void ClothSolver::implicit_multiply(int first_row, int last_row) {
+	FlushDenormals flush;
+	const Float3Array& in = cg_dir;
+	Float3Array& out = cg_q;
+	const float h2 = implicit_dt * implicit_dt;
+
+	for (int i = first_row; i < last_row; i++) {
+		for (int j = 0; j <= col; j++) {
+			int o = index(i, j);
+			if (!active[o]) {
+				out.x()[o] = out.y()[o] = out.z()[o] = 0.f;
+				continue;
+			}
+
+			const ImplicitSpring* sp = &springs[12 * size_t(o)];
+			float kx = 0.f, ky = 0.f, kz = 0.f;
+			for (int s = 0; s < 12; s++) {
+				if (sp[s].k == 0.f) continue;
+				int n = o + stencil_offsets[s][0] * stride + stencil_offsets[s][1];
+				spring_apply(sp[s], in.x()[n] - in.x()[o], in.y()[n] - in.y()[o], in.z()[n] - in.z()[o], kx, ky, kz);
+			}
+			out.x()[o] = in.x()[o] - h2 * kx;
+			out.y()[o] = in.y()[o] - h2 * ky;
+			out.z()[o] = in.z()[o] - h2 * kz;
+		}
+		row_sums[i] = row_dot(in, out, index(i, 0), col + 1);
+	}
+}
+
+// dv += alpha dir, r -= alpha q, z = r / diag and the new r.z
+void ClothSolver::implicit_update(float alpha, int first_row, int last_row) {
+	FlushDenormals flush;
+	for (int i = first_row; i < last_row; i++) {
+		int first = index(i, 0), last = first + col + 1;
+		for (int k = first; k < last; k++) {
+			cg_dv.x()[k] += alpha * cg_dir.x()[k]; cg_r.x()[k] -= alpha * cg_q.x()[k]; cg_z.x()[k] = cg_r.x()[k] / cg_diag.x()[k];
+			cg_dv.y()[k] += alpha * cg_dir.y()[k]; cg_r.y()[k] -= alpha * cg_q.y()[k]; cg_z.y()[k] = cg_r.y()[k] / cg_diag.y()[k];
+			cg_dv.z()[k] += alpha * cg_dir.z()[k]; cg_r.z()[k] -= alpha * cg_q.z()[k]; cg_z.z()[k] = cg_r.z()[k] / cg_diag.z()[k];
+		}
+		row_sums[i] = row_dot(cg_r, cg_z, first, col + 1);
+	}
+}
+
+// v = (1 - KD)^(h / DELTA_TIME) (v + dv), then the same sphere collision as the constraints
+void ClothSolver::implicit_finish(int first_row, int last_row) {
+	FlushDenormals flush;
+	const float h = implicit_dt;
+	const float damping = powf(1.f - KD, h / DELTA_TIME);
+	const float r = 5.5f;
+	float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+	float* ox = old_positions.x(), * oy = old_positions.y(), * oz = old_positions.z();
+
+	for (int i = first_row; i < last_row; i++) {
+		for (int j = 0; j <= col; j++) {
+			int o = index(i, j);
+			float x = px[o], y = py[o], z = pz[o];
+			if (active[o]) {
+				x += damping * (x - ox[o] + h * cg_dv.x()[o]);
+				y += damping * (y - oy[o] + h * cg_dv.y()[o]);
+				z += damping * (z - oz[o] + h * cg_dv.z()[o]);
+
+				float dist = sqrtf(x * x + y * y + z * z + 1.f);
+				if (dist < r) {
+					float diff = (dist - r) / dist;
+					x -= diff * x; y -= diff * y; z -= diff * z;
+				}
+			}
+			ox[o] = px[o]; oy[o] = py[o]; oz[o] = pz[o];
+			px[o] = x; py[o] = y; pz[o] = z;
+		}
+	}
+}
+
+// Largest distance between the free vertices of two iterates, relative to
+// the shorter rest distance
+float ClothSolver::max_correction(const Float3Array& from, const Float3Array& to, int grain) {
+	pool.parallel_for(0, row + 1, grain, [this, &from, &to](int first, int last) {
+		for (int i = first; i < last; i++) {
+			int idx = index(i, 0);
+			float largest = 0.f;
+			for (int j = 0; j <= col; j++) {
+				if (!active[idx + j]) continue;
+				float x = to.x()[idx + j] - from.x()[idx + j];
+				float y = to.y()[idx + j] - from.y()[idx + j];
+				float z = to.z()[idx + j] - from.z()[idx + j];
+				largest = std::max(largest, x * x + y * y + z * z);
+			}
+			row_max[i] = largest;
+		}
+	});
+	float largest = *std::max_element(row_max.begin(), row_max.end());
+	return sqrtf(largest) / std::min(dx, dy);
+}
+
+// Added in row order, so the result does not depend on the thread count
+double ClothSolver::sum_rows() const {
+	double sum = 0.0;
+	for (int i = 0; i <= row; i++)
+		sum += row_sums[i];
+	return sum;
+}
+
+void ClothSolver::calculate_normals(int first_row, int last_row) {
+	const float* px = positions.x(), * py = positions.y(), * pz = positions.z();
+
+	for (int i = first_row; i < last_row; i++) {
+		for (int j = 0; j <= col; j++) {
+			int o = index(i, j);
+			int down = index(std::min(row, i + 1), j);
+			int up = index(std::max(0, i - 1), j);
+			int right = index(i, std::min(col, j + 1));
+			int left = index(i, std::max(0, j - 1));
+
+			float lx = px[left] - px[o], ly = py[left] - py[o], lz = pz[left] - pz[o];
+			float ux = px[up] - px[o], uy = py[up] - py[o], uz = pz[up] - pz[o];
+			float rx = px[right] - px[o], ry = py[right] - py[o], rz = pz[right] - pz[o];
+			float dx_ = px[down] - px[o], dy_ = py[down] - py[o], dz_ = pz[down] - pz[o];
+
+			float x = 0.f, y = 0.f, z = 0.f;
+			add_cross(lx, ly, lz, ux, uy, uz, x, y, z);
+			add_cross(dx_, dy_, dz_, lx, ly, lz, x, y, z);
+			add_cross(rx, ry, rz, dx_, dy_, dz_, x, y, z);
+			add_cross(ux, uy, uz, rx, ry, rz, x, y, z);
+
+			float len = sqrtf(x * x + y * y + z * z);
+			normals.x()[o] = x / len;
+			normals.y()[o] = y / len;
+			normals.z()[o] = z / len;
+		}
+	}
+}
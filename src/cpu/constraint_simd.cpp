@@ -0,0 +1,448 @@
+#include "constraint_simd.hpp"
+#include "config.hpp"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	#define CLOTH_SIMD_X86
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define TARGET_AVX2
+		#define TARGET_AVX512
+	#else
+		#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+		#define TARGET_AVX512 __attribute__((target("avx512f")))
+	#endif
+#endif
+
+SimdIsa detect_simd_isa() {
+#if defined(CLOTH_SIMD_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return SIMD_SCALAR;
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave) return SIMD_SCALAR;
+	unsigned long long xcr0 = _xgetbv(0);
+
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512f = (info[1] & (1 << 16)) != 0;
+
+	// the OS has to save the ymm (and zmm) registers on context switches
+	if (avx512f && (xcr0 & 0xE6) == 0xE6) return SIMD_AVX512;
+	if (avx2 && fma && (xcr0 & 0x6) == 0x6) return SIMD_AVX2;
+	return SIMD_SCALAR;
+#elif defined(CLOTH_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+	return SIMD_SCALAR;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+const char* simd_isa_name(SimdIsa isa) {
+	switch (isa) {
+	case SIMD_AVX512: return "AVX-512";
+	case SIMD_AVX2: return "AVX2";
+	default: return "scalar";
+	}
+}
+
+ConstraintRowFn select_constraint_row(SimdIsa requested, SimdIsa* selected) {
+	SimdIsa isa = detect_simd_isa();
+	if (requested < isa) isa = requested;
+	if (selected) *selected = isa;
+
+	switch (isa) {
+	case SIMD_AVX512: return &constraint_row_avx512;
+	case SIMD_AVX2: return &constraint_row_avx2;
+	default: return &constraint_row_scalar;
+	}
+}
+
+float chebyshev_omega(int k, float rho, float omega) {
+	if (k < CHEBYSHEV_DELAY) return 1.f;
+	if (k == CHEBYSHEV_DELAY) return 2.f / (2.f - rho * rho);
+	return 4.f / (4.f - rho * rho * omega);
+}
+
+//
+//	Scalar fallback
+//
+static inline float scalar_chebyshev(const ConstraintArgs& a, float x, float cur, float prev) {
+	return a.omega * (a.gamma * (x - cur) + cur - prev) + prev;
+}
+
+static inline void scalar_term(
+	const ConstraintArgs& a, int n, float ox, float oy, float oz, float restDist,
+	float& dx, float& dy, float& dz) {
+	float vx = a.in_x[n] - ox;
+	float vy = a.in_y[n] - oy;
+	float vz = a.in_z[n] - oz;
+	// Mirrors fast_length((float4)(v, 1.f)) in kernels.cl, the extra 1 included,
+	// so that both backends produce the same cloth.
+	float inv = 1.f / sqrtf(vx * vx + vy * vy + vz * vz + 1.f);
+	float k = a.tau * (1.f - restDist * inv);
+	dx += k * vx; dy += k * vy; dz += k * vz;
+}
+
+void constraint_row_scalar(const ConstraintArgs& a, int i) {
+	const int s = a.stride;
+	const float r = a.sphere_radius;
+
+	for (int j = 0; j <= a.col; j++) {
+		int idx = i * s + j;
+		if (!a.active[idx]) continue;
+
+		float ox = a.in_x[idx], oy = a.in_y[idx], oz = a.in_z[idx];
+		float dx = 0.f, dy = 0.f, dz = 0.f;
+
+		if (i > 0) scalar_term(a, idx - s, ox, oy, oz, a.dy, dx, dy, dz);
+		if (i < a.row) scalar_term(a, idx + s, ox, oy, oz, a.dy, dx, dy, dz);
+		if (j < a.col) scalar_term(a, idx + 1, ox, oy, oz, a.dx, dx, dy, dz);
+		if (j > 0) scalar_term(a, idx - 1, ox, oy, oz, a.dx, dx, dy, dz);
+
+		if (i > 0 && j > 0) scalar_term(a, idx - s - 1, ox, oy, oz, a.diagl, dx, dy, dz);
+		if (i < a.row && j > 0) scalar_term(a, idx + s - 1, ox, oy, oz, a.diagl, dx, dy, dz);
+		if (i > 0 && j < a.col) scalar_term(a, idx - s + 1, ox, oy, oz, a.diagl, dx, dy, dz);
+		if (i < a.row && j < a.col) scalar_term(a, idx + s + 1, ox, oy, oz, a.diagl, dx, dy, dz);
+
+		if (i > 1 && j > 1) scalar_term(a, idx - 2 * s - 2, ox, oy, oz, a.dblDiagl, dx, dy, dz);
+		if (i < a.row - 1 && j > 1) scalar_term(a, idx + 2 * s - 2, ox, oy, oz, a.dblDiagl, dx, dy, dz);
+		if (i > 1 && j < a.col - 1) scalar_term(a, idx - 2 * s + 2, ox, oy, oz, a.dblDiagl, dx, dy, dz);
+		if (i < a.row - 1 && j < a.col - 1) scalar_term(a, idx + 2 * s + 2, ox, oy, oz, a.dblDiagl, dx, dy, dz);
+
+		ox += dx; oy += dy; oz += dz;
+
+		// Sphere collision
+		float vx = -ox, vy = -oy, vz = -oz;
+		float dist = sqrtf(vx * vx + vy * vy + vz * vz + 1.f);
+		if (dist < r) {
+			float diff = (dist - r) / dist;
+			ox += diff * vx; oy += diff * vy; oz += diff * vz;
+		}
+
+		if (a.force_x) {
+			ox += a.force_x[idx]; oy += a.force_y[idx]; oz += a.force_z[idx];
+		}
+
+		if (a.chebyshev) {
+			ox = scalar_chebyshev(a, ox, a.in_x[idx], a.out_x[idx]);
+			oy = scalar_chebyshev(a, oy, a.in_y[idx], a.out_y[idx]);
+			oz = scalar_chebyshev(a, oz, a.in_z[idx], a.out_z[idx]);
+		}
+
+		a.out_x[idx] = ox; a.out_y[idx] = oy; a.out_z[idx] = oz;
+	}
+}
+
+//
+//	XPBD, same multiplier per vertex and constraint as compliant_inverse()
+//
+static inline void xpbd_term(
+	const ConstraintArgs& a, int n, float ox, float oy, float oz, float restDist,
+	float alpha, float lambda, float& dlambda, float& dx, float& dy, float& dz, int& count) {
+	float vx = a.in_x[n] - ox;
+	float vy = a.in_y[n] - oy;
+	float vz = a.in_z[n] - oz;
+	float dist = sqrtf(vx * vx + vy * vy + vz * vz);
+	if (dist < 1e-6f) return;
+	dlambda = (restDist - dist - alpha * lambda) / (2.f + alpha);
+	float k = -dlambda / dist;
+	dx += k * vx; dy += k * vy; dz += k * vz;
+	count++;
+}
+
+void constraint_row_xpbd(const ConstraintArgs& a, int i) {
+	const int s = a.stride;
+	const int ls = a.lambda_stride;
+	const float r = a.sphere_radius;
+
+	for (int j = 0; j <= a.col; j++) {
+		int idx = i * s + j;
+		if (!a.active[idx]) continue;
+
+		float ox = a.in_x[idx], oy = a.in_y[idx], oz = a.in_z[idx];
+		float dx = 0.f, dy = 0.f, dz = 0.f;
+		float* l = a.lambda + idx;
+		float dl[XPBD_CONSTRAINTS] = { 0.f };
+		int count = 0;
+
+		if (i > 0) xpbd_term(a, idx - s, ox, oy, oz, a.dy, a.alpha_stretch, l[0], dl[0], dx, dy, dz, count);
+		if (i < a.row) xpbd_term(a, idx + s, ox, oy, oz, a.dy, a.alpha_stretch, l[ls], dl[1], dx, dy, dz, count);
+		if (j < a.col) xpbd_term(a, idx + 1, ox, oy, oz, a.dx, a.alpha_stretch, l[2 * ls], dl[2], dx, dy, dz, count);
+		if (j > 0) xpbd_term(a, idx - 1, ox, oy, oz, a.dx, a.alpha_stretch, l[3 * ls], dl[3], dx, dy, dz, count);
+
+		if (i > 0 && j > 0) xpbd_term(a, idx - s - 1, ox, oy, oz, a.diagl, a.alpha_shear, l[4 * ls], dl[4], dx, dy, dz, count);
+		if (i < a.row && j > 0) xpbd_term(a, idx + s - 1, ox, oy, oz, a.diagl, a.alpha_shear, l[5 * ls], dl[5], dx, dy, dz, count);
+		if (i > 0 && j < a.col) xpbd_term(a, idx - s + 1, ox, oy, oz, a.diagl, a.alpha_shear, l[6 * ls], dl[6], dx, dy, dz, count);
+		if (i < a.row && j < a.col) xpbd_term(a, idx + s + 1, ox, oy, oz, a.diagl, a.alpha_shear, l[7 * ls], dl[7], dx, dy, dz, count);
+
+		if (i > 1 && j > 1) xpbd_term(a, idx - 2 * s - 2, ox, oy, oz, a.dblDiagl, a.alpha_bend, l[8 * ls], dl[8], dx, dy, dz, count);
+		if (i < a.row - 1 && j > 1) xpbd_term(a, idx + 2 * s - 2, ox, oy, oz, a.dblDiagl, a.alpha_bend, l[9 * ls], dl[9], dx, dy, dz, count);
+		if (i > 1 && j < a.col - 1) xpbd_term(a, idx - 2 * s + 2, ox, oy, oz, a.dblDiagl, a.alpha_bend, l[10 * ls], dl[10], dx, dy, dz, count);
+		if (i < a.row - 1 && j < a.col - 1) xpbd_term(a, idx + 2 * s + 2, ox, oy, oz, a.dblDiagl, a.alpha_bend, l[11 * ls], dl[11], dx, dy, dz, count);
+
+		// The multipliers take the share of the position correction
+		if (count > 0) {
+			float w = XPBD_OMEGA / count;
+			ox += w * dx; oy += w * dy; oz += w * dz;
+			for (int k = 0; k < XPBD_CONSTRAINTS; k++)
+				l[k * ls] += w * dl[k];
+		}
+
+		// Sphere collision
+		float vx = -ox, vy = -oy, vz = -oz;
+		float dist = sqrtf(vx * vx + vy * vy + vz * vz + 1.f);
+		if (dist < r) {
+			float diff = (dist - r) / dist;
+			ox += diff * vx; oy += diff * vy; oz += diff * vz;
+		}
+
+		a.out_x[idx] = ox; a.out_y[idx] = oy; a.out_z[idx] = oz;
+	}
+}
+
+#ifdef CLOTH_SIMD_X86
+
+//
+//	AVX2: 8 vertices of a row per instruction
+//
+struct Avx2Delta {
+	__m256 x, y, z;
+};
+
+// 1 / sqrt(v) refined by one Newton step, close to fast_length() precision
+TARGET_AVX2 static inline __m256 avx2_rsqrt(__m256 v) {
+	__m256 y = _mm256_rsqrt_ps(v);
+	__m256 yy_v = _mm256_mul_ps(_mm256_mul_ps(y, y), v);
+	return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y), _mm256_sub_ps(_mm256_set1_ps(3.f), yy_v));
+}
+
+TARGET_AVX2 static inline void avx2_term(
+	const ConstraintArgs& a, int n, __m256 ox, __m256 oy, __m256 oz,
+	__m256 rest, __m256 mask, Avx2Delta& d) {
+	__m256 vx = _mm256_sub_ps(_mm256_loadu_ps(a.in_x + n), ox);
+	__m256 vy = _mm256_sub_ps(_mm256_loadu_ps(a.in_y + n), oy);
+	__m256 vz = _mm256_sub_ps(_mm256_loadu_ps(a.in_z + n), oz);
+	__m256 len2 = _mm256_fmadd_ps(vx, vx, _mm256_fmadd_ps(vy, vy, _mm256_fmadd_ps(vz, vz, _mm256_set1_ps(1.f))));
+	__m256 rate = _mm256_fnmadd_ps(rest, avx2_rsqrt(len2), _mm256_set1_ps(1.f));
+	__m256 k = _mm256_and_ps(_mm256_mul_ps(_mm256_set1_ps(a.tau), rate), mask);
+	d.x = _mm256_fmadd_ps(k, vx, d.x);
+	d.y = _mm256_fmadd_ps(k, vy, d.y);
+	d.z = _mm256_fmadd_ps(k, vz, d.z);
+}
+
+TARGET_AVX2 static inline __m256 avx2_chebyshev(const ConstraintArgs& a, __m256 x, const float* cur, const float* prev) {
+	__m256 c = _mm256_load_ps(cur);
+	__m256 p = _mm256_load_ps(prev);
+	__m256 mix = _mm256_fmadd_ps(_mm256_set1_ps(a.gamma), _mm256_sub_ps(x, c), _mm256_sub_ps(c, p));
+	return _mm256_fmadd_ps(_mm256_set1_ps(a.omega), mix, p);
+}
+
+TARGET_AVX2 void constraint_row_avx2(const ConstraintArgs& a, int i) {
+	const int s = a.stride;
+	const __m256 all = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+	const __m256 dy = _mm256_set1_ps(a.dy);
+	const __m256 dx = _mm256_set1_ps(a.dx);
+	const __m256 diagl = _mm256_set1_ps(a.diagl);
+	const __m256 dblDiagl = _mm256_set1_ps(a.dblDiagl);
+	const __m256 r = _mm256_set1_ps(a.sphere_radius);
+
+	for (int j = 0; j <= a.col; j += 8) {
+		int idx = i * s + j;
+		__m256i active = _mm256_load_si256((const __m256i*)(a.active + idx));
+		if (_mm256_testz_si256(active, active)) continue;
+
+		__m256 left1 = _mm256_load_ps((const float*)(a.has_left1 + j));
+		__m256 right1 = _mm256_load_ps((const float*)(a.has_right1 + j));
+		__m256 left2 = _mm256_load_ps((const float*)(a.has_left2 + j));
+		__m256 right2 = _mm256_load_ps((const float*)(a.has_right2 + j));
+
+		__m256 ox = _mm256_load_ps(a.in_x + idx);
+		__m256 oy = _mm256_load_ps(a.in_y + idx);
+		__m256 oz = _mm256_load_ps(a.in_z + idx);
+		Avx2Delta d = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+		if (i > 0) avx2_term(a, idx - s, ox, oy, oz, dy, all, d);
+		if (i < a.row) avx2_term(a, idx + s, ox, oy, oz, dy, all, d);
+		avx2_term(a, idx + 1, ox, oy, oz, dx, right1, d);
+		avx2_term(a, idx - 1, ox, oy, oz, dx, left1, d);
+
+		if (i > 0) {
+			avx2_term(a, idx - s - 1, ox, oy, oz, diagl, left1, d);
+			avx2_term(a, idx - s + 1, ox, oy, oz, diagl, right1, d);
+		}
+		if (i < a.row) {
+			avx2_term(a, idx + s - 1, ox, oy, oz, diagl, left1, d);
+			avx2_term(a, idx + s + 1, ox, oy, oz, diagl, right1, d);
+		}
+
+		if (i > 1) {
+			avx2_term(a, idx - 2 * s - 2, ox, oy, oz, dblDiagl, left2, d);
+			avx2_term(a, idx - 2 * s + 2, ox, oy, oz, dblDiagl, right2, d);
+		}
+		if (i < a.row - 1) {
+			avx2_term(a, idx + 2 * s - 2, ox, oy, oz, dblDiagl, left2, d);
+			avx2_term(a, idx + 2 * s + 2, ox, oy, oz, dblDiagl, right2, d);
+		}
+
+		ox = _mm256_add_ps(ox, d.x);
+		oy = _mm256_add_ps(oy, d.y);
+		oz = _mm256_add_ps(oz, d.z);
+
+		// Sphere collision
+		__m256 len2 = _mm256_fmadd_ps(ox, ox, _mm256_fmadd_ps(oy, oy, _mm256_fmadd_ps(oz, oz, _mm256_set1_ps(1.f))));
+		__m256 inside = _mm256_cmp_ps(len2, _mm256_mul_ps(r, r), _CMP_LT_OQ);
+		__m256 diff = _mm256_and_ps(_mm256_fnmadd_ps(r, avx2_rsqrt(len2), _mm256_set1_ps(1.f)), inside);
+		ox = _mm256_fnmadd_ps(diff, ox, ox);
+		oy = _mm256_fnmadd_ps(diff, oy, oy);
+		oz = _mm256_fnmadd_ps(diff, oz, oz);
+
+		if (a.force_x) {
+			ox = _mm256_add_ps(ox, _mm256_load_ps(a.force_x + idx));
+			oy = _mm256_add_ps(oy, _mm256_load_ps(a.force_y + idx));
+			oz = _mm256_add_ps(oz, _mm256_load_ps(a.force_z + idx));
+		}
+
+		if (a.chebyshev) {
+			ox = avx2_chebyshev(a, ox, a.in_x + idx, a.out_x + idx);
+			oy = avx2_chebyshev(a, oy, a.in_y + idx, a.out_y + idx);
+			oz = avx2_chebyshev(a, oz, a.in_z + idx, a.out_z + idx);
+		}
+
+		_mm256_maskstore_ps(a.out_x + idx, active, ox);
+		_mm256_maskstore_ps(a.out_y + idx, active, oy);
+		_mm256_maskstore_ps(a.out_z + idx, active, oz);
+	}
+}
+
+//
+//	AVX-512: 16 vertices of a row per instruction
+//
+struct Avx512Delta {
+	__m512 x, y, z;
+};
+
+TARGET_AVX512 static inline __m512 avx512_rsqrt(__m512 v) {
+	__m512 y = _mm512_rsqrt14_ps(v);
+	__m512 yy_v = _mm512_mul_ps(_mm512_mul_ps(y, y), v);
+	return _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), y), _mm512_sub_ps(_mm512_set1_ps(3.f), yy_v));
+}
+
+TARGET_AVX512 static inline __mmask16 avx512_mask(const int32_t* p) {
+	__m512i v = _mm512_load_si512((const void*)p);
+	return _mm512_test_epi32_mask(v, v);
+}
+
+TARGET_AVX512 static inline void avx512_term(
+	const ConstraintArgs& a, int n, __m512 ox, __m512 oy, __m512 oz,
+	__m512 rest, __mmask16 mask, Avx512Delta& d) {
+	__m512 vx = _mm512_sub_ps(_mm512_loadu_ps(a.in_x + n), ox);
+	__m512 vy = _mm512_sub_ps(_mm512_loadu_ps(a.in_y + n), oy);
+	__m512 vz = _mm512_sub_ps(_mm512_loadu_ps(a.in_z + n), oz);
+	__m512 len2 = _mm512_fmadd_ps(vx, vx, _mm512_fmadd_ps(vy, vy, _mm512_fmadd_ps(vz, vz, _mm512_set1_ps(1.f))));
+	__m512 rate = _mm512_fnmadd_ps(rest, avx512_rsqrt(len2), _mm512_set1_ps(1.f));
+	__m512 k = _mm512_maskz_mul_ps(mask, _mm512_set1_ps(a.tau), rate);
+	d.x = _mm512_fmadd_ps(k, vx, d.x);
+	d.y = _mm512_fmadd_ps(k, vy, d.y);
+	d.z = _mm512_fmadd_ps(k, vz, d.z);
+}
+
+TARGET_AVX512 static inline __m512 avx512_chebyshev(const ConstraintArgs& a, __m512 x, const float* cur, const float* prev) {
+	__m512 c = _mm512_load_ps(cur);
+	__m512 p = _mm512_load_ps(prev);
+	__m512 mix = _mm512_fmadd_ps(_mm512_set1_ps(a.gamma), _mm512_sub_ps(x, c), _mm512_sub_ps(c, p));
+	return _mm512_fmadd_ps(_mm512_set1_ps(a.omega), mix, p);
+}
+
+TARGET_AVX512 void constraint_row_avx512(const ConstraintArgs& a, int i) {
+	const int s = a.stride;
+	const __mmask16 all = 0xFFFF;
+	const __m512 dy = _mm512_set1_ps(a.dy);
+	const __m512 dx = _mm512_set1_ps(a.dx);
+	const __m512 diagl = _mm512_set1_ps(a.diagl);
+	const __m512 dblDiagl = _mm512_set1_ps(a.dblDiagl);
+	const __m512 r = _mm512_set1_ps(a.sphere_radius);
+
+	for (int j = 0; j <= a.col; j += 16) {
+		int idx = i * s + j;
+		__mmask16 active = avx512_mask(a.active + idx);
+		if (!active) continue;
+
+		__mmask16 left1 = avx512_mask(a.has_left1 + j);
+		__mmask16 right1 = avx512_mask(a.has_right1 + j);
+		__mmask16 left2 = avx512_mask(a.has_left2 + j);
+		__mmask16 right2 = avx512_mask(a.has_right2 + j);
+
+		__m512 ox = _mm512_load_ps(a.in_x + idx);
+		__m512 oy = _mm512_load_ps(a.in_y + idx);
+		__m512 oz = _mm512_load_ps(a.in_z + idx);
+		Avx512Delta d = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+
+		if (i > 0) avx512_term(a, idx - s, ox, oy, oz, dy, all, d);
+		if (i < a.row) avx512_term(a, idx + s, ox, oy, oz, dy, all, d);
+		avx512_term(a, idx + 1, ox, oy, oz, dx, right1, d);
+		avx512_term(a, idx - 1, ox, oy, oz, dx, left1, d);
+
+		if (i > 0) {
+			avx512_term(a, idx - s - 1, ox, oy, oz, diagl, left1, d);
+			avx512_term(a, idx - s + 1, ox, oy, oz, diagl, right1, d);
+		}
+		if (i < a.row) {
+			avx512_term(a, idx + s - 1, ox, oy, oz, diagl, left1, d);
+			avx512_term(a, idx + s + 1, ox, oy, oz, diagl, right1, d);
+		}
+
+		if (i > 1) {
+			avx512_term(a, idx - 2 * s - 2, ox, oy, oz, dblDiagl, left2, d);
+			avx512_term(a, idx - 2 * s + 2, ox, oy, oz, dblDiagl, right2, d);
+		}
+		if (i < a.row - 1) {
+			avx512_term(a, idx + 2 * s - 2, ox, oy, oz, dblDiagl, left2, d);
+			avx512_term(a, idx + 2 * s + 2, ox, oy, oz, dblDiagl, right2, d);
+		}
+
+		ox = _mm512_add_ps(ox, d.x);
+		oy = _mm512_add_ps(oy, d.y);
+		oz = _mm512_add_ps(oz, d.z);
+
+		// Sphere collision
+		__m512 len2 = _mm512_fmadd_ps(ox, ox, _mm512_fmadd_ps(oy, oy, _mm512_fmadd_ps(oz, oz, _mm512_set1_ps(1.f))));
+		__mmask16 inside = _mm512_cmp_ps_mask(len2, _mm512_mul_ps(r, r), _CMP_LT_OQ);
+		__m512 diff = _mm512_maskz_sub_ps(inside, _mm512_set1_ps(1.f), _mm512_mul_ps(r, avx512_rsqrt(len2)));
+		ox = _mm512_fnmadd_ps(diff, ox, ox);
+		oy = _mm512_fnmadd_ps(diff, oy, oy);
+		oz = _mm512_fnmadd_ps(diff, oz, oz);
+
+		if (a.force_x) {
+			ox = _mm512_add_ps(ox, _mm512_load_ps(a.force_x + idx));
+			oy = _mm512_add_ps(oy, _mm512_load_ps(a.force_y + idx));
+			oz = _mm512_add_ps(oz, _mm512_load_ps(a.force_z + idx));
+		}
+
+		if (a.chebyshev) {
+			ox = avx512_chebyshev(a, ox, a.in_x + idx, a.out_x + idx);
+			oy = avx512_chebyshev(a, oy, a.in_y + idx, a.out_y + idx);
+			oz = avx512_chebyshev(a, oz, a.in_z + idx, a.out_z + idx);
+		}
+
+		_mm512_mask_store_ps(a.out_x + idx, active, ox);
+		_mm512_mask_store_ps(a.out_y + idx, active, oy);
+		_mm512_mask_store_ps(a.out_z + idx, active, oz);
+	}
+}
+
+#else
+
+// Not an x86 build, the wide kernels fall back to the scalar one
+void constraint_row_avx2(const ConstraintArgs& a, int i) { constraint_row_scalar(a, i); }
+void constraint_row_avx512(const ConstraintArgs& a, int i) { constraint_row_scalar(a, i); }
+
+#endif
@@ -0,0 +1,100 @@
+#include "projective_system.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+const int stencil_offsets[12][2] = {
+	{ -1, 0 }, { 1, 0 }, { 0, 1 }, { 0, -1 },
+	{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 },
+	{ -2, -2 }, { 2, -2 }, { -2, 2 }, { 2, 2 }
+};
+
+ProjectiveSystem::ProjectiveSystem(int row, int col, const std::vector<unsigned int>& pins,
+	float time_step, float stretch, float shear, float bend) {
+	n = (row + 1) * (col + 1);
+	band = std::min(2 * (col + 1) + 2, n - 1);
+	const size_t width = size_t(band) + 1;
+
+	std::vector<char> pinned(n, 0);
+	for (unsigned int pin : pins)
+		if (pin < (unsigned int)n) pinned[pin] = 1;
+
+	// Lower band of the matrix, in double for the factorization
+	std::vector<double> a(size_t(n) * width, 0.0);
+	auto at = [&](int i, int k) -> double& { return a[size_t(i) * width + band - (i - k)]; };
+	const double inertia = 1.0 / (double(time_step) * time_step);
+	for (int i = 0; i <= row; i++) {
+		for (int j = 0; j <= col; j++) {
+			int v = j + (col + 1) * i;
+			at(v, v) = 1.0;
+			if (pinned[v]) continue;
+
+			at(v, v) = inertia;
+			for (int s = 0; s < 12; s++) {
+				int ni = i + stencil_offsets[s][0], nj = j + stencil_offsets[s][1];
+				if (ni < 0 || ni > row || nj < 0 || nj > col) continue;
+				double w = s < 4 ? stretch : s < 8 ? shear : bend;
+				int u = nj + (col + 1) * ni;
+				at(v, v) += w;
+				if (u < v && !pinned[u])
+					at(v, u) -= w;
+			}
+		}
+	}
+
+	// Banded Cholesky, row by row
+	for (int i = 0; i < n; i++) {
+		int first = std::max(0, i - band);
+		for (int k = first; k <= i; k++) {
+			double sum = at(i, k);
+			for (int m = std::max(first, k - band); m < k; m++)
+				sum -= at(i, m) * at(k, m);
+			if (k < i) {
+				at(i, k) = sum / at(k, k);
+			} else {
+				if (sum <= 0.0) {
+					std::cout << "ERROR: the Projective Dynamics system is not positive definite" << std::endl;
+					exit(1);
+				}
+				at(i, i) = std::sqrt(sum);
+			}
+		}
+	}
+
+	// The fill-in decays away from the diagonal, what float cannot hold as a
+	// normal number is dropped rather than left to slow every solve down
+	lower.resize(a.size());
+	for (size_t k = 0; k < a.size(); k++)
+		lower[k] = std::fabs(a[k]) < FLT_MIN ? 0.f : float(a[k]);
+}
+
+void ProjectiveSystem::solve(float* xyz) const {
+	const size_t width = size_t(band) + 1;
+
+	// L y = b, each row against the finished ones before it
+	for (int i = 0; i < n; i++) {
+		const float* l = &lower[size_t(i) * width + band];
+		float x = xyz[3 * i], y = xyz[3 * i + 1], z = xyz[3 * i + 2];
+		for (int k = std::max(0, i - band); k < i; k++) {
+			float f = l[k - i];
+			x -= f * xyz[3 * k]; y -= f * xyz[3 * k + 1]; z -= f * xyz[3 * k + 2];
+		}
+		float d = 1.f / l[0];
+		xyz[3 * i] = x * d; xyz[3 * i + 1] = y * d; xyz[3 * i + 2] = z * d;
+	}
+
+	// L^T x = y, each finished row is taken out of the ones before it
+	for (int i = n - 1; i >= 0; i--) {
+		const float* l = &lower[size_t(i) * width + band];
+		float d = 1.f / l[0];
+		float x = xyz[3 * i] * d, y = xyz[3 * i + 1] * d, z = xyz[3 * i + 2] * d;
+		xyz[3 * i] = x; xyz[3 * i + 1] = y; xyz[3 * i + 2] = z;
+		for (int k = std::max(0, i - band); k < i; k++) {
+			float f = l[k - i];
+			xyz[3 * k] -= f * x; xyz[3 * k + 1] -= f * y; xyz[3 * k + 2] -= f * z;
+		}
+	}
+}
@@ -0,0 +1,96 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned int thread_count) {
+	if (thread_count == 0)
+		thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+	worker_count = thread_count;
+	slices.reset(new Slice[worker_count]);
+	for (unsigned int i = 0; i < worker_count; i++) {
+		slices[i].next = 0;
+		slices[i].end = 0;
+	}
+
+	job = nullptr;
+	job_grain = 1;
+	generation = 0;
+	running = 0;
+	stopping = false;
+
+	// the calling thread acts as worker 0
+	for (unsigned int i = 1; i < worker_count; i++)
+		threads.push_back(std::thread(&ThreadPool::worker_loop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads)
+		t.join();
+}
+
+void ThreadPool::parallel_for(int first, int last, int grain, const std::function<void(int, int)>& body) {
+	if (last <= first) return;
+	grain = std::max(1, grain);
+
+	// Not worth waking anyone up
+	if (worker_count == 1 || last - first <= grain) {
+		body(first, last);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		int count = last - first;
+		for (unsigned int i = 0; i < worker_count; i++) {
+			slices[i].next = first + int((long long)count * i / worker_count);
+			slices[i].end = first + int((long long)count * (i + 1) / worker_count);
+		}
+		job = &body;
+		job_grain = grain;
+		running = worker_count - 1;
+		generation++;
+	}
+	wake.notify_all();
+
+	drain(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this] { return running == 0; });
+	job = nullptr;
+}
+
+void ThreadPool::worker_loop(unsigned int id) {
+	unsigned long seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+		}
+
+		drain(id);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--running == 0)
+			done.notify_one();
+	}
+}
+
+void ThreadPool::drain(unsigned int id) {
+	// Own slice first, then steal from the neighbours
+	for (unsigned int k = 0; k < worker_count; k++) {
+		Slice& slice = slices[(id + k) % worker_count];
+		for (;;) {
+			int begin = slice.next.fetch_add(job_grain);
+			if (begin >= slice.end) break;
+			(*job)(begin, std::min(begin + job_grain, slice.end));
+		}
+	}
+}
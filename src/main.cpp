@@ -2,6 +2,9 @@
 
 /* Main */	
 int main(int argc, char *argv[]){
+	// Read the backend selection
+	parse_args(argc, argv);
+
 	// Load the meshes
 	init_meshes();
 	
@@ -67,8 +70,14 @@ int main(int argc, char *argv[]){
 	shader.enable();
     
 	/* OpenCL initialization steps */
-	init_kernel();
-	set_buffer_kernel();
+	if (Globals::backend == BACKEND_OPENCL && !init_kernel()) {
+		std::cout << "WARNING: no OpenCL GPU device, falling back to the CPU solver..." << std::endl;
+		Globals::backend = BACKEND_CPU;
+	}
+	if (Globals::backend == BACKEND_OPENCL)
+		set_buffer_kernel();
+	else
+		init_cpu_solver();
 
 	// Initialize matrices
 	init_mat();
@@ -80,6 +89,7 @@ int main(int argc, char *argv[]){
 	}
 
 	// Game loop
+	double last_time = glfwGetTime();
 	while( !glfwWindowShouldClose(window) ){
 		
 		// Clear the color and depth buffers
@@ -98,10 +108,13 @@ int main(int argc, char *argv[]){
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 
+		double now = glfwGetTime();
+		double frame_time = now - last_time;
+		last_time = now;
+
 		if (pause) continue;
 		// Calculate the cloth physics
-		execute_kernel();
-		get_result_from_kernel();
+		simulate_frame(frame_time);
 	} // end game loop
 
 	// Unbind
@@ -112,12 +125,359 @@ int main(int argc, char *argv[]){
 	shader.disable();
     
 	// Release kernels
-	release_kernel();
+	if (Globals::backend == BACKEND_OPENCL)
+		release_kernel();
+	else
+		release_cpu_solver();
 
 	return EXIT_SUCCESS;
 }
 
-void init_kernel() {
+void parse_args(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "cpu") == 0)
+				Globals::backend = BACKEND_CPU;
+			else if (strcmp(argv[i], "opencl") == 0)
+				Globals::backend = BACKEND_OPENCL;
+			else
+				std::cout << "WARNING: unknown backend " << argv[i] << ", using opencl" << std::endl;
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			Globals::cpu_threads = (unsigned int)atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--cloth") == 0 && i + 2 < argc) {
+			Globals::cloth_row = std::max(2, atoi(argv[++i]));
+			Globals::cloth_col = std::max(2, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--cloth-size") == 0 && i + 2 < argc) {
+			Globals::cloth_width = (float)atof(argv[++i]);
+			Globals::cloth_height = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "--pins") == 0 && i + 1 < argc) {
+			// comma separated vertex indices, j + (col+1)*i
+			std::stringstream ss(argv[++i]); std::string pin;
+			Globals::cloth_pins.clear();
+			while (std::getline(ss, pin, ','))
+				Globals::cloth_pins.push_back((unsigned int)atoi(pin.c_str()));
+			Globals::custom_pins = true;
+		} else if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "multigrid") == 0)
+				Globals::solver_mode = SOLVER_MULTIGRID;
+			else if (strcmp(argv[i], "projective") == 0)
+				Globals::solver_mode = SOLVER_PROJECTIVE;
+			else
+				Globals::solver_mode = SOLVER_JACOBI;
+		} else if (strcmp(argv[i], "--chebyshev") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "off") == 0)
+				Globals::chebyshev_rho = 0.f;
+			else if (strcmp(argv[i], "on") == 0)
+				Globals::chebyshev_rho = CHEBYSHEV_RHO;
+			else
+				Globals::chebyshev_rho = std::min(std::max((float)atof(argv[i]), 0.f), 0.9999f);
+		} else if (strcmp(argv[i], "--constraints") == 0 && i + 1 < argc) {
+			Globals::xpbd = strcmp(argv[++i], "xpbd") == 0;
+		} else if (strcmp(argv[i], "--compliance") == 0 && i + 3 < argc) {
+			for (int k = 0; k < 3; k++)
+				Globals::compliance[k] = std::max(0.f, (float)atof(argv[++i]));
+		} else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+			Globals::implicit = strcmp(argv[++i], "implicit") == 0;
+		} else if (strcmp(argv[i], "--step-scale") == 0 && i + 1 < argc) {
+			Globals::step_scale = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--tiling") == 0 && i + 1 < argc) {
+			Globals::tiling = strcmp(argv[++i], "off") != 0;
+		} else if (strcmp(argv[i], "--substeps") == 0 && i + 1 < argc) {
+			Globals::substeps = std::max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--step-budget") == 0 && i + 1 < argc) {
+			Globals::step_budget = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "--fused") == 0 && i + 1 < argc) {
+			Globals::fused = strcmp(argv[++i], "off") != 0;
+		} else if (strcmp(argv[i], "--autotune") == 0 && i + 1 < argc) {
+			i++;
+			Globals::autotune = strcmp(argv[i], "off") != 0;
+			Globals::retune = strcmp(argv[i], "retune") == 0;
+		} else if (strcmp(argv[i], "--tuning-cache") == 0 && i + 1 < argc) {
+			Globals::tuning_cache = argv[++i];
+		} else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+			Globals::solver_iterations = std::max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "on") == 0)
+				Globals::tolerance = ADAPTIVE_TOLERANCE;
+			else
+				Globals::tolerance = std::max(0.f, (float)atof(argv[i]));
+		} else if (strcmp(argv[i], "--rest") == 0 && i + 1 < argc) {
+			Globals::rest = strcmp(argv[++i], "off") != 0;
+		} else if (strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "packed") == 0)
+				Globals::storage = STORAGE_PACKED;
+			else if (strcmp(argv[i], "compact") == 0)
+				Globals::storage = STORAGE_COMPACT;
+			else
+				Globals::storage = STORAGE_FLOAT3;
+		} else if (strcmp(argv[i], "--bandwidth") == 0) {
+			Globals::bandwidth = true;
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			// a count of identical cloths, or a file of them
+			i++;
+			if (strspn(argv[i], "0123456789") == strlen(argv[i]))
+				Globals::batch = atoi(argv[i]);
+			else
+				Globals::batch_file = argv[i];
+		} else if (strcmp(argv[i], "--batch-output") == 0 && i + 1 < argc) {
+			Globals::batch_output = argv[++i];
+		} else if (strcmp(argv[i], "--deterministic") == 0) {
+			Globals::deterministic = true;
+		} else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+			Globals::mesh_file = argv[++i];
+		} else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc) {
+			Globals::csr = strcmp(argv[++i], "csr") == 0;
+		} else if (strcmp(argv[i], "--bending") == 0 && i + 1 < argc) {
+			Globals::quadratic_bending = strcmp(argv[++i], "quadratic") == 0;
+		} else if (strcmp(argv[i], "--wind") == 0 && i + 1 < argc && strcmp(argv[i + 1], "off") == 0) {
+			Globals::aerodynamics = false;
+			i++;
+		} else if (strcmp(argv[i], "--wind") == 0 && i + 3 < argc) {
+			Globals::aerodynamics = true;
+			for (int k = 0; k < 3; k++)
+				Globals::wind[k] = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "--tear") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "off") == 0)
+				Globals::tear_strain = 0.f;
+			else if (strcmp(argv[i], "on") == 0)
+				Globals::tear_strain = TEAR_STRAIN;
+			else
+				Globals::tear_strain = std::max((float)atof(argv[i]), 0.f);
+		} else if (strcmp(argv[i], "--simd") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "scalar") == 0)
+				Globals::cpu_simd = SIMD_SCALAR;
+			else if (strcmp(argv[i], "avx2") == 0)
+				Globals::cpu_simd = SIMD_AVX2;
+			else
+				Globals::cpu_simd = SIMD_AVX512;
+		} else {
+			std::cout << "Usage: " << argv[0] << " [--backend opencl|cpu] [--threads N] [--simd scalar|avx2|avx512]"
+				<< " [--cloth ROW COL] [--cloth-size WIDTH HEIGHT] [--pins i,j,...]"
+				<< " [--solver jacobi|multigrid|projective] [--iterations N] [--tolerance on|off|T] [--chebyshev on|off|RHO] [--rest on|off]"
+				<< " [--storage float|packed|compact] [--bandwidth] [--batch N|FILE] [--batch-output FILE] [--deterministic]"
+				<< " [--mesh FILE.obj] [--topology stencil|csr] [--bending folds|quadratic] [--tear on|off|STRAIN] [--wind X Y Z|off]"
+				<< " [--constraints pbd|xpbd] [--integrator verlet|implicit] [--step-scale N]"
+				<< " [--compliance STRETCH SHEAR BEND] [--tiling auto|off] [--fused auto|off]"
+				<< " [--substeps N] [--step-budget MS] [--autotune on|off|retune] [--tuning-cache FILE]" << std::endl;
+			exit(1);
+		}
+	}
+
+	limit_projective();
+
+	// The coarse grids only know the TAU constraints, Projective Dynamics has its own springs
+	if (Globals::xpbd && Globals::solver_mode != SOLVER_JACOBI) {
+		std::cout << "Multigrid and Projective Dynamics do not support XPBD constraints, using jacobi..." << std::endl;
+		Globals::solver_mode = SOLVER_JACOBI;
+	}
+
+	// Their scratch grids and the implicit integrator only read float positions
+	if (Globals::storage != STORAGE_FLOAT3 && (Globals::solver_mode == SOLVER_MULTIGRID ||
+		Globals::solver_mode == SOLVER_PROJECTIVE || Globals::implicit)) {
+		std::cout << "The " << storage_name() << " layout only supports jacobi constraints, using float3..." << std::endl;
+		Globals::storage = STORAGE_FLOAT3;
+	}
+
+	// The batch kernels only run the Verlet PBD Jacobi sweeps on the device
+	if (batched() && (Globals::backend != BACKEND_OPENCL || Globals::solver_mode != SOLVER_JACOBI ||
+		Globals::xpbd || Globals::implicit || Globals::storage == STORAGE_COMPACT)) {
+		std::cout << "Batch mode needs the opencl backend, jacobi pbd constraints and float3 or packed storage, simulating one cloth..." << std::endl;
+		Globals::batch = 0;
+		Globals::batch_file.clear();
+	}
+
+	// The graph kernels only run the Verlet PBD Jacobi sweeps of one cloth on
+	// the device, a loaded mesh has no grid to fall back to
+	if (csr_topology() && (Globals::backend != BACKEND_OPENCL || Globals::solver_mode != SOLVER_JACOBI ||
+		Globals::xpbd || Globals::implicit || Globals::storage == STORAGE_COMPACT || batched())) {
+		if (!Globals::mesh_file.empty()) {
+			std::cout << "ERROR: a --mesh cloth needs the opencl backend, jacobi pbd constraints, float3 or packed storage and no batch" << std::endl;
+			exit(1);
+		}
+		std::cout << "The csr topology needs the opencl backend, jacobi pbd constraints, float3 or packed storage and no batch, using the stencil..." << std::endl;
+		Globals::csr = false;
+	}
+
+	// Both ends of a constraint must see the same state to snap together, as
+	// the Verlet PBD Jacobi stencil sweeps of one cloth on the device do
+	if (tearing() && (Globals::backend != BACKEND_OPENCL || Globals::solver_mode != SOLVER_JACOBI ||
+		Globals::xpbd || Globals::implicit || batched() || csr_topology())) {
+		std::cout << "Tearing needs the opencl backend, jacobi pbd constraints on the grid stencil and no batch, not tearing..." << std::endl;
+		Globals::tear_strain = 0.f;
+	}
+
+	// The faces of the grid around every vertex, in the Verlet prediction of the
+	// device, a batch predicts on its own
+	if (Globals::aerodynamics && (Globals::backend != BACKEND_OPENCL || Globals::implicit || batched() || csr_topology())) {
+		std::cout << "Aerodynamics needs the opencl backend, the verlet integrator on the grid stencil and no batch, no wind..." << std::endl;
+		Globals::aerodynamics = false;
+	}
+
+	// The bending weights live in the Verlet PBD Jacobi stencil of the device,
+	// and they would hold the sides of a tear together
+	if (Globals::quadratic_bending && (Globals::backend != BACKEND_OPENCL || Globals::solver_mode != SOLVER_JACOBI ||
+		Globals::xpbd || Globals::implicit || csr_topology() || tearing())) {
+		std::cout << "Quadratic bending needs the opencl backend, jacobi pbd constraints on the grid stencil and no tearing, using the folds..." << std::endl;
+		Globals::quadratic_bending = false;
+	}
+
+	// Timing must not pick what runs, and a frame is a fixed number of steps
+	if (Globals::deterministic) {
+		Globals::autotune = false;
+		Globals::fused = false;
+		if (Globals::substeps <= 0)
+			Globals::substeps = 1;
+	}
+}
+
+void simulate_frame(double frame_time) {
+	int steps;
+	if (Globals::substeps > 0) {
+		steps = Globals::substeps;
+	} else {
+		// Pay back the wall time in whole time steps
+		Globals::accumulator += std::min(frame_time, double(MAX_FRAME_TIME));
+		steps = int(Globals::accumulator / time_step());
+	}
+
+	// As many as fit the budget, the cloth slows down rather than the frame rate
+	if (Globals::substeps <= 0 && Globals::step_time > 0.0) {
+		int fit = std::max(1, int(Globals::step_budget * 1e-3 / Globals::step_time));
+		steps = std::min(steps, fit);
+	}
+
+	if (steps > 0) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < steps; i++) {
+			// Only the last step is read back and displayed
+			bool display = i == steps - 1;
+			if (Globals::backend == BACKEND_OPENCL)
+				execute_kernel(display);
+			else
+				execute_cpu_solver(display);
+		}
+		if (Globals::backend == BACKEND_OPENCL) {
+			get_result_from_kernel();
+			compact_faces();
+		} else {
+			get_result_from_cpu_solver();
+		}
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double step_time = elapsed / steps;
+		Globals::step_time = Globals::step_time > 0.0 ? 0.9 * Globals::step_time + 0.1 * step_time : step_time;
+	}
+
+	float alpha = 1.f;
+	if (Globals::substeps <= 0) {
+		// Steps the budget could not afford are dropped
+		const double dt = time_step();
+		Globals::accumulator = std::min(Globals::accumulator - steps * dt, dt);
+		alpha = float(Globals::accumulator / dt);
+	}
+	update_fabric(alpha);
+}
+
+void update_fabric(float alpha) {
+	TriMesh* fabric = &Globals::meshes[0];
+
+	// Render between the last two states, alpha of a step past prev
+	for (size_t i = 0; i < fabric->vertices.size(); i++) {
+		const cl_float3& a = Kernel::prev[i];
+		const cl_float3& b = Kernel::pos[i];
+		fabric->vertices[i][0] = a.x + alpha * (b.x - a.x);
+		fabric->vertices[i][1] = a.y + alpha * (b.y - a.y);
+		fabric->vertices[i][2] = a.z + alpha * (b.z - a.z);
+	}
+
+	for (size_t i = 0; i < fabric->normals.size(); i++) {
+		fabric->normals[i][0] = Kernel::n[i].x;
+		fabric->normals[i][1] = Kernel::n[i].y;
+		fabric->normals[i][2] = Kernel::n[i].z;
+	}
+}
+
+int solver_iterations() {
+	if (Globals::solver_iterations > 0)
+		return Globals::solver_iterations;
+	if (Globals::xpbd)
+		return XPBD_SOLVER_ITERATIONS;
+	if (adaptive_tolerance() > 0.f)
+		return ADAPTIVE_MAX_ITERATIONS;
+	if (Globals::solver_mode == SOLVER_MULTIGRID)
+		return MULTIGRID_CYCLES;
+	if (Globals::solver_mode == SOLVER_PROJECTIVE)
+		return PD_ITERATIONS;
+	return SOLVER_ITERATIONS;
+}
+
+// Projective Dynamics solves the whole grid in one work-group, larger cloths
+// fall back to jacobi, see PROJECTIVE_MAX_VERTICES
+void limit_projective() {
+	if (Globals::solver_mode != SOLVER_PROJECTIVE) return;
+	if (size_t(Globals::cloth_row + 1) * size_t(Globals::cloth_col + 1) <= PROJECTIVE_MAX_VERTICES) return;
+	std::cout << "Projective Dynamics is limited to " << PROJECTIVE_MAX_VERTICES << " vertices, using jacobi..." << std::endl;
+	Globals::solver_mode = SOLVER_JACOBI;
+}
+
+float time_step() {
+	return Globals::implicit ? DELTA_TIME * Globals::step_scale : DELTA_TIME;
+}
+
+float adaptive_tolerance() {
+	// Only the Jacobi PBD stencil sweeps of a single cloth measure their corrections
+	if (Globals::solver_mode != SOLVER_JACOBI || Globals::xpbd || Globals::implicit || batched() || csr_topology())
+		return 0.f;
+	return Globals::tolerance;
+}
+
+bool rest_detection() {
+	// The other solvers and the implicit integrator couple the whole grid every
+	// step, and the graph has no tiles. A sleeping tile would not snap its
+	// side of the constraints to an awake one
+	return Globals::rest && Globals::solver_mode == SOLVER_JACOBI && !Globals::implicit && !batched() && !csr_topology() &&
+		!tearing();
+}
+
+// --deterministic keeps the CPU solver on the scalar constraints, the SIMD
+// ones use approximate reciprocal square roots that differ between CPUs
+SimdIsa cpu_simd() {
+	return Globals::deterministic ? SIMD_SCALAR : Globals::cpu_simd;
+}
+
+bool batched() {
+	return Globals::batch > 0 || !Globals::batch_file.empty();
+}
+
+// Instances in the device buffers
+size_t batch_size() {
+	return std::max(size_t(1), Kernel::instances.size());
+}
+
+// Constraints from the graph of the faces instead of the grid stencil
+bool csr_topology() {
+	return Globals::csr || !Globals::mesh_file.empty();
+}
+
+bool tearing() {
+	return Globals::tear_strain > 0.f;
+}
+
+float chebyshev_rho() {
+	// Only the Jacobi PBD stencil sweeps of a single cloth keep the previous iterate to mix in
+	if (Globals::solver_mode != SOLVER_JACOBI || Globals::xpbd || batched() || csr_topology())
+		return 0.f;
+	return Globals::chebyshev_rho;
+}
+
+bool init_kernel() {
 	cl_int err;
 	cl_platform_id platform;
 	cl_uint platform_amount;
@@ -126,7 +486,7 @@ void init_kernel() {
 	err = clGetPlatformIDs(1, &platform, &platform_amount);
 	if (err != CL_SUCCESS) {
 		std::cout << "ERROR: platform not found!" << std::endl;
-		exit(1);
+		return false;
 	}
 
 	char platform_name[128];
@@ -145,9 +505,9 @@ void init_kernel() {
 	/* Get devices*/
 	cl_uint devices_amount = 0;
 	err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &devices_amount);
-	if (err != CL_SUCCESS) {
+	if (err != CL_SUCCESS || devices_amount == 0) {
 		std::cout << "ERROR: device not found!" << std::endl;
-		exit(1);
+		return false;
 	}
 
 	Kernel::devices.resize(devices_amount);
@@ -188,7 +548,7 @@ void init_kernel() {
 
 	// create a program
 	std::stringstream kernel_file; kernel_file << MY_CUR_DIR << "kernels/kernels.cl";
-	Kernel::program = build_prog(kernel_file.str());
+	Kernel::program = build_prog(kernel_file.str(), Globals::deterministic, Globals::storage);
 
 	// create kernels
 	Kernel::updatePositionKernel = clCreateKernel(Kernel::program, "update_position", &err);
@@ -199,13 +559,109 @@ void init_kernel() {
 	clCreateKernelAssert(err);
 	Kernel::constraintEvenKernel = clCreateKernel(Kernel::program, "constraint", &err);
 	clCreateKernelAssert(err);
+	Kernel::constraintTiledOddKernel = clCreateKernel(Kernel::program, "constraint_tiled", &err);
+	clCreateKernelAssert(err);
+	Kernel::constraintTiledEvenKernel = clCreateKernel(Kernel::program, "constraint_tiled", &err);
+	clCreateKernelAssert(err);
 	Kernel::calculateNoramlsKernel = clCreateKernel(Kernel::program, "calculate_normals", &err);
 	clCreateKernelAssert(err);
+	Kernel::stepFusedKernel = clCreateKernel(Kernel::program, "step_fused", &err);
+	clCreateKernelAssert(err);
+	Kernel::restrictLevelKernel = clCreateKernel(Kernel::program, "restrict_level", &err);
+	clCreateKernelAssert(err);
+	Kernel::restrictForceKernel = clCreateKernel(Kernel::program, "restrict_force", &err);
+	clCreateKernelAssert(err);
+	Kernel::prolongateLevelKernel = clCreateKernel(Kernel::program, "prolongate_level", &err);
+	clCreateKernelAssert(err);
+	Kernel::implicitPrepareKernel = clCreateKernel(Kernel::program, "implicit_prepare", &err);
+	clCreateKernelAssert(err);
+	Kernel::implicitMultiplyKernel = clCreateKernel(Kernel::program, "implicit_multiply", &err);
+	clCreateKernelAssert(err);
+	Kernel::dotPartialKernel = clCreateKernel(Kernel::program, "dot_partial", &err);
+	clCreateKernelAssert(err);
+	Kernel::dotFinalKernel = clCreateKernel(Kernel::program, "dot_final", &err);
+	clCreateKernelAssert(err);
+	Kernel::cgStepKernel = clCreateKernel(Kernel::program, "cg_step", &err);
+	clCreateKernelAssert(err);
+	Kernel::cgDirectionKernel = clCreateKernel(Kernel::program, "cg_direction", &err);
+	clCreateKernelAssert(err);
+	Kernel::implicitFinishKernel = clCreateKernel(Kernel::program, "implicit_finish", &err);
+	clCreateKernelAssert(err);
+	Kernel::projectiveLocalKernel = clCreateKernel(Kernel::program, "projective_local", &err);
+	clCreateKernelAssert(err);
+	Kernel::projectiveSolveKernel = clCreateKernel(Kernel::program, "projective_solve", &err);
+	clCreateKernelAssert(err);
+	Kernel::restClassifyKernel = clCreateKernel(Kernel::program, "rest_classify", &err);
+	clCreateKernelAssert(err);
+	Kernel::restCompactKernel = clCreateKernel(Kernel::program, "rest_compact", &err);
+	clCreateKernelAssert(err);
+	Kernel::copyTilesKernel = clCreateKernel(Kernel::program, "copy_tiles", &err);
+	clCreateKernelAssert(err);
+	Kernel::batchPredictKernel = clCreateKernel(Kernel::program, "batch_predict", &err);
+	clCreateKernelAssert(err);
+	Kernel::batchConstraintOddKernel = clCreateKernel(Kernel::program, "batch_constraint", &err);
+	clCreateKernelAssert(err);
+	Kernel::batchConstraintEvenKernel = clCreateKernel(Kernel::program, "batch_constraint", &err);
+	clCreateKernelAssert(err);
+	Kernel::batchNormalsKernel = clCreateKernel(Kernel::program, "batch_normals", &err);
+	clCreateKernelAssert(err);
+	Kernel::meshConstraintOddKernel = clCreateKernel(Kernel::program, "mesh_constraint", &err);
+	clCreateKernelAssert(err);
+	Kernel::meshConstraintEvenKernel = clCreateKernel(Kernel::program, "mesh_constraint", &err);
+	clCreateKernelAssert(err);
+	Kernel::meshNormalsKernel = clCreateKernel(Kernel::program, "mesh_normals", &err);
+	clCreateKernelAssert(err);
+	Kernel::tearFacesKernel = clCreateKernel(Kernel::program, "tear_faces", &err);
+	clCreateKernelAssert(err);
+	Kernel::tearPairKernel = clCreateKernel(Kernel::program, "tear_pair", &err);
+	clCreateKernelAssert(err);
+	Kernel::tearMoveKernel = clCreateKernel(Kernel::program, "tear_move", &err);
+	clCreateKernelAssert(err);
+	Kernel::pinTargetsKernel = clCreateKernel(Kernel::program, "pin_targets", &err);
+	clCreateKernelAssert(err);
+
+	Kernel::tuner = new WorkGroupTuner(Kernel::devices[0], Kernel::commandQueue, Globals::tuning_cache);
+	Kernel::tuner->set_retune(Globals::retune);
 
 	std::cout << "OpenCL setup is done!" << std::endl;
+	return true;
+}
+
+size_t max_tile_size() {
+	if (!Globals::tiling) return 0;
+
+	cl_int err;
+	cl_device_id device = Kernel::devices[0];
+
+	// Local memory emulated in global memory (most CPU drivers) gains nothing
+	cl_device_local_mem_type local_type;
+	err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_TYPE, sizeof(local_type), &local_type, NULL);
+	if (err != CL_SUCCESS || local_type != CL_LOCAL) return 0;
+
+	cl_ulong local_size;
+	err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_size), &local_size, NULL);
+	if (err != CL_SUCCESS) return 0;
+
+	size_t max_group;
+	cl_ulong kernel_local;
+	err = clGetKernelWorkGroupInfo(Kernel::constraintTiledEvenKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+	err |= clGetKernelWorkGroupInfo(Kernel::constraintTiledEvenKernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(kernel_local), &kernel_local, NULL);
+	if (err != CL_SUCCESS) return 0;
+
+	// Largest tile whose work-group and (B+4)x(B+4) halo tile both fit
+	const size_t candidates[] = { 16, 8 };
+	for (size_t b : candidates) {
+		cl_ulong tile_bytes = (b + 4) * (b + 4) * sizeof(cl_float3);
+		if (b * b <= max_group && tile_bytes + kernel_local <= local_size)
+			return b;
+	}
+	return 0;
 }
 
-cl_program build_prog(std::string& filename) {
+// deterministic builds without the relaxed math options, whose results the
+// compiler may change with every contraction and reassociation it picks.
+// storage is the layout of the positions and normals, see position_t.
+cl_program build_prog(const std::string& filename, bool deterministic, Storage storage) {
 	cl_program program;
 
 	std::ifstream file(filename.c_str());
@@ -223,7 +679,21 @@ cl_program build_prog(std::string& filename) {
 	}
 
 	std::stringstream dir; dir << "-I " << MY_CUR_DIR << "kernels/";
-	std::string options = dir.str() + " -cl-denorms-are-zero -cl-strict-aliasing -cl-fast-relaxed-math -cl-mad-enable -cl-no-signed-zeros";
+	std::string options = dir.str() + " -cl-strict-aliasing";
+	if (!deterministic) {
+		options += " -cl-denorms-are-zero -cl-fast-relaxed-math -cl-mad-enable -cl-no-signed-zeros";
+	} else {
+		options += " -D DETERMINISTIC";
+		// IEEE division and square roots where the device has them
+		cl_device_fp_config fp_config = 0;
+		clGetDeviceInfo(Kernel::devices[0], CL_DEVICE_SINGLE_FP_CONFIG, sizeof(fp_config), &fp_config, NULL);
+		if (fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT)
+			options += " -cl-fp32-correctly-rounded-divide-sqrt";
+	}
+	if (storage == STORAGE_PACKED)
+		options += " -D PACKED_STORAGE";
+	else if (storage == STORAGE_COMPACT)
+		options += " -D COMPACT_STORAGE";
 	err = clBuildProgram(program, 1, &Kernel::devices[0], options.c_str(), NULL, NULL);
 
 	if (err != CL_SUCCESS) {
@@ -266,122 +736,2024 @@ cl_program build_prog(std::string& filename) {
 			size_t log_size;
 			clGetProgramBuildInfo(program, Kernel::devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
 
-			// Allocate memory for the log
-			char* log = (char*)malloc(log_size);
+			// Allocate memory for the log
+			char* log = (char*)malloc(log_size);
+
+			// Get the log
+			clGetProgramBuildInfo(program, Kernel::devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+
+			// Print the log
+			printf("%s\n", log);
+		}
+
+		std::cout << "clProgram build failed!" << std::endl;
+		exit(1);
+	}
+
+	std::cout << "SUCCESS: clProgram built..." << std::endl;
+	return program;
+}
+
+void release_kernel() {
+	// Clean up
+	cl_int err;
+	err = clFlush(Kernel::commandQueue);
+	err = clFinish(Kernel::commandQueue);
+	err = clReleaseKernel(Kernel::updatePositionKernel);
+	err = clReleaseKernel(Kernel::updateOldPositionKernel);
+	err = clReleaseKernel(Kernel::constraintOddKernel);
+	err = clReleaseKernel(Kernel::constraintEvenKernel);
+	err = clReleaseKernel(Kernel::constraintTiledOddKernel);
+	err = clReleaseKernel(Kernel::constraintTiledEvenKernel);
+	err = clReleaseKernel(Kernel::calculateNoramlsKernel);
+	err = clReleaseKernel(Kernel::stepFusedKernel);
+	err = clReleaseKernel(Kernel::restrictLevelKernel);
+	err = clReleaseKernel(Kernel::restrictForceKernel);
+	err = clReleaseKernel(Kernel::prolongateLevelKernel);
+	err = clReleaseKernel(Kernel::implicitPrepareKernel);
+	err = clReleaseKernel(Kernel::implicitMultiplyKernel);
+	err = clReleaseKernel(Kernel::dotPartialKernel);
+	err = clReleaseKernel(Kernel::dotFinalKernel);
+	err = clReleaseKernel(Kernel::cgStepKernel);
+	err = clReleaseKernel(Kernel::cgDirectionKernel);
+	err = clReleaseKernel(Kernel::implicitFinishKernel);
+	err = clReleaseKernel(Kernel::projectiveLocalKernel);
+	err = clReleaseKernel(Kernel::projectiveSolveKernel);
+	err = clReleaseKernel(Kernel::restClassifyKernel);
+	err = clReleaseKernel(Kernel::restCompactKernel);
+	err = clReleaseKernel(Kernel::copyTilesKernel);
+	err = clReleaseKernel(Kernel::batchPredictKernel);
+	err = clReleaseKernel(Kernel::batchConstraintOddKernel);
+	err = clReleaseKernel(Kernel::batchConstraintEvenKernel);
+	err = clReleaseKernel(Kernel::batchNormalsKernel);
+	err = clReleaseKernel(Kernel::meshConstraintOddKernel);
+	err = clReleaseKernel(Kernel::meshConstraintEvenKernel);
+	err = clReleaseKernel(Kernel::meshNormalsKernel);
+	err = clReleaseKernel(Kernel::tearFacesKernel);
+	err = clReleaseKernel(Kernel::tearPairKernel);
+	err = clReleaseKernel(Kernel::tearMoveKernel);
+	err = clReleaseKernel(Kernel::pinTargetsKernel);
+	err = clReleaseProgram(Kernel::program);
+	release_buffer_kernel();
+	delete Kernel::tuner;
+	Kernel::tuner = nullptr;
+	err = clReleaseCommandQueue(Kernel::commandQueue);
+	err = clReleaseContext(Kernel::context);
+}
+
+void release_buffer_kernel() {
+	save_batch();
+	clReleaseMemObject(Kernel::pins);
+	clReleaseMemObject(Kernel::weights);
+	clReleaseMemObject(Kernel::lambda);
+	clReleaseMemObject(Kernel::bending);
+	clReleaseMemObject(Kernel::tear);
+	clReleaseMemObject(Kernel::correction);
+	if (Kernel::correction_read) {
+		clWaitForEvents(1, &Kernel::correction_read);
+		clReleaseEvent(Kernel::correction_read);
+		Kernel::correction_read = NULL;
+	}
+	clReleaseMemObject(Kernel::tile_motion);
+	clReleaseMemObject(Kernel::tile_quiet);
+	clReleaseMemObject(Kernel::tiles);
+	if (Kernel::tiles_read) {
+		clWaitForEvents(1, &Kernel::tiles_read);
+		clReleaseEvent(Kernel::tiles_read);
+		Kernel::tiles_read = NULL;
+	}
+	clReleaseMemObject(Kernel::old_positions);
+	clReleaseMemObject(Kernel::positions);
+	clReleaseMemObject(Kernel::new_positions);
+	clReleaseMemObject(Kernel::normals);
+	release_multigrid();
+	release_implicit();
+	release_projective();
+	release_batch();
+	release_graph();
+	release_tear();
+	release_pin_targets();
+}
+
+void init_host_buffers() {
+	TriMesh* fabric = &Globals::meshes[0];
+	Kernel::pos.clear();
+	Kernel::n.clear();
+
+	// Cast type from float[3] to cl_float3 (sizeof(cl_float3) == sizeof(cl_float4))
+	for (Vec3f &v : fabric->vertices) {
+		cl_float3 pos;
+		pos.x = v[0]; pos.y = v[1]; pos.z = v[2];
+		//std::cout << pos.x << ", " << pos.y << ", " << pos.z << std::endl;
+		Kernel::pos.push_back(pos);
+	}
+	Kernel::prev = Kernel::pos;
+	for (Vec3f &vn : fabric->normals) {
+		cl_float3 n;
+		n.x = vn[0]; n.y = vn[1]; n.z = vn[2];
+		Kernel::n.push_back(n);
+	}
+}
+
+void set_buffer_kernel() {
+	init_host_buffers();
+
+	std::cout << "Data size verification..." << std::endl;
+	std::cout << "Size of host data mem: " << sizeof(Kernel::pos[0]) << std::endl;
+	std::cout << "Size of kernel data mem: " << sizeof(cl_float3) << std::endl;
+	if (sizeof(Kernel::pos[0]) != sizeof(cl_float3)) {
+		std::cout << "TEST1: FALSE" << std::endl;
+		exit(1);
+	}
+	std::cout << "TEST1: TRUE" << std::endl;
+
+	std::cout << "Size of host data mem: " << sizeof(Kernel::n[0]) << std::endl;
+	std::cout << "Size of kernel data mem: " << sizeof(cl_float3) << std::endl;
+	if (sizeof(Kernel::n[0]) != sizeof(cl_float3)) {
+		std::cout << "TEST2: FALSE" << std::endl;
+		exit(1);
+	}
+	std::cout << "TEST2: TRUE" << std::endl;
+
+	// Grid description passed to every kernel
+	Kernel::params.row = Globals::cloth_row;
+	Kernel::params.col = Globals::cloth_col;
+	Kernel::params.dx = Globals::cloth_width / Globals::cloth_col;
+	Kernel::params.dy = Globals::cloth_height / Globals::cloth_row;
+	Kernel::params.pin_count = (int)Globals::cloth_pins.size();
+	Kernel::params.tau = TAU;
+	Kernel::params.xpbd = Globals::xpbd;
+	Kernel::params.alpha_stretch = Globals::compliance[0] / (DELTA_TIME * DELTA_TIME);
+	Kernel::params.alpha_shear = Globals::compliance[1] / (DELTA_TIME * DELTA_TIME);
+	Kernel::params.alpha_bend = Globals::compliance[2] / (DELTA_TIME * DELTA_TIME);
+	Kernel::params.time_step = time_step();
+	Kernel::params.k_stretch = SPRING_STRETCH_STIFFNESS;
+	Kernel::params.k_shear = SPRING_SHEAR_STIFFNESS;
+	Kernel::params.k_bend = SPRING_BEND_STIFFNESS;
+	Kernel::params.projective = Globals::solver_mode == SOLVER_PROJECTIVE;
+	Kernel::params.rest_tiles = rest_detection();
+	Kernel::params.quadratic_bend = Globals::quadratic_bending ? QUADRATIC_BEND : 0.f;
+	Kernel::params.tear_strain = Globals::tear_strain;
+	Kernel::params.aerodynamics = Globals::aerodynamics;
+	for (int a = 0; a < 3; a++)
+		Kernel::params.wind[a] = Globals::wind[a];
+
+	// The constraint graph of the rest pose. A loaded mesh is one row of
+	// vertices to the per-vertex kernels, its mean edge stands in for the
+	// rest distances of the grid
+	if (csr_topology())
+		Kernel::graph = new ConstraintGraph(Globals::meshes[0].vertices, Globals::meshes[0].faces);
+	if (!Globals::mesh_file.empty()) {
+		Kernel::params.row = 0;
+		Kernel::params.col = int(Kernel::pos.size()) - 1;
+		Kernel::params.dx = Kernel::params.dy = Kernel::graph->mean_edge();
+	}
+	set_storage_range();
+	load_batch();
+
+	std::vector<cl_int> pins(Globals::cloth_pins.begin(), Globals::cloth_pins.end());
+	pins.push_back(-1); // buffers cannot be empty
+
+	cl_int err;
+	Kernel::pins = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * pins.size(), &pins[0], &err);
+	assert(!err);
+	// 1 for the free vertices, 0 for the pins unless they were released
+	std::vector<cl_float>& weights = Kernel::pin_weights;
+	weights.assign(Kernel::pos.size(), 1.f);
+	for (unsigned int pin : Globals::cloth_pins)
+		weights[pin] = Globals::pins_released ? 1.f : 0.f;
+	Kernel::weights = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float) * weights.size(), &weights[0], &err);
+	assert(!err);
+	// XPBD_CONSTRAINTS multipliers per vertex, stored constraint by constraint
+	size_t lambda_count = Globals::xpbd ? XPBD_CONSTRAINTS * Kernel::pos.size() : 1;
+	Kernel::lambda = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE,
+		sizeof(cl_float) * lambda_count, NULL, &err);
+	assert(!err);
+	// The bending weights of the rest grid, built once
+	std::vector<cl_float> bending(1, 0.f);
+	if (Globals::quadratic_bending)
+		bending = QuadraticBending::grid_table(Kernel::params.row, Kernel::params.col, Kernel::params.dx, Kernel::params.dy);
+	Kernel::bending = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float) * bending.size(), &bending[0], &err);
+	assert(!err);
+	std::vector<cl_int> tear = initial_tear();
+	Kernel::tear = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * tear.size(), &tear[0], &err);
+	assert(!err);
+	Kernel::correction = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE,
+		sizeof(cl_int), NULL, &err);
+	assert(!err);
+	// Every tile starts awake and listed
+	Kernel::tile_count = size_t(Kernel::params.row / REST_TILE + 1) * (Kernel::params.col / REST_TILE + 1);
+	Kernel::rest_wake = 0;
+	Kernel::tiles_host = cl_int(Kernel::tile_count);
+	std::vector<cl_int> tiles(Kernel::tile_count + 1, 0);
+	tiles[0] = cl_int(Kernel::tile_count);
+	for (size_t t = 0; t < Kernel::tile_count; t++)
+		tiles[t + 1] = cl_int(t);
+	Kernel::tiles = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * tiles.size(), &tiles[0], &err);
+	assert(!err);
+	std::fill(tiles.begin(), tiles.end(), 0);
+	Kernel::tile_motion = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * Kernel::tile_count, &tiles[0], &err);
+	assert(!err);
+	Kernel::tile_quiet = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * Kernel::tile_count, &tiles[0], &err);
+	assert(!err);
+	create_state_buffers();
+	set_step_args();
+
+	err = clSetKernelArg(Kernel::restClassifyKernel, 0, sizeof(cl_mem), &Kernel::tile_motion);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restClassifyKernel, 1, sizeof(cl_mem), &Kernel::tile_quiet);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restClassifyKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restClassifyKernel, 4, sizeof(cl_mem), &Kernel::pins);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restCompactKernel, 0, sizeof(cl_mem), &Kernel::tile_quiet);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restCompactKernel, 1, sizeof(cl_mem), &Kernel::tiles);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::restCompactKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+
+	cl_int iterations = solver_iterations();
+	err = clSetKernelArg(Kernel::stepFusedKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 2, sizeof(cl_mem), &Kernel::normals);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 3, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 4, sizeof(cl_mem), &Kernel::weights);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 5, sizeof(cl_int), &iterations);
+	clSetKernelArgAssert(err);
+	// The whole grid in local memory, twice for the Jacobi ping-pong
+	err = clSetKernelArg(Kernel::stepFusedKernel, 7, sizeof(cl_float3) * Kernel::pos.size(), NULL);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 8, sizeof(cl_float3) * Kernel::pos.size(), NULL);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 9, sizeof(cl_mem), &Kernel::lambda);
+	clSetKernelArgAssert(err);
+	cl_float rho = chebyshev_rho();
+	err = clSetKernelArg(Kernel::stepFusedKernel, 10, sizeof(cl_float), &rho);
+	clSetKernelArgAssert(err);
+	// The fused step checks its corrections in local memory, no read back
+	cl_float tolerance = adaptive_tolerance();
+	err = clSetKernelArg(Kernel::stepFusedKernel, 11, sizeof(cl_float), &tolerance);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::stepFusedKernel, 12, sizeof(cl_mem), &Kernel::bending);
+	clSetKernelArgAssert(err);
+
+	build_multigrid();
+	build_implicit();
+	build_projective();
+	build_batch();
+	build_graph();
+	build_tear();
+	build_pin_targets();
+	tune_work_groups();
+	choose_step_mode();
+	storage_report();
+	bandwidth_report();
+	graph_report();
+	bending_report();
+	wind_report();
+	determinism_report();
+
+	std::cout << "SUCCESS: Buffers and kernels setting is done...\n" << std::endl;
+}
+
+// The Verlet state and the normals in the --storage layout, every instance
+// of --batch starts from the same pose
+void create_state_buffers() {
+	cl_int err;
+	std::vector<char> codes, initial;
+	encode_positions(Kernel::pos, codes);
+	for (size_t k = 0; k < batch_size(); k++)
+		initial.insert(initial.end(), codes.begin(), codes.end());
+	Kernel::old_positions = clCreateBuffer(
+		Kernel::context, CL_MEM_COPY_HOST_PTR,
+		initial.size(), &initial[0], &err);
+	assert(!err);
+	Kernel::positions = clCreateBuffer(
+		Kernel::context, CL_MEM_COPY_HOST_PTR,
+		initial.size(), &initial[0], &err);
+	assert(!err);
+	Kernel::new_positions = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_WRITE,
+		initial.size(), NULL, &err);
+	assert(!err);
+	Kernel::normals = clCreateBuffer(
+		Kernel::context, CL_MEM_WRITE_ONLY,
+		normal_bytes() * Kernel::n.size() * batch_size(), NULL, &err);
+	assert(!err);
+}
+
+// Arguments of the multi-launch step kernels on the Verlet state buffers.
+// Plain Jacobi until execute_kernel() sets the Chebyshev weights, and no
+// measuring sweep until it asks for one.
+void set_step_args() {
+	cl_int err;
+	cl_float omega = 0.f;
+	cl_int measure = 0;
+	err = clSetKernelArg(Kernel::updatePositionKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 2, sizeof(cl_mem), &Kernel::new_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 3, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 4, sizeof(cl_mem), &Kernel::weights);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 5, sizeof(cl_mem), &Kernel::tiles);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updatePositionKernel, 6, sizeof(cl_mem), &Kernel::tear);
+	clSetKernelArgAssert(err);
+
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 3, sizeof(cl_mem), &Kernel::lambda);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 4, sizeof(cl_mem), &Kernel::tiles);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::updateOldPositionKernel, 5, sizeof(cl_mem), &Kernel::tile_motion);
+	clSetKernelArgAssert(err);
+
+	// The Jacobi ping-pong, the even sweep reads new_positions
+	cl_kernel untiled[2] = { Kernel::constraintEvenKernel, Kernel::constraintOddKernel };
+	cl_mem* in[2] = { &Kernel::new_positions, &Kernel::positions };
+	cl_mem* out[2] = { &Kernel::positions, &Kernel::new_positions };
+	for (int k = 0; k < 2; k++) {
+		err = clSetKernelArg(untiled[k], 0, sizeof(cl_mem), in[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 1, sizeof(cl_mem), out[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 2, sizeof(ClothParams), &Kernel::params);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 3, sizeof(cl_mem), &Kernel::weights);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 4, sizeof(cl_mem), &Kernel::lambda);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 5, sizeof(cl_float), &omega);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 6, sizeof(cl_mem), &Kernel::correction);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 7, sizeof(cl_int), &measure);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 8, sizeof(cl_mem), &Kernel::tiles);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 9, sizeof(cl_mem), &Kernel::bending);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(untiled[k], 10, sizeof(cl_mem), &Kernel::tear);
+		clSetKernelArgAssert(err);
+	}
+
+	// The tiled kernels have the same ping-pong, their tile is set by set_tile_arg()
+	cl_kernel tiled[2] = { Kernel::constraintTiledEvenKernel, Kernel::constraintTiledOddKernel };
+	for (int k = 0; k < 2; k++) {
+		err = clSetKernelArg(tiled[k], 0, sizeof(cl_mem), in[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 1, sizeof(cl_mem), out[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 2, sizeof(ClothParams), &Kernel::params);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 3, sizeof(cl_mem), &Kernel::weights);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 5, sizeof(cl_mem), &Kernel::lambda);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 6, sizeof(cl_float), &omega);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 7, sizeof(cl_mem), &Kernel::correction);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 8, sizeof(cl_int), &measure);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 9, sizeof(cl_mem), &Kernel::bending);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(tiled[k], 10, sizeof(cl_mem), &Kernel::tear);
+		clSetKernelArgAssert(err);
+	}
+
+	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 0, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 1, sizeof(cl_mem), &Kernel::normals);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 3, sizeof(cl_mem), &Kernel::tiles);
+	clSetKernelArgAssert(err);
+
+	err = clSetKernelArg(Kernel::copyTilesKernel, 0, sizeof(cl_mem), &Kernel::new_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::copyTilesKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::copyTilesKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::copyTilesKernel, 3, sizeof(cl_mem), &Kernel::tiles);
+	clSetKernelArgAssert(err);
+}
+
+void reset_cloth_buffers() {
+	// Back to the rest pose held by the host mirror
+	write_positions(Kernel::old_positions, Kernel::pos);
+	write_positions(Kernel::positions, Kernel::pos);
+	Kernel::rest_wake = 2;
+	reset_tear();
+	// The pins back on their curves
+	Kernel::pin_until = std::max(Kernel::pin_until, Kernel::pin_time);
+}
+
+// Bytes per vertex of the position and normal buffers, see position_t in kernels.cl
+size_t position_bytes() {
+	switch (Globals::storage) {
+	case STORAGE_PACKED: return 3 * sizeof(cl_float);
+	case STORAGE_COMPACT: return sizeof(cl_ulong);
+	default: return sizeof(cl_float3);
+	}
+}
+
+size_t normal_bytes() {
+	switch (Globals::storage) {
+	case STORAGE_PACKED: return 3 * sizeof(cl_float);
+	case STORAGE_COMPACT: return 2 * sizeof(cl_short);
+	default: return sizeof(cl_float3);
+	}
+}
+
+const char* storage_name() {
+	switch (Globals::storage) {
+	case STORAGE_PACKED: return "packed";
+	case STORAGE_COMPACT: return "compact";
+	default: return "float3";
+	}
+}
+
+// Fixed point range of --storage compact: the rest pose grown by the cloth
+// diagonal on every side, which a cloth hanging from a pin or lying on the
+// sphere stays within. Positions beyond it saturate.
+void set_storage_range() {
+	float reach = std::sqrt(Globals::cloth_width * Globals::cloth_width + Globals::cloth_height * Globals::cloth_height);
+	for (int a = 0; a < 3; a++) {
+		float lo = Kernel::pos[0].s[a], hi = lo;
+		for (const cl_float3& v : Kernel::pos) {
+			lo = std::min(lo, v.s[a]);
+			hi = std::max(hi, v.s[a]);
+		}
+		Kernel::params.origin[a] = 0.5f * (lo + hi);
+		Kernel::params.quantum[a] = (0.5f * (hi - lo) + reach) / ((1 << (STORAGE_FIXED_BITS - 1)) - 1);
+	}
+}
+
+// in in the device layout of the positions, the compact one with the same
+// packing and rounding as store_position() in kernels.cl
+void encode_positions(const std::vector<cl_float3>& in, std::vector<char>& out) {
+	out.resize(position_bytes() * in.size());
+	for (size_t i = 0; i < in.size(); i++) {
+		char* dst = &out[position_bytes() * i];
+		if (Globals::storage == STORAGE_COMPACT) {
+			const float half = float(1 << (STORAGE_FIXED_BITS - 1));
+			cl_ulong w = 0;
+			for (int a = 0; a < 3; a++) {
+				float s = std::nearbyint((in[i].s[a] - Kernel::params.origin[a]) / Kernel::params.quantum[a]);
+				s = std::min(std::max(s, -half), half - 1.f) + half;
+				w |= cl_ulong(s) << (a * STORAGE_FIXED_BITS);
+			}
+			memcpy(dst, &w, sizeof(w));
+		} else {
+			memcpy(dst, &in[i], position_bytes());
+		}
+	}
+}
+
+void decode_positions(const std::vector<char>& in, std::vector<cl_float3>& out) {
+	for (size_t i = 0; i < out.size(); i++) {
+		const char* src = &in[position_bytes() * i];
+		if (Globals::storage == STORAGE_COMPACT) {
+			const cl_ulong mask = (cl_ulong(1) << STORAGE_FIXED_BITS) - 1;
+			const int half = 1 << (STORAGE_FIXED_BITS - 1);
+			cl_ulong w;
+			memcpy(&w, src, sizeof(w));
+			for (int a = 0; a < 3; a++) {
+				int s = int((w >> (a * STORAGE_FIXED_BITS)) & mask) - half;
+				out[i].s[a] = Kernel::params.origin[a] + Kernel::params.quantum[a] * s;
+			}
+		} else {
+			memcpy(&out[i], src, position_bytes());
+		}
+	}
+}
+
+// The compact layout is the inverse of store_normal() in kernels.cl
+void decode_normals(const std::vector<char>& in, std::vector<cl_float3>& out) {
+	for (size_t i = 0; i < out.size(); i++) {
+		const char* src = &in[normal_bytes() * i];
+		if (Globals::storage != STORAGE_COMPACT) {
+			memcpy(&out[i], src, normal_bytes());
+			continue;
+		}
+		cl_short e[2];
+		memcpy(e, src, sizeof(e));
+		float x = std::max(e[0] / 32767.f, -1.f);
+		float y = std::max(e[1] / 32767.f, -1.f);
+		float z = 1.f - std::fabs(x) - std::fabs(y);
+		if (z < 0.f) {
+			float fx = (1.f - std::fabs(y)) * (x >= 0.f ? 1.f : -1.f);
+			y = (1.f - std::fabs(x)) * (y >= 0.f ? 1.f : -1.f);
+			x = fx;
+		}
+		float len = std::sqrt(x * x + y * y + z * z);
+		out[i].x = x / len; out[i].y = y / len; out[i].z = z / len;
+	}
+}
+
+// Blocking, the layouts other than float3 are encoded into a temporary.
+// Every instance of --batch gets the same positions.
+void write_positions(cl_mem buffer, const std::vector<cl_float3>& in) {
+	cl_int err;
+	std::vector<char> codes;
+	encode_positions(in, codes);
+	for (size_t k = 0; k < batch_size(); k++) {
+		err = clEnqueueWriteBuffer(Kernel::commandQueue, buffer, CL_TRUE, codes.size() * k, codes.size(), &codes[0], 0, NULL, NULL);
+		assert(!err);
+	}
+}
+
+// Average wall time of one launch of kernel, after a warm up launch
+double time_kernel(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height) {
+	const int launches = 20;
+	enqueue_grid(kernel, config, width, height);
+	clFinish(Kernel::commandQueue);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < launches; i++)
+		enqueue_grid(kernel, config, width, height);
+	clFinish(Kernel::commandQueue);
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / launches;
+}
+
+// Prints the rows of a startup report that times b against a, with what b
+// costs over a and a warning above limit %, 0 for none. The timing runs move
+// the cloth, it is back at the rest pose afterwards.
+void compare_timings(const std::string& title, const char* a, const char* b,
+	const std::vector<TimingRow>& rows, double limit) {
+	std::cout << title << ":" << std::endl;
+	for (const TimingRow& row : rows) {
+		double first = row.a(), second = row.b();
+		double cost = 100.0 * (second / first - 1.0);
+		std::cout << "  " << row.name << ": " << a << " " << first * 1e6 << " us, " << b << " "
+			<< second * 1e6 << " us (" << cost << "%)" << std::endl;
+		if (limit > 0.0 && cost > limit)
+			std::cout << "WARNING: " << b << " " << row.name << " is more than " << limit << "% slower than "
+				<< a << " on this device" << std::endl;
+	}
+	reset_cloth_buffers();
+}
+
+// Kernels a and b over the grid with the same launch
+TimingRow kernel_row(const char* name, cl_kernel a, cl_kernel b, const LaunchConfig& config) {
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
+	return {
+		name,
+		[=]() { return time_kernel(a, config, width, height); },
+		[=]() { return time_kernel(b, config, width, height); }
+	};
+}
+
+// --bandwidth: times the kernels of a step and prints the memory they move
+// at least, each position and normal read or written once per vertex. A
+// float3 build of kernels.cl is timed next to the other layouts, and both
+// time a whole multi-launch step.
+void bandwidth_report() {
+	if (!Globals::bandwidth) return;
+
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
+	const char* names[4] = { "update_position", "update_old_position", "constraint", "calculate_normals" };
+	if (csr_topology()) {
+		names[2] = "mesh_constraint";
+		names[3] = "mesh_normals";
+	}
+	struct {
+		const char* name;
+		size_t position, normal;	// bytes per vertex
+		double kernels[4], step;
+	} layouts[2];
+	auto measure = [&](int l) {
+		layouts[l].name = storage_name();
+		layouts[l].position = position_bytes();
+		layouts[l].normal = normal_bytes();
+		cl_kernel kernels[4] = { Kernel::updatePositionKernel, Kernel::updateOldPositionKernel,
+			Kernel::tile_size ? Kernel::constraintTiledEvenKernel : Kernel::constraintEvenKernel, Kernel::calculateNoramlsKernel };
+		if (csr_topology()) {
+			kernels[2] = Kernel::meshConstraintEvenKernel;
+			kernels[3] = Kernel::meshNormalsKernel;
+		}
+		const LaunchConfig* configs[4] = { &Kernel::launch_update, &Kernel::launch_old, &Kernel::launch_constraint, &Kernel::launch_normals };
+		for (int k = 0; k < 4; k++)
+			layouts[l].kernels[k] = time_kernel(kernels[k], *configs[k], width, height);
+		layouts[l].step = time_steps(30);
+	};
+
+	// The other build only has the step kernels of one cloth on the grid stencil
+	bool compare = Globals::storage != STORAGE_FLOAT3 && !csr_topology() && !batched();
+	size_t fused_size = Kernel::fused_size;
+	Kernel::fused_size = 0;
+	measure(0);
+	if (compare) {
+		StepBuild reference = create_step_build(STORAGE_FLOAT3, Globals::deterministic);
+		swap_step_build(reference);
+		measure(1);
+		swap_step_build(reference);
+		release_step_build(reference);
+	}
+	Kernel::fused_size = fused_size;
+	reset_cloth_buffers();
+
+	int count = compare ? 2 : 1;
+	std::cout << "Bandwidth of the " << layouts[0].name << " layout (" << layouts[0].position << " bytes per position, "
+		<< layouts[0].normal << " per normal)";
+	if (compare)
+		std::cout << " against float3 (" << layouts[1].position << " and " << layouts[1].normal << ")";
+	std::cout << ":" << std::endl;
+	for (int k = 0; k < 4; k++) {
+		std::cout << "  " << names[k] << ":";
+		for (int l = 0; l < count; l++) {
+			size_t pb = layouts[l].position, nb = layouts[l].normal;
+			size_t bytes[4] = { 3 * pb, 3 * pb, 2 * pb, pb + nb };
+			double time = layouts[l].kernels[k];
+			std::cout << (l ? ", " : " ") << layouts[l].name << " " << time * 1e6 << " us "
+				<< bytes[k] * Kernel::pos.size() / time * 1e-9 << " GB/s";
+		}
+		std::cout << std::endl;
+	}
+	std::cout << "  multi-launch step:";
+	for (int l = 0; l < count; l++)
+		std::cout << (l ? ", " : " ") << layouts[l].name << " " << layouts[l].step * 1e3 << " ms";
+	std::cout << std::endl;
+}
+
+// kernels.cl built for storage next to the build in use, for the startup
+// reports. Its Verlet state starts at the rest pose of the host mirror, its
+// kernels share every other buffer and the launches of the build in use.
+StepBuild create_step_build(Storage storage, bool deterministic) {
+	cl_int err;
+	std::stringstream kernel_file; kernel_file << MY_CUR_DIR << "kernels/kernels.cl";
+	StepBuild build = {};
+	build.storage = storage;
+	build.program = build_prog(kernel_file.str(), deterministic, storage);
+	struct {
+		cl_kernel* kernel;
+		const char* name;
+	} kernels[] = {
+		{ &build.update, "update_position" },
+		{ &build.old, "update_old_position" },
+		{ &build.even, "constraint" },
+		{ &build.odd, "constraint" },
+		{ &build.tiled_even, "constraint_tiled" },
+		{ &build.tiled_odd, "constraint_tiled" },
+		{ &build.normals, "calculate_normals" },
+		{ &build.copy_tiles, "copy_tiles" },
+		{ &build.pin_targets, "pin_targets" }
+	};
+	for (const auto& k : kernels) {
+		*k.kernel = clCreateKernel(build.program, k.name, &err);
+		clCreateKernelAssert(err);
+	}
+
+	// Buffers and arguments as set_buffer_kernel() sets them, in its layout
+	swap_step_build(build);
+	create_state_buffers();
+	set_step_args();
+	set_pin_target_args();
+	if (Kernel::tile_size)
+		set_tile_arg(Kernel::tile_size);
+	swap_step_build(build);
+	return build;
+}
+
+// Only the multi-launch step on the grid stencil runs another build, the
+// callers keep Kernel::fused_size at 0 while it is swapped in
+void swap_step_build(StepBuild& build) {
+	std::swap(Globals::storage, build.storage);
+	std::swap(Kernel::updatePositionKernel, build.update);
+	std::swap(Kernel::updateOldPositionKernel, build.old);
+	std::swap(Kernel::constraintEvenKernel, build.even);
+	std::swap(Kernel::constraintOddKernel, build.odd);
+	std::swap(Kernel::constraintTiledEvenKernel, build.tiled_even);
+	std::swap(Kernel::constraintTiledOddKernel, build.tiled_odd);
+	std::swap(Kernel::calculateNoramlsKernel, build.normals);
+	std::swap(Kernel::copyTilesKernel, build.copy_tiles);
+	std::swap(Kernel::pinTargetsKernel, build.pin_targets);
+	std::swap(Kernel::old_positions, build.old_positions);
+	std::swap(Kernel::positions, build.positions);
+	std::swap(Kernel::new_positions, build.new_positions);
+	std::swap(Kernel::normals, build.normals_buffer);
+}
+
+void release_step_build(StepBuild& build) {
+	cl_kernel kernels[] = { build.update, build.old, build.even, build.odd, build.tiled_even,
+		build.tiled_odd, build.normals, build.copy_tiles, build.pin_targets };
+	for (cl_kernel kernel : kernels)
+		clReleaseKernel(kernel);
+	clReleaseProgram(build.program);
+	clReleaseMemObject(build.old_positions);
+	clReleaseMemObject(build.positions);
+	clReleaseMemObject(build.new_positions);
+	clReleaseMemObject(build.normals_buffer);
+}
+
+// --storage compact: simulates STORAGE_REPORT_STEPS from the rest pose with
+// the compact build and a float3 build of the same kernels.cl, and prints
+// how far apart they end up. Both take the multi-launch step with the same
+// parameters and launches, so only the layout differs.
+void storage_report() {
+	if (Globals::storage != STORAGE_COMPACT) return;
+
+	StepBuild reference = create_step_build(STORAGE_FLOAT3, Globals::deterministic);
+	size_t fused_size = Kernel::fused_size;
+	Kernel::fused_size = 0;
+	cl_float pin_time = Kernel::pin_time;
+	// The host mirror keeps the rest pose for reset_cloth_buffers()
+	std::vector<cl_float3> pos = Kernel::pos, prev = Kernel::prev, n = Kernel::n;
+	std::vector<cl_float3> ends[2], end_normals[2];
+	for (int r = 0; r < 2; r++) {
+		if (r == 1)
+			swap_step_build(reference);
+		Kernel::pin_time = pin_time;
+		reset_cloth_buffers();
+		for (int s = 0; s < STORAGE_REPORT_STEPS; s++)
+			execute_kernel(s == STORAGE_REPORT_STEPS - 1);
+		get_result_from_kernel();
+		ends[r].swap(Kernel::pos);
+		end_normals[r].swap(Kernel::n);
+		Kernel::pos = pos;
+		Kernel::n = n;
+		if (r == 1)
+			swap_step_build(reference);
+	}
+	release_step_build(reference);
+	Kernel::prev.swap(prev);
+	Kernel::fused_size = fused_size;
+	Kernel::pin_time = pin_time;
+	reset_cloth_buffers();
+
+	double squares = 0.0;
+	float largest = 0.f, normal_cos = 1.f, quantum = 0.f;
+	for (size_t i = 0; i < pos.size(); i++) {
+		const cl_float3& x = ends[0][i];
+		const cl_float3& y = ends[1][i];
+		float dx = x.x - y.x, dy = x.y - y.y, dz = x.z - y.z;
+		float d = std::sqrt(dx * dx + dy * dy + dz * dz);
+		squares += d * d;
+		largest = std::max(largest, d);
+		const cl_float3& m = end_normals[0][i];
+		const cl_float3& k = end_normals[1][i];
+		normal_cos = std::min(normal_cos, m.x * k.x + m.y * k.y + m.z * k.z);
+	}
+	for (int a = 0; a < 3; a++)
+		quantum = std::max(quantum, Kernel::params.quantum[a]);
+
+	std::cout << "Compact storage: " << 3 * position_bytes() + normal_bytes() << " bytes per vertex instead of "
+		<< 4 * sizeof(cl_float3) << ", position quantum up to " << quantum << std::endl;
+	std::cout << "Compact storage error after " << STORAGE_REPORT_STEPS << " steps against the float3 build: rms "
+		<< std::sqrt(squares / pos.size()) << ", max " << largest << ", normals up to "
+		<< std::acos(std::max(-1.f, std::min(1.f, normal_cos))) * 180.f / PI << " degrees" << std::endl;
+}
+
+// Another work-group shape for kernel than local: the first one the tuner
+// would try, or the driver's choice when there is none
+WorkGroup other_work_group(cl_kernel kernel, const WorkGroup& local) {
+	for (const WorkGroup& shape : Kernel::tuner->default_candidates(kernel))
+		if (shape.x && (shape.x != local.x || shape.y != local.y))
+			return shape;
+	return { 0, 0 };
+}
+
+// --deterministic: two runs of DETERMINISM_REPORT_STEPS from the rest pose
+// have to give the same bits, the second with other work-groups and the
+// other constraint kernel where the tiled one fits. The step kernels are
+// timed against the fast build of kernels.cl.
+void determinism_report() {
+	if (!Globals::deterministic) return;
+
+	// The batch kernels and rest detection fix their work-groups
+	bool reshape = !batched() && !Kernel::params.rest_tiles;
+	size_t max_tile = csr_topology() ? 0 : max_tile_size();
+	cl_kernel constraint = csr_topology() ? Kernel::meshConstraintEvenKernel : Kernel::constraintEvenKernel;
+	cl_kernel normals = csr_topology() ? Kernel::meshNormalsKernel : Kernel::calculateNoramlsKernel;
+	LaunchConfig* configs[4] = { &Kernel::launch_update, &Kernel::launch_old, &Kernel::launch_constraint, &Kernel::launch_normals };
+	cl_kernel kernels[4] = { Kernel::updatePositionKernel, Kernel::updateOldPositionKernel, constraint, normals };
+	LaunchConfig launches[4] = { *configs[0], *configs[1], *configs[2], *configs[3] };
+	size_t tile_size = Kernel::tile_size;
+	std::string shape = reshape ? "other work-groups" : "the work-groups the batch or rest detection fix";
+
+	// The host mirror keeps the rest pose for reset_cloth_buffers()
+	std::vector<cl_float3> pos = Kernel::pos, prev = Kernel::prev, n = Kernel::n;
+	std::vector<cl_float3> runs[2];
+	for (int r = 0; r < 2; r++) {
+		if (r == 1 && reshape) {
+			for (int k = 0; k < 4; k++)
+				*configs[k] = { 0, other_work_group(kernels[k], launches[k].local) };
+			if (tile_size) {
+				Kernel::tile_size = 0;
+				shape += " and the untiled constraint";
+			} else if (max_tile) {
+				Kernel::tile_size = max_tile;
+				Kernel::launch_constraint = { 1, { max_tile, max_tile } };
+				set_tile_arg(max_tile);
+				shape += " and the tiled constraint";
+			}
+		}
+		reset_cloth_buffers();
+		for (int s = 0; s < DETERMINISM_REPORT_STEPS; s++)
+			execute_kernel(s == DETERMINISM_REPORT_STEPS - 1);
+		get_result_from_kernel();
+		runs[r].swap(Kernel::pos);
+		Kernel::pos = pos;
+	}
+	Kernel::prev.swap(prev);
+	Kernel::n.swap(n);
+	for (int k = 0; k < 4; k++)
+		*configs[k] = launches[k];
+	Kernel::tile_size = tile_size;
+	if (tile_size)
+		set_tile_arg(tile_size);
+	size_t differing = 0;
+	for (size_t i = 0; i < pos.size(); i++)
+		differing += memcmp(&runs[0][i], &runs[1][i], 3 * sizeof(cl_float)) != 0;
+
+	// The kernels and launches of the first run in both builds
+	StepBuild fast = create_step_build(Globals::storage, false);
+	const char* names[4] = { "update_position", "update_old_position", "constraint", "calculate_normals" };
+	cl_kernel strict[4] = { Kernel::updatePositionKernel, Kernel::updateOldPositionKernel,
+		tile_size ? Kernel::constraintTiledEvenKernel : Kernel::constraintEvenKernel, Kernel::calculateNoramlsKernel };
+	cl_kernel relaxed[4] = { fast.update, fast.old, tile_size ? fast.tiled_even : fast.even, fast.normals };
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
+	double total[2] = { 0.0, 0.0 };
+	std::cout << "Deterministic kernels against the fast build:" << std::endl;
+	for (int k = 0; k < 4; k++) {
+		double time[2] = { time_kernel(strict[k], launches[k], width, height), time_kernel(relaxed[k], launches[k], width, height) };
+		total[0] += time[0];
+		total[1] += time[1];
+		std::cout << "  " << names[k] << ": " << time[0] * 1e6 << " us, fast " << time[1] * 1e6 << " us" << std::endl;
+	}
+	release_step_build(fast);
+	reset_cloth_buffers();
+
+	std::cout << "Deterministic mode: two runs of " << DETERMINISM_REPORT_STEPS << " steps, the second with " << shape << ", ";
+	if (differing)
+		std::cout << "DIFFER in " << differing << " vertices";
+	else
+		std::cout << "are identical";
+	std::cout << ", step kernels " << 100.0 * (total[0] / total[1] - 1.0) << "% slower than the fast build" << std::endl;
+}
+
+// --deterministic on the cpu: the same steps on one thread and on all of
+// them have to give the same bits, the SIMD constraints give the cost
+void cpu_determinism_report() {
+	if (!Globals::deterministic) return;
+
+	ClothSolver* solvers[3] = {
+		create_cpu_solver(1, SIMD_SCALAR),
+		create_cpu_solver(Globals::cpu_threads, SIMD_SCALAR),
+		create_cpu_solver(Globals::cpu_threads, Globals::cpu_simd)
+	};
+	double time[3];
+	for (int k = 0; k < 3; k++) {
+		auto start = std::chrono::steady_clock::now();
+		for (int s = 0; s < DETERMINISM_REPORT_STEPS; s++)
+			solvers[k]->step(s == DETERMINISM_REPORT_STEPS - 1);
+		time[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / DETERMINISM_REPORT_STEPS;
+	}
+	size_t differing = 0;
+	for (size_t i = 0; i < Kernel::pos.size(); i++) {
+		Float3 a = solvers[0]->get_position(i), b = solvers[1]->get_position(i);
+		differing += memcmp(&a, &b, sizeof(Float3)) != 0;
+	}
+
+	std::cout << "Deterministic mode: " << DETERMINISM_REPORT_STEPS << " steps on 1 and " << solvers[1]->thread_count() << " threads ";
+	if (differing)
+		std::cout << "DIFFER in " << differing << " vertices";
+	else
+		std::cout << "are identical";
+	std::cout << ", " << time[1] * 1e3 << " ms per step against " << time[2] * 1e3 << " ms with "
+		<< simd_isa_name(solvers[2]->simd_isa()) << " constraints" << std::endl;
+	for (ClothSolver* solver : solvers)
+		delete solver;
+}
+
+void build_multigrid() {
+	Kernel::levels.clear();
+	if (Globals::solver_mode != SOLVER_MULTIGRID) return;
+
+	cl_int err;
+	ClothParams fine = Kernel::params;
+	std::vector<char> fine_pinned(Kernel::pos.size(), 0);
+	for (unsigned int pin : Globals::cloth_pins)
+		if (pin < fine_pinned.size()) fine_pinned[pin] = 1;
+
+	// An odd side keeps its last row or column, see fine_of in kernels.cl
+	while ((fine.row + 1) / 2 >= MULTIGRID_MIN_SIDE && (fine.col + 1) / 2 >= MULTIGRID_MIN_SIDE) {
+		CoarseGrid level;
+		level.params = fine;
+		level.params.row = (fine.row + 1) / 2;
+		level.params.col = (fine.col + 1) / 2;
+		level.params.dx = 2.f * fine.dx;
+		level.params.dy = 2.f * fine.dy;
+
+		// A coarse vertex next to a pin would drag the pinned cloth along,
+		// same rule as ClothSolver::set_multigrid()
+		std::vector<char> pinned(size_t(level.params.row + 1) * size_t(level.params.col + 1), 0);
+		std::vector<cl_int> pins;
+		for (int i = 0; i <= level.params.row; i++) {
+			for (int j = 0; j <= level.params.col; j++) {
+				size_t idx = size_t(j + (level.params.col + 1) * i);
+				int fi = std::min(2 * i, fine.row), fj = std::min(2 * j, fine.col);
+				for (int a = std::max(0, fi - 1); a <= std::min(fine.row, fi + 1); a++)
+					for (int b = std::max(0, fj - 1); b <= std::min(fine.col, fj + 1); b++)
+						pinned[idx] |= fine_pinned[b + (fine.col + 1) * a];
+				if (pinned[idx])
+					pins.push_back((cl_int)idx);
+			}
+		}
+		level.params.pin_count = (int)pins.size();
+		pins.push_back(-1); // buffers cannot be empty
+
+		size_t bytes = sizeof(cl_float3) * pinned.size();
+		cl_mem* buffers[4] = { &level.positions, &level.new_positions, &level.restricted, &level.force };
+		for (cl_mem* buffer : buffers) {
+			*buffer = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+			assert(!err);
+		}
+		level.pins = clCreateBuffer(
+			Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_int) * pins.size(), &pins[0], &err);
+		assert(!err);
+
+		level.even = clCreateKernel(Kernel::program, "constraint_coarse", &err);
+		clCreateKernelAssert(err);
+		level.odd = clCreateKernel(Kernel::program, "constraint_coarse", &err);
+		clCreateKernelAssert(err);
+		cl_kernel kernels[2] = { level.even, level.odd };
+		cl_mem* in[2] = { &level.new_positions, &level.positions };
+		cl_mem* out[2] = { &level.positions, &level.new_positions };
+		for (int k = 0; k < 2; k++) {
+			err = clSetKernelArg(kernels[k], 0, sizeof(cl_mem), in[k]);
+			clSetKernelArgAssert(err);
+			err = clSetKernelArg(kernels[k], 1, sizeof(cl_mem), out[k]);
+			clSetKernelArgAssert(err);
+			err = clSetKernelArg(kernels[k], 2, sizeof(ClothParams), &level.params);
+			clSetKernelArgAssert(err);
+			err = clSetKernelArg(kernels[k], 3, sizeof(cl_mem), &level.pins);
+			clSetKernelArgAssert(err);
+			err = clSetKernelArg(kernels[k], 4, sizeof(cl_mem), &level.force);
+			clSetKernelArgAssert(err);
+		}
+
+		Kernel::levels.push_back(level);
+		fine = level.params;
+		fine_pinned.swap(pinned);
+	}
+
+	if (Kernel::levels.empty())
+		std::cout << "WARNING: the cloth is too small for a coarse grid, multigrid runs plain jacobi sweeps..." << std::endl;
+	else
+		std::cout << "SUCCESS: multigrid with " << Kernel::levels.size() + 1 << " level(s)..." << std::endl;
+}
+
+void release_multigrid() {
+	for (CoarseGrid& level : Kernel::levels) {
+		clReleaseMemObject(level.positions);
+		clReleaseMemObject(level.new_positions);
+		clReleaseMemObject(level.restricted);
+		clReleaseMemObject(level.force);
+		clReleaseMemObject(level.pins);
+		clReleaseKernel(level.even);
+		clReleaseKernel(level.odd);
+	}
+	Kernel::levels.clear();
+}
+
+// One V-cycle, the same passes as ClothSolver::multigrid_cycle(). Every
+// grid keeps its last two iterates in positions (x1) and new_positions (x2).
+void multigrid_cycle(size_t width, size_t height) {
+	// The coarse grids are small, their launches are left to the driver
+	const LaunchConfig untuned = { 0, { 0, 0 } };
+	const int coarsest = (int)Kernel::levels.size();
+	const int pre = std::max(2, MULTIGRID_SMOOTH_SWEEPS + MULTIGRID_SMOOTH_SWEEPS % 2);
+	const int coarse_sweeps = std::max(2, MULTIGRID_COARSE_SWEEPS + MULTIGRID_COARSE_SWEEPS % 2);
+
+	auto set_arg = [](cl_kernel kernel, cl_uint index, size_t size, const void* value) {
+		cl_int err = clSetKernelArg(kernel, index, size, value);
+		clSetKernelArgAssert(err);
+	};
+	auto smooth = [&](int level, int sweeps) {
+		for (int i = 0; i < sweeps; i++) {
+			if (level == 0) {
+				cl_kernel even = Kernel::tile_size ? Kernel::constraintTiledEvenKernel : Kernel::constraintEvenKernel;
+				cl_kernel odd = Kernel::tile_size ? Kernel::constraintTiledOddKernel : Kernel::constraintOddKernel;
+				enqueue_kernel(i % 2 == 0 ? even : odd, Kernel::launch_constraint, width, height);
+			} else {
+				const CoarseGrid& grid = Kernel::levels[level - 1];
+				enqueue_kernel(i % 2 == 0 ? grid.even : grid.odd, untuned, grid.params.row + 1, grid.params.col + 1);
+			}
+		}
+	};
+
+	for (int l = 0; l < coarsest; l++) {
+		smooth(l, pre);
+
+		CoarseGrid& coarse = Kernel::levels[l];
+		const ClothParams& fine_params = l ? Kernel::levels[l - 1].params : Kernel::params;
+		cl_mem& x1 = l ? Kernel::levels[l - 1].positions : Kernel::positions;
+		cl_mem& x2 = l ? Kernel::levels[l - 1].new_positions : Kernel::new_positions;
+		size_t coarse_width = size_t(coarse.params.row + 1);
+		size_t coarse_height = size_t(coarse.params.col + 1);
+
+		set_arg(Kernel::restrictLevelKernel, 0, sizeof(cl_mem), &x1);
+		set_arg(Kernel::restrictLevelKernel, 1, sizeof(ClothParams), &fine_params);
+		set_arg(Kernel::restrictLevelKernel, 2, sizeof(cl_mem), &coarse.new_positions);
+		set_arg(Kernel::restrictLevelKernel, 3, sizeof(cl_mem), &coarse.positions);
+		set_arg(Kernel::restrictLevelKernel, 4, sizeof(cl_mem), &coarse.restricted);
+		set_arg(Kernel::restrictLevelKernel, 5, sizeof(cl_mem), &coarse.force);
+		set_arg(Kernel::restrictLevelKernel, 6, sizeof(ClothParams), &coarse.params);
+		enqueue_kernel(Kernel::restrictLevelKernel, untuned, coarse_width, coarse_height);
+
+		// S(R x1) with a zero force, then the real forcing term
+		enqueue_kernel(coarse.even, untuned, coarse_width, coarse_height);
+
+		set_arg(Kernel::restrictForceKernel, 0, sizeof(cl_mem), &x1);
+		set_arg(Kernel::restrictForceKernel, 1, sizeof(cl_mem), &x2);
+		set_arg(Kernel::restrictForceKernel, 2, sizeof(ClothParams), &fine_params);
+		set_arg(Kernel::restrictForceKernel, 3, sizeof(cl_mem), &coarse.new_positions);
+		set_arg(Kernel::restrictForceKernel, 4, sizeof(cl_mem), &coarse.positions);
+		set_arg(Kernel::restrictForceKernel, 5, sizeof(cl_mem), &coarse.restricted);
+		set_arg(Kernel::restrictForceKernel, 6, sizeof(cl_mem), &coarse.force);
+		set_arg(Kernel::restrictForceKernel, 7, sizeof(ClothParams), &coarse.params);
+		enqueue_kernel(Kernel::restrictForceKernel, untuned, coarse_width, coarse_height);
+	}
+
+	smooth(coarsest, coarsest ? coarse_sweeps : pre);
+
+	for (int l = coarsest; l > 0; l--) {
+		CoarseGrid& coarse = Kernel::levels[l - 1];
+		const ClothParams& fine_params = l > 1 ? Kernel::levels[l - 2].params : Kernel::params;
+		cl_mem& x1 = l > 1 ? Kernel::levels[l - 2].positions : Kernel::positions;
+		cl_mem& fine = l > 1 ? Kernel::levels[l - 2].new_positions : Kernel::new_positions;
+		cl_mem& fine_pins = l > 1 ? Kernel::levels[l - 2].pins : Kernel::pins;
+
+		set_arg(Kernel::prolongateLevelKernel, 0, sizeof(cl_mem), &coarse.new_positions);
+		set_arg(Kernel::prolongateLevelKernel, 1, sizeof(cl_mem), &coarse.restricted);
+		set_arg(Kernel::prolongateLevelKernel, 2, sizeof(ClothParams), &coarse.params);
+		set_arg(Kernel::prolongateLevelKernel, 3, sizeof(cl_mem), &x1);
+		set_arg(Kernel::prolongateLevelKernel, 4, sizeof(cl_mem), &fine);
+		set_arg(Kernel::prolongateLevelKernel, 5, sizeof(ClothParams), &fine_params);
+		set_arg(Kernel::prolongateLevelKernel, 6, sizeof(cl_mem), &fine_pins);
+		enqueue_kernel(Kernel::prolongateLevelKernel, untuned, size_t(fine_params.row + 1), size_t(fine_params.col + 1));
+
+		smooth(l - 1, pre);
+	}
+}
+
+void build_implicit() {
+	if (!Globals::implicit) return;
+
+	cl_int err;
+	size_t bytes = sizeof(cl_float3) * Kernel::pos.size();
+	cl_mem* buffers[6] = { &Kernel::cg_dv, &Kernel::cg_r, &Kernel::cg_z, &Kernel::cg_dir, &Kernel::cg_q, &Kernel::cg_diag };
+	for (cl_mem* buffer : buffers) {
+		*buffer = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+		assert(!err);
+	}
+
+	// Power of two work-groups for the tree reductions, a few per compute unit
+	size_t max_group = 0;
+	cl_uint units = 1;
+	err = clGetKernelWorkGroupInfo(Kernel::dotPartialKernel, Kernel::devices[0], CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+	err |= clGetDeviceInfo(Kernel::devices[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+	assert(!err);
+	for (Kernel::dot_group = 1; Kernel::dot_group * 2 <= std::min(max_group, size_t(256)); Kernel::dot_group *= 2);
+	Kernel::dot_groups = std::max(size_t(1), std::min(size_t(4 * units), (Kernel::pos.size() + Kernel::dot_group - 1) / Kernel::dot_group));
+
+	Kernel::dot_partials = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, sizeof(cl_float) * Kernel::dot_groups, NULL, &err);
+	assert(!err);
+	Kernel::cg_scalars = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, sizeof(cl_float) * 4, NULL, &err);
+	assert(!err);
+
+	auto set_arg = [](cl_kernel kernel, cl_uint index, size_t size, const void* value) {
+		cl_int err = clSetKernelArg(kernel, index, size, value);
+		clSetKernelArgAssert(err);
+	};
+	cl_int count = (cl_int)Kernel::pos.size();
+	cl_int partial_count = (cl_int)Kernel::dot_groups;
+
+	set_arg(Kernel::implicitPrepareKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	set_arg(Kernel::implicitPrepareKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	set_arg(Kernel::implicitPrepareKernel, 2, sizeof(cl_mem), &Kernel::cg_dv);
+	set_arg(Kernel::implicitPrepareKernel, 3, sizeof(cl_mem), &Kernel::cg_r);
+	set_arg(Kernel::implicitPrepareKernel, 4, sizeof(cl_mem), &Kernel::cg_z);
+	set_arg(Kernel::implicitPrepareKernel, 5, sizeof(cl_mem), &Kernel::cg_dir);
+	set_arg(Kernel::implicitPrepareKernel, 6, sizeof(cl_mem), &Kernel::cg_diag);
+	set_arg(Kernel::implicitPrepareKernel, 7, sizeof(ClothParams), &Kernel::params);
+	set_arg(Kernel::implicitPrepareKernel, 8, sizeof(cl_mem), &Kernel::weights);
+
+	set_arg(Kernel::implicitMultiplyKernel, 0, sizeof(cl_mem), &Kernel::cg_dir);
+	set_arg(Kernel::implicitMultiplyKernel, 1, sizeof(cl_mem), &Kernel::cg_q);
+	set_arg(Kernel::implicitMultiplyKernel, 2, sizeof(cl_mem), &Kernel::positions);
+	set_arg(Kernel::implicitMultiplyKernel, 3, sizeof(ClothParams), &Kernel::params);
+	set_arg(Kernel::implicitMultiplyKernel, 4, sizeof(cl_mem), &Kernel::weights);
+
+	// The vectors of dot_partial and the slot of dot_final change per call
+	set_arg(Kernel::dotPartialKernel, 2, sizeof(cl_int), &count);
+	set_arg(Kernel::dotPartialKernel, 3, sizeof(cl_mem), &Kernel::dot_partials);
+	set_arg(Kernel::dotPartialKernel, 4, sizeof(cl_float) * Kernel::dot_group, NULL);
+	set_arg(Kernel::dotFinalKernel, 0, sizeof(cl_mem), &Kernel::dot_partials);
+	set_arg(Kernel::dotFinalKernel, 1, sizeof(cl_int), &partial_count);
+	set_arg(Kernel::dotFinalKernel, 2, sizeof(cl_mem), &Kernel::cg_scalars);
+	set_arg(Kernel::dotFinalKernel, 4, sizeof(cl_float) * Kernel::dot_group, NULL);
+
+	set_arg(Kernel::cgStepKernel, 0, sizeof(cl_mem), &Kernel::cg_dv);
+	set_arg(Kernel::cgStepKernel, 1, sizeof(cl_mem), &Kernel::cg_r);
+	set_arg(Kernel::cgStepKernel, 2, sizeof(cl_mem), &Kernel::cg_z);
+	set_arg(Kernel::cgStepKernel, 3, sizeof(cl_mem), &Kernel::cg_dir);
+	set_arg(Kernel::cgStepKernel, 4, sizeof(cl_mem), &Kernel::cg_q);
+	set_arg(Kernel::cgStepKernel, 5, sizeof(cl_mem), &Kernel::cg_diag);
+	set_arg(Kernel::cgStepKernel, 6, sizeof(cl_mem), &Kernel::cg_scalars);
+	set_arg(Kernel::cgStepKernel, 8, sizeof(ClothParams), &Kernel::params);
+
+	set_arg(Kernel::cgDirectionKernel, 0, sizeof(cl_mem), &Kernel::cg_z);
+	set_arg(Kernel::cgDirectionKernel, 1, sizeof(cl_mem), &Kernel::cg_dir);
+	set_arg(Kernel::cgDirectionKernel, 2, sizeof(cl_mem), &Kernel::cg_scalars);
+	set_arg(Kernel::cgDirectionKernel, 5, sizeof(ClothParams), &Kernel::params);
+
+	set_arg(Kernel::implicitFinishKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	set_arg(Kernel::implicitFinishKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	set_arg(Kernel::implicitFinishKernel, 2, sizeof(cl_mem), &Kernel::cg_dv);
+	set_arg(Kernel::implicitFinishKernel, 3, sizeof(ClothParams), &Kernel::params);
+	set_arg(Kernel::implicitFinishKernel, 4, sizeof(cl_mem), &Kernel::weights);
+
+	std::cout << "SUCCESS: implicit integrator, time step " << time_step() << " s..." << std::endl;
+}
+
+void release_implicit() {
+	if (!Globals::implicit) return;
+
+	clReleaseMemObject(Kernel::cg_dv);
+	clReleaseMemObject(Kernel::cg_r);
+	clReleaseMemObject(Kernel::cg_z);
+	clReleaseMemObject(Kernel::cg_dir);
+	clReleaseMemObject(Kernel::cg_q);
+	clReleaseMemObject(Kernel::cg_diag);
+	clReleaseMemObject(Kernel::dot_partials);
+	clReleaseMemObject(Kernel::cg_scalars);
+}
+
+// Factors the global system once per cloth, the pins only move within
+// their identity rows so the factor stays valid
+void build_projective() {
+	if (Globals::solver_mode != SOLVER_PROJECTIVE) return;
+
+	auto start = std::chrono::steady_clock::now();
+	ProjectiveSystem system(Globals::cloth_row, Globals::cloth_col, Globals::cloth_pins, DELTA_TIME,
+		SPRING_STRETCH_STIFFNESS, SPRING_SHEAR_STIFFNESS, SPRING_BEND_STIFFNESS);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	cl_int err;
+	size_t bytes = sizeof(cl_float3) * Kernel::pos.size();
+	Kernel::pd_rhs = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+	assert(!err);
+	Kernel::pd_y = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, bytes, NULL, &err);
+	assert(!err);
+	Kernel::pd_factor = clCreateBuffer(Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_float) * system.factor().size(), (void*)system.factor().data(), &err);
+	assert(!err);
+	Kernel::pd_band = system.bandwidth();
+
+	size_t max_group = 0;
+	err = clGetKernelWorkGroupInfo(Kernel::projectiveSolveKernel, Kernel::devices[0], CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+	assert(!err);
+	Kernel::pd_group = std::max(size_t(1), std::min(max_group, size_t(256)));
+
+	auto set_arg = [](cl_kernel kernel, cl_uint index, size_t size, const void* value) {
+		cl_int err = clSetKernelArg(kernel, index, size, value);
+		clSetKernelArgAssert(err);
+	};
+	set_arg(Kernel::projectiveLocalKernel, 0, sizeof(cl_mem), &Kernel::new_positions);
+	set_arg(Kernel::projectiveLocalKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	set_arg(Kernel::projectiveLocalKernel, 2, sizeof(cl_mem), &Kernel::pd_rhs);
+	set_arg(Kernel::projectiveLocalKernel, 3, sizeof(ClothParams), &Kernel::params);
+	set_arg(Kernel::projectiveLocalKernel, 4, sizeof(cl_mem), &Kernel::pins);
+
+	set_arg(Kernel::projectiveSolveKernel, 0, sizeof(cl_mem), &Kernel::pd_rhs);
+	set_arg(Kernel::projectiveSolveKernel, 1, sizeof(cl_mem), &Kernel::pd_y);
+	set_arg(Kernel::projectiveSolveKernel, 2, sizeof(cl_mem), &Kernel::pd_factor);
+	set_arg(Kernel::projectiveSolveKernel, 3, sizeof(cl_int), &Kernel::pd_band);
+	set_arg(Kernel::projectiveSolveKernel, 4, sizeof(ClothParams), &Kernel::params);
+	set_arg(Kernel::projectiveSolveKernel, 5, sizeof(cl_mem), &Kernel::positions);
+	set_arg(Kernel::projectiveSolveKernel, 6, sizeof(cl_mem), &Kernel::pins);
+
+	std::cout << "SUCCESS: Projective Dynamics system factored, bandwidth " << Kernel::pd_band
+		<< ", " << elapsed * 1e3 << " ms..." << std::endl;
+}
+
+void release_projective() {
+	if (Globals::solver_mode != SOLVER_PROJECTIVE) return;
+
+	clReleaseMemObject(Kernel::pd_rhs);
+	clReleaseMemObject(Kernel::pd_y);
+	clReleaseMemObject(Kernel::pd_factor);
+}
+
+// --batch: the instances, batch copies of the defaults or one per line of
+// the batch file as "TAU KD GRAVITY PINS". Fields left out keep the
+// defaults, PINS is a comma separated list like --pins, or - for none.
+void load_batch() {
+	Kernel::instances.clear();
+	Kernel::batch_pins.clear();
+	if (!batched()) return;
+
+	std::vector<std::string> lines(Globals::batch);
+	if (!Globals::batch_file.empty()) {
+		std::ifstream in(Globals::batch_file);
+		if (!in) {
+			std::cout << "ERROR: cannot open the batch file " << Globals::batch_file << std::endl;
+			exit(1);
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			size_t first = line.find_first_not_of(" \t\r");
+			if (first != std::string::npos && line[first] != '#')
+				lines.push_back(line);
+		}
+	}
+	if (lines.empty()) {
+		std::cout << "ERROR: the batch has no cloths" << std::endl;
+		exit(1);
+	}
+
+	for (const std::string& line : lines) {
+		InstanceParams inst = { TAU, KD, GRAVITY, cl_int(Kernel::batch_pins.size()), 0 };
+		float* fields[3] = { &inst.tau, &inst.kd, &inst.gravity };
+		std::stringstream ss(line);
+		std::string word;
+		for (int f = 0; f < 3 && ss >> word; f++)
+			*fields[f] = (float)atof(word.c_str());
+
+		std::vector<unsigned int> pins = Globals::cloth_pins;
+		if (ss >> word) {
+			pins.clear();
+			std::stringstream list(word); std::string pin;
+			while (word != "-" && std::getline(list, pin, ','))
+				pins.push_back((unsigned int)atoi(pin.c_str()));
+		}
+		for (unsigned int pin : pins)
+			if (pin < Kernel::pos.size()) Kernel::batch_pins.push_back(cl_int(pin));
+		inst.pin_count = cl_int(Kernel::batch_pins.size()) - inst.pin_first;
+		Kernel::instances.push_back(inst);
+	}
+	Kernel::batch_pins.push_back(-1); // buffers cannot be empty
+	std::cout << "SUCCESS: " << Kernel::instances.size() << " cloths in the batch..." << std::endl;
+}
+
+void build_batch() {
+	if (!batched()) return;
+
+	cl_int err;
+	Kernel::instance_params = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(InstanceParams) * Kernel::instances.size(), &Kernel::instances[0], &err);
+	assert(!err);
+	Kernel::instance_pins = clCreateBuffer(
+		Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * Kernel::batch_pins.size(), &Kernel::batch_pins[0], &err);
+	assert(!err);
+
+	err = clSetKernelArg(Kernel::batchPredictKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchPredictKernel, 1, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchPredictKernel, 2, sizeof(cl_mem), &Kernel::new_positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchPredictKernel, 3, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchPredictKernel, 4, sizeof(cl_mem), &Kernel::instance_params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchPredictKernel, 5, sizeof(cl_mem), &Kernel::instance_pins);
+	clSetKernelArgAssert(err);
+
+	// The same ping-pong as the single cloth sweeps
+	cl_kernel sweeps[2] = { Kernel::batchConstraintEvenKernel, Kernel::batchConstraintOddKernel };
+	cl_mem* sweep_in[2] = { &Kernel::new_positions, &Kernel::positions };
+	cl_mem* sweep_out[2] = { &Kernel::positions, &Kernel::new_positions };
+	for (int k = 0; k < 2; k++) {
+		err = clSetKernelArg(sweeps[k], 0, sizeof(cl_mem), sweep_in[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 1, sizeof(cl_mem), sweep_out[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 2, sizeof(ClothParams), &Kernel::params);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 3, sizeof(cl_mem), &Kernel::instance_params);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 4, sizeof(cl_mem), &Kernel::instance_pins);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 5, sizeof(cl_mem), &Kernel::lambda);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 6, sizeof(cl_mem), &Kernel::bending);
+		clSetKernelArgAssert(err);
+	}
+
+	err = clSetKernelArg(Kernel::batchNormalsKernel, 0, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchNormalsKernel, 1, sizeof(cl_mem), &Kernel::normals);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::batchNormalsKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+}
+
+void release_batch() {
+	if (!batched()) return;
+
+	clReleaseMemObject(Kernel::instance_params);
+	clReleaseMemObject(Kernel::instance_pins);
+}
+
+// One launch per stage steps every instance, as many launches as one cloth
+void batch_step(size_t width, size_t height, bool display) {
+	cl_int err;
+	int iterations = solver_iterations();
+	enqueue_batch(Kernel::batchPredictKernel, width, height);
+	for (int i = 0; i < iterations; i++)
+		enqueue_batch(i % 2 == 0 ? Kernel::batchConstraintEvenKernel : Kernel::batchConstraintOddKernel, width, height);
+
+	// Even counts leave the result in new_positions
+	if (iterations % 2 == 0) {
+		err = clEnqueueCopyBuffer(
+			Kernel::commandQueue, Kernel::new_positions, Kernel::positions,
+			0, 0, position_bytes() * Kernel::pos.size() * batch_size(), 0, NULL, NULL);
+		assert(!err);
+	}
+
+	if (!display)
+		return;
+
+	enqueue_batch(Kernel::batchNormalsKernel, width, height);
+	err = clFinish(Kernel::commandQueue);
+	assert(!err);
+}
+
+// The grid in the first two dimensions, the instances in the third
+void enqueue_batch(cl_kernel kernel, size_t width, size_t height) {
+	size_t globalWorkSize[3] = { width, height, batch_size() };
+	cl_int err = clEnqueueNDRangeKernel(
+		Kernel::commandQueue, kernel,
+		3, NULL, globalWorkSize, NULL,
+		0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+}
+
+// --batch-output: the positions of every instance as "instance vertex x y z" lines
+void save_batch() {
+	if (!batched() || Globals::batch_output.empty()) return;
+
+	std::vector<char> codes(position_bytes() * Kernel::pos.size() * batch_size());
+	cl_int err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::positions, CL_TRUE,
+		0, codes.size(), &codes[0], 0, NULL, NULL);
+	assert(!err);
+	std::vector<cl_float3> all(Kernel::pos.size() * batch_size());
+	decode_positions(codes, all);
+
+	std::ofstream out(Globals::batch_output);
+	if (!out) {
+		std::cout << "ERROR: cannot write the batch output " << Globals::batch_output << std::endl;
+		return;
+	}
+	for (size_t v = 0; v < all.size(); v++)
+		out << v / Kernel::pos.size() << " " << v % Kernel::pos.size() << " "
+			<< all[v].x << " " << all[v].y << " " << all[v].z << "\n";
+	std::cout << "SUCCESS: " << batch_size() << " batched cloths written to " << Globals::batch_output << std::endl;
+}
+
+void build_graph() {
+	if (!csr_topology()) return;
+
+	const ConstraintGraph& graph = *Kernel::graph;
+	struct {
+		cl_mem* buffer;
+		size_t bytes;
+		const void* data;
+	} uploads[] = {
+		{ &Kernel::graph_offsets, sizeof(cl_int) * graph.offsets().size(), &graph.offsets()[0] },
+		{ &Kernel::graph_neighbors, sizeof(cl_int) * graph.neighbors().size(), &graph.neighbors()[0] },
+		{ &Kernel::graph_rest, sizeof(cl_float) * graph.rest().size(), &graph.rest()[0] },
+		{ &Kernel::graph_face_offsets, sizeof(cl_int) * graph.face_offsets().size(), &graph.face_offsets()[0] },
+		{ &Kernel::graph_face_list, sizeof(cl_int) * graph.face_list().size(), &graph.face_list()[0] },
+		{ &Kernel::graph_faces, sizeof(cl_int) * graph.faces().size(), &graph.faces()[0] }
+	};
+	cl_int err;
+	for (const auto& u : uploads) {
+		*u.buffer = clCreateBuffer(
+			Kernel::context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			u.bytes, const_cast<void*>(u.data), &err);
+		assert(!err);
+	}
+
+	// The same ping-pong as the stencil sweeps
+	cl_kernel sweeps[2] = { Kernel::meshConstraintEvenKernel, Kernel::meshConstraintOddKernel };
+	cl_mem* sweep_in[2] = { &Kernel::new_positions, &Kernel::positions };
+	cl_mem* sweep_out[2] = { &Kernel::positions, &Kernel::new_positions };
+	for (int k = 0; k < 2; k++) {
+		err = clSetKernelArg(sweeps[k], 0, sizeof(cl_mem), sweep_in[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 1, sizeof(cl_mem), sweep_out[k]);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 2, sizeof(ClothParams), &Kernel::params);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 3, sizeof(cl_mem), &Kernel::weights);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 4, sizeof(cl_mem), &Kernel::graph_offsets);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 5, sizeof(cl_mem), &Kernel::graph_neighbors);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(sweeps[k], 6, sizeof(cl_mem), &Kernel::graph_rest);
+		clSetKernelArgAssert(err);
+	}
+
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 0, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 1, sizeof(cl_mem), &Kernel::normals);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 2, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 3, sizeof(cl_mem), &Kernel::graph_face_offsets);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 4, sizeof(cl_mem), &Kernel::graph_face_list);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::meshNormalsKernel, 5, sizeof(cl_mem), &Kernel::graph_faces);
+	clSetKernelArgAssert(err);
+
+	std::cout << "SUCCESS: constraint graph of " << graph.size() << " vertices, " << graph.edges() << " edges and "
+		<< graph.bends() << " folds (up to " << graph.max_degree() << " constraints per vertex)..." << std::endl;
+}
+
+void release_graph() {
+	if (!Kernel::graph) return;
+
+	clReleaseMemObject(Kernel::graph_offsets);
+	clReleaseMemObject(Kernel::graph_neighbors);
+	clReleaseMemObject(Kernel::graph_rest);
+	clReleaseMemObject(Kernel::graph_face_offsets);
+	clReleaseMemObject(Kernel::graph_face_list);
+	clReleaseMemObject(Kernel::graph_faces);
+	delete Kernel::graph;
+	Kernel::graph = nullptr;
+}
+
+// The multi-launch step with the graph sweeps and normals
+void graph_step(size_t width, size_t height, bool display) {
+	cl_int err;
+	enqueue_kernel(Kernel::updatePositionKernel, Kernel::launch_update, width, height);
+	enqueue_kernel(Kernel::updateOldPositionKernel, Kernel::launch_old, width, height);
+
+	int iterations = solver_iterations();
+	for (int i = 0; i < iterations; i++)
+		enqueue_kernel(i % 2 == 0 ? Kernel::meshConstraintEvenKernel : Kernel::meshConstraintOddKernel,
+			Kernel::launch_constraint, width, height);
+
+	// Even counts leave the result in new_positions
+	if (iterations % 2 == 0) {
+		err = clEnqueueCopyBuffer(
+			Kernel::commandQueue, Kernel::new_positions, Kernel::positions,
+			0, 0, position_bytes() * Kernel::pos.size(), 0, NULL, NULL);
+		assert(!err);
+	}
+
+	if (!display)
+		return;
+
+	enqueue_kernel(Kernel::meshNormalsKernel, Kernel::launch_normals, width, height);
+	err = clFinish(Kernel::commandQueue);
+	assert(!err);
+}
+
+// --topology csr on the grid: times the graph kernels against the stencil
+// ones on the same cloth and work-groups
+void graph_report() {
+	if (!Globals::csr || !Globals::mesh_file.empty()) return;
+
+	std::stringstream title;
+	title << "Constraint graph against the stencil on the " << Kernel::params.row << "x" << Kernel::params.col << " grid";
+	compare_timings(title.str(), "stencil", "csr", {
+		kernel_row("constraint", Kernel::constraintEvenKernel, Kernel::meshConstraintEvenKernel, Kernel::launch_constraint),
+		kernel_row("normals", Kernel::calculateNoramlsKernel, Kernel::meshNormalsKernel, Kernel::launch_normals)
+	}, CSR_MAX_OVERHEAD);
+}
+
+// --bending quadratic: times the constraint sweep with the quadratic
+// bending operator against the one with the +-2 diagonal folds
+void bending_report() {
+	if (!Globals::quadratic_bending) return;
+
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
+	auto sweep = [=]() { return time_kernel(Kernel::constraintEvenKernel, Kernel::launch_constraint, width, height); };
+	auto folds = [=]() {
+		ClothParams params = Kernel::params;
+		params.quadratic_bend = 0.f;
+		cl_int err = clSetKernelArg(Kernel::constraintEvenKernel, 2, sizeof(ClothParams), &params);
+		clSetKernelArgAssert(err);
+		double time = sweep();
+		err = clSetKernelArg(Kernel::constraintEvenKernel, 2, sizeof(ClothParams), &Kernel::params);
+		clSetKernelArgAssert(err);
+		return time;
+	};
+
+	std::stringstream title;
+	title << "Quadratic bending against the folds on the " << Kernel::params.row << "x" << Kernel::params.col << " grid";
+	compare_timings(title.str(), "folds", "quadratic", { { "constraint", folds, sweep } }, 0.0);
+}
+
+// --wind: times whole steps with the faces and without, only update_position
+// and the fused step read p.aerodynamics
+void wind_report() {
+	if (!Globals::aerodynamics) return;
+
+	const int frames = 30;
+	auto wind = [=]() { return time_steps(frames); };
+	auto still = [=]() {
+		ClothParams params = Kernel::params;
+		params.aerodynamics = 0;
+		cl_kernel kernels[] = { Kernel::updatePositionKernel, Kernel::stepFusedKernel };
+		for (cl_kernel k : kernels) {
+			cl_int err = clSetKernelArg(k, 3, sizeof(ClothParams), &params);
+			clSetKernelArgAssert(err);
+		}
+		double time = time_steps(frames);
+		for (cl_kernel k : kernels) {
+			cl_int err = clSetKernelArg(k, 3, sizeof(ClothParams), &Kernel::params);
+			clSetKernelArgAssert(err);
+		}
+		return time;
+	};
+
+	compare_timings("Frame time with the wind", "still", "wind", { { "step", still, wind } }, AERO_MAX_COST);
+}
+
+// --tear: the counters, the links of every vertex with each stencil term
+// holding and room for 6 logged edges per vertex, see tear.cl
+std::vector<cl_int> initial_tear() {
+	if (!tearing())
+		return std::vector<cl_int>(1, 0); // buffers cannot be empty
+	size_t n = Kernel::pos.size();
+	std::vector<cl_int> tear(TEAR_HEADER + 7 * n, 0);
+	std::fill(tear.begin() + TEAR_HEADER, tear.begin() + TEAR_HEADER + n, -1);
+	return tear;
+}
+
+void build_tear() {
+	if (!tearing()) return;
+
+	// Every face of build_fabric in its own slot
+	Kernel::tear_rest = Globals::meshes[0].faces;
+	size_t faces = Kernel::tear_rest.size();
+	cl_int err;
+	cl_mem* buffers[] = { &Kernel::tear_slot, &Kernel::tear_face, &Kernel::tear_holes, &Kernel::tear_cut };
+	for (cl_mem* b : buffers) {
+		*b = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, sizeof(cl_int) * faces, NULL, &err);
+		assert(!err);
+	}
+	Kernel::tear_faces = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, 3 * sizeof(cl_int) * faces, NULL, &err);
+	assert(!err);
+	Kernel::tear_pairs = clCreateBuffer(Kernel::context, CL_MEM_READ_WRITE, 2 * sizeof(cl_int) * faces, NULL, &err);
+	assert(!err);
+	Kernel::tear_moved = clCreateBuffer(Kernel::context, CL_MEM_WRITE_ONLY, 4 * sizeof(cl_int) * faces, NULL, &err);
+	assert(!err);
+	reset_tear();
+
+	err = clSetKernelArg(Kernel::tearFacesKernel, 0, sizeof(cl_mem), &Kernel::tear);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearFacesKernel, 1, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearFacesKernel, 2, sizeof(cl_mem), &Kernel::tear_slot);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearFacesKernel, 3, sizeof(cl_mem), &Kernel::tear_holes);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearFacesKernel, 4, sizeof(cl_mem), &Kernel::tear_cut);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearPairKernel, 0, sizeof(cl_mem), &Kernel::tear);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearPairKernel, 1, sizeof(cl_mem), &Kernel::tear_slot);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearPairKernel, 2, sizeof(cl_mem), &Kernel::tear_face);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearPairKernel, 3, sizeof(cl_mem), &Kernel::tear_holes);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearPairKernel, 4, sizeof(cl_mem), &Kernel::tear_pairs);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 0, sizeof(cl_mem), &Kernel::tear);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 1, sizeof(cl_mem), &Kernel::tear_slot);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 2, sizeof(cl_mem), &Kernel::tear_face);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 3, sizeof(cl_mem), &Kernel::tear_faces);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 4, sizeof(cl_mem), &Kernel::tear_pairs);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::tearMoveKernel, 5, sizeof(cl_mem), &Kernel::tear_moved);
+	clSetKernelArgAssert(err);
+
+	std::cout << "SUCCESS: tearing past " << Globals::tear_strain << " times the rest length, "
+		<< faces << " faces in the index buffer..." << std::endl;
+}
+
+void release_tear() {
+	if (Kernel::tear_rest.empty()) return;
+
+	clReleaseMemObject(Kernel::tear_slot);
+	clReleaseMemObject(Kernel::tear_face);
+	clReleaseMemObject(Kernel::tear_faces);
+	clReleaseMemObject(Kernel::tear_holes);
+	clReleaseMemObject(Kernel::tear_pairs);
+	clReleaseMemObject(Kernel::tear_moved);
+	clReleaseMemObject(Kernel::tear_cut);
+	Kernel::tear_rest.clear();
+}
+
+// Kinematic pins: every pin holds its vertex on a curve that pin_targets
+// evaluates on the device, the host uploads the curves only when they change.
+// They start still, at the rest pose of the host mirror.
+void build_pin_targets() {
+	Kernel::targets.clear();
+	for (unsigned int pin : Globals::cloth_pins) {
+		PinTarget target = {};
+		target.vertex = cl_int(pin);
+		target.curve = PIN_CURVE_EASE;
+		for (int a = 0; a < 3; a++)
+			target.start[a] = target.end[a] = Kernel::pos[pin].s[a];
+		Kernel::targets.push_back(target);
+	}
+	Kernel::pin_time = 0.f;
+	Kernel::pin_until = -1.f;
+
+	cl_int err;
+	Kernel::pin_targets = clCreateBuffer(Kernel::context, CL_MEM_READ_ONLY,
+		sizeof(PinTarget) * std::max<size_t>(Kernel::targets.size(), 1), NULL, &err);
+	assert(!err);
+	upload_pin_targets(Kernel::pin_until);
+	set_pin_target_args();
+}
+
+void set_pin_target_args() {
+	cl_int err;
+	cl_int count = cl_int(Kernel::targets.size());
+	err = clSetKernelArg(Kernel::pinTargetsKernel, 0, sizeof(cl_mem), &Kernel::positions);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::pinTargetsKernel, 1, sizeof(ClothParams), &Kernel::params);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::pinTargetsKernel, 2, sizeof(cl_mem), &Kernel::pin_targets);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::pinTargetsKernel, 3, sizeof(cl_int), &count);
+	clSetKernelArgAssert(err);
+}
+
+void release_pin_targets() {
+	clReleaseMemObject(Kernel::pin_targets);
+	Kernel::targets.clear();
+}
+
+// The curves of every pin, moving until the simulated time until
+void upload_pin_targets(float until) {
+	Kernel::pin_until = until;
+	if (Kernel::targets.empty()) return;
+
+	cl_int err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::pin_targets, CL_TRUE,
+		0, sizeof(PinTarget) * Kernel::targets.size(), &Kernel::targets[0], 0, NULL, NULL);
+	assert(!err);
+}
+
+// The host side of pin_targets
+cl_float3 pin_target_at(const PinTarget& target, float time) {
+	float s = target.t1 > target.t0 ? std::min(std::max((time - target.t0) / (target.t1 - target.t0), 0.f), 1.f) : 1.f;
+	if (target.curve == PIN_CURVE_EASE)
+		s = s * s * (3.f - 2.f * s);
+	cl_float3 x;
+	for (int a = 0; a < 3; a++)
+		x.s[a] = target.start[a] + (target.end[a] - target.start[a]) * s;
+	x.s[3] = 0.f;
+	return x;
+}
+
+// Mends every tear, the links, the index buffer and the faces of the cloth
+void reset_tear() {
+	if (Kernel::tear_rest.empty()) return;
+
+	std::vector<cl_int> tear = initial_tear();
+	cl_int err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear, CL_TRUE,
+		0, sizeof(cl_int) * tear.size(), &tear[0], 0, NULL, NULL);
+	assert(!err);
+	std::vector<cl_int> slots(Kernel::tear_rest.size());
+	for (size_t f = 0; f < slots.size(); f++)
+		slots[f] = cl_int(f);
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear_slot, CL_TRUE,
+		0, sizeof(cl_int) * slots.size(), &slots[0], 0, NULL, NULL);
+	assert(!err);
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear_face, CL_TRUE,
+		0, sizeof(cl_int) * slots.size(), &slots[0], 0, NULL, NULL);
+	assert(!err);
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear_faces, CL_TRUE,
+		0, sizeof(Vec3i) * Kernel::tear_rest.size(), &Kernel::tear_rest[0][0], 0, NULL, NULL);
+	assert(!err);
+	std::fill(slots.begin(), slots.end(), 0);
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear_cut, CL_TRUE,
+		0, sizeof(cl_int) * slots.size(), &slots[0], 0, NULL, NULL);
+	assert(!err);
+	Kernel::tear_live = cl_int(Kernel::tear_rest.size());
+	Globals::meshes[0].faces = Kernel::tear_rest;
+	Globals::meshes[0].faces_changed();
+}
+
+// Takes the faces that lost a second edge since the last call out of the
+// packed index buffer and makes the same moves in the faces of the cloth;
+// TriMesh::draw uploads only the moved slots to its index buffer.
+// One counter is read when nothing tore, otherwise the launches and reads
+// grow with the tears, never with the cloth.
+void compact_faces() {
+	if (!tearing()) return;
+
+	cl_int header[TEAR_HEADER];
+	cl_int err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::tear, CL_TRUE,
+		0, sizeof(header), header, 0, NULL, NULL);
+	assert(!err);
+	if (header[0] == 0)
+		return;
+
+	size_t count = size_t(header[0]);
+	err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::tearFacesKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+	err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::tear, CL_TRUE,
+		0, sizeof(header), header, 0, NULL, NULL);
+	assert(!err);
+
+	cl_int freed = header[1];
+	if (freed > 0) {
+		err = clSetKernelArg(Kernel::tearPairKernel, 5, sizeof(cl_int), &Kernel::tear_live);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(Kernel::tearPairKernel, 6, sizeof(cl_int), &freed);
+		clSetKernelArgAssert(err);
+		count = size_t(freed);
+		err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::tearPairKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+		clEnqueueNDRangeKernelAssert(err);
+		err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::tearMoveKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+		clEnqueueNDRangeKernelAssert(err);
+		err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::tear, CL_TRUE,
+			0, sizeof(header), header, 0, NULL, NULL);
+		assert(!err);
+
+		// Only the faces freed below the new end move, from past it
+		std::vector<Vec3i>& faces = Globals::meshes[0].faces;
+		if (header[2] > 0) {
+			std::vector<cl_int> moved(4 * size_t(header[2]));
+			err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::tear_moved, CL_TRUE,
+				0, sizeof(cl_int) * moved.size(), &moved[0], 0, NULL, NULL);
+			assert(!err);
+			for (cl_int r = 0; r < header[2]; r++) {
+				faces[moved[4 * r]] = Vec3i(moved[4 * r + 1], moved[4 * r + 2], moved[4 * r + 3]);
+				Globals::meshes[0].face_changed(size_t(moved[4 * r]));
+			}
+		}
+		Kernel::tear_live -= freed;
+		faces.resize(Kernel::tear_live);
+	}
+
+	// The next frame logs from the start
+	std::fill(header, header + TEAR_HEADER, 0);
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tear, CL_TRUE,
+		0, sizeof(header), header, 0, NULL, NULL);
+	assert(!err);
+}
 
-			// Get the log
-			clGetProgramBuildInfo(program, Kernel::devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+// scalars[slot] = a.b, in two launches so no work-group waits for another
+void enqueue_dot(cl_mem a, cl_mem b, cl_int slot) {
+	cl_int err = clSetKernelArg(Kernel::dotPartialKernel, 0, sizeof(cl_mem), &a);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::dotPartialKernel, 1, sizeof(cl_mem), &b);
+	clSetKernelArgAssert(err);
+	err = clSetKernelArg(Kernel::dotFinalKernel, 3, sizeof(cl_int), &slot);
+	clSetKernelArgAssert(err);
 
-			// Print the log
-			printf("%s\n", log);
-		}
+	size_t global = Kernel::dot_group * Kernel::dot_groups;
+	err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::dotPartialKernel, 1, NULL, &global, &Kernel::dot_group, 0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+	err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::dotFinalKernel, 1, NULL, &Kernel::dot_group, &Kernel::dot_group, 0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+}
 
-		std::cout << "clProgram build failed!" << std::endl;
-		exit(1);
+// One backward Euler step, the same passes as ClothSolver::implicit_step().
+// The CG loop runs its full IMPLICIT_CG_ITERATIONS without reading the
+// residual back, converged iterations are no-ops on the device.
+void implicit_step(size_t width, size_t height) {
+	enqueue_kernel(Kernel::implicitPrepareKernel, Kernel::launch_update, width, height);
+	enqueue_dot(Kernel::cg_r, Kernel::cg_z, 0);
+	enqueue_dot(Kernel::cg_r, Kernel::cg_z, 1);
+
+	for (int i = 0; i < IMPLICIT_CG_ITERATIONS; i++) {
+		cl_int rz = 1 + i % 2, rz_next = 1 + (i + 1) % 2;
+		enqueue_kernel(Kernel::implicitMultiplyKernel, Kernel::launch_update, width, height);
+		enqueue_dot(Kernel::cg_dir, Kernel::cg_q, 3);
+
+		cl_int err = clSetKernelArg(Kernel::cgStepKernel, 7, sizeof(cl_int), &rz);
+		clSetKernelArgAssert(err);
+		enqueue_kernel(Kernel::cgStepKernel, Kernel::launch_update, width, height);
+		enqueue_dot(Kernel::cg_r, Kernel::cg_z, rz_next);
+
+		err = clSetKernelArg(Kernel::cgDirectionKernel, 3, sizeof(cl_int), &rz_next);
+		clSetKernelArgAssert(err);
+		err = clSetKernelArg(Kernel::cgDirectionKernel, 4, sizeof(cl_int), &rz);
+		clSetKernelArgAssert(err);
+		enqueue_kernel(Kernel::cgDirectionKernel, Kernel::launch_update, width, height);
 	}
 
-	std::cout << "SUCCESS: clProgram built..." << std::endl;
-	return program;
+	enqueue_kernel(Kernel::implicitFinishKernel, Kernel::launch_update, width, height);
 }
 
-void release_kernel() {
-	// Clean up
+size_t fused_group_size() {
 	cl_int err;
-	err = clFlush(Kernel::commandQueue);
-	err = clFinish(Kernel::commandQueue);
-	err = clReleaseKernel(Kernel::updatePositionKernel);
-	err = clReleaseKernel(Kernel::updateOldPositionKernel);
-	err = clReleaseKernel(Kernel::constraintOddKernel);
-	err = clReleaseKernel(Kernel::constraintEvenKernel);
-	err = clReleaseKernel(Kernel::calculateNoramlsKernel);
-	err = clReleaseProgram(Kernel::program);
-	err = clReleaseMemObject(Kernel::old_positions);
-	err = clReleaseMemObject(Kernel::positions);
-	err = clReleaseMemObject(Kernel::new_positions);
-	err = clReleaseMemObject(Kernel::normals);
-	err = clReleaseCommandQueue(Kernel::commandQueue);
-	err = clReleaseContext(Kernel::context);
+	cl_device_id device = Kernel::devices[0];
+
+	cl_ulong local_size;
+	err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_size), &local_size, NULL);
+	size_t max_group;
+	cl_ulong kernel_local;
+	err |= clGetKernelWorkGroupInfo(Kernel::stepFusedKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+	err |= clGetKernelWorkGroupInfo(Kernel::stepFusedKernel, device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(kernel_local), &kernel_local, NULL);
+	if (err != CL_SUCCESS) return 0;
+
+	// One work-group holds the whole grid twice, for the Jacobi ping-pong
+	size_t n = Kernel::pos.size();
+	cl_ulong grid_bytes = sizeof(cl_float3) * n * 2;
+	if (grid_bytes + kernel_local > local_size)
+		return 0;
+	return std::min(max_group, n);
 }
 
-void set_buffer_kernel() {
-	TriMesh* fabric = &Globals::meshes[0];
-
-	// Cast type from float[3] to cl_float3 (sizeof(cl_float3) == sizeof(cl_float4))
-	for (Vec3f &v : fabric->vertices) {
-		cl_float3 pos;
-		pos.x = v[0]; pos.y = v[1]; pos.z = v[2];
-		//std::cout << pos.x << ", " << pos.y << ", " << pos.z << std::endl;
-		Kernel::pos.push_back(pos);
-	}
-	for (Vec3f &vn : fabric->normals) {
-		cl_float3 n;
-		n.x = vn[0]; n.y = vn[1]; n.z = vn[2];
-		Kernel::n.push_back(n);
+void choose_step_mode() {
+	Kernel::fused_size = 0;
+	if (!Globals::fused || Globals::solver_mode == SOLVER_MULTIGRID || Globals::solver_mode == SOLVER_PROJECTIVE ||
+		Globals::implicit || batched() || csr_topology() || tearing()) return;
+	if (Kernel::params.rest_tiles) {
+		std::cout << "Fused step disabled, rest detection dispatches tiles..." << std::endl;
+		return;
 	}
 
-	std::cout << "Data size verification..." << std::endl;
-	std::cout << "Size of host data mem: " << sizeof(Kernel::pos[0]) << std::endl;
-	std::cout << "Size of kernel data mem: " << sizeof(cl_float3) << std::endl;
-	if (sizeof(Kernel::pos[0]) != sizeof(cl_float3)) {
-		std::cout << "TEST1: FALSE" << std::endl;
-		exit(1);
+	size_t group = fused_group_size();
+	if (!group) {
+		std::cout << "Fused step disabled, the cloth does not fit in one work-group..." << std::endl;
+		return;
 	}
-	std::cout << "TEST1: TRUE" << std::endl;
 
-	std::cout << "Size of host data mem: " << sizeof(Kernel::n[0]) << std::endl;
-	std::cout << "Size of kernel data mem: " << sizeof(cl_float3) << std::endl;
-	if (sizeof(Kernel::n[0]) != sizeof(cl_float3)) {
-		std::cout << "TEST2: FALSE" << std::endl;
-		exit(1);
-	}
-	std::cout << "TEST2: TRUE" << std::endl;
+	// Frame time of both paths, the faster one is kept
+	const int frames = 30;
+	double multi = time_steps(frames);
+	Kernel::fused_size = group;
+	double fused = time_steps(frames);
+	reset_cloth_buffers();
+
+	std::cout << "Frame time: multi-launch " << multi * 1e3 << " ms, fused " << fused * 1e3
+		<< " ms (" << group << " work-items)" << std::endl;
+	if (fused > multi)
+		Kernel::fused_size = 0;
+	std::cout << "SUCCESS: using the " << (Kernel::fused_size ? "fused" : "multi-launch") << " step..." << std::endl;
+}
 
-	cl_int err;
-	Kernel::old_positions = clCreateBuffer(
-		Kernel::context, CL_MEM_COPY_HOST_PTR,
-		sizeof(cl_float3) * Kernel::pos.size(), &Kernel::pos[0], &err);
-	assert(!err);
-	Kernel::positions = clCreateBuffer(
-		Kernel::context, CL_MEM_COPY_HOST_PTR,
-		sizeof(cl_float3) * Kernel::pos.size(), &Kernel::pos[0], &err);
-	assert(!err);
-	Kernel::new_positions = clCreateBuffer(
-		Kernel::context, CL_MEM_WRITE_ONLY,
-		sizeof(cl_float3) * Kernel::pos.size(), NULL, &err);
-	assert(!err);
-	Kernel::normals = clCreateBuffer(
-		Kernel::context, CL_MEM_WRITE_ONLY,
-		sizeof(cl_float3) * Kernel::n.size(), NULL, &err);
-	assert(!err);
+double time_steps(int frames) {
+	// One warm up step, execute_kernel() waits for the queue
+	execute_kernel();
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < frames; i++)
+		execute_kernel();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / frames;
+}
 
-	err = clSetKernelArg(Kernel::updatePositionKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
+void set_tile_arg(size_t tile) {
+	// (tile + 4)^2 positions, the tile plus the halo of the stencil
+	size_t tile_bytes = (tile + 4) * (tile + 4) * sizeof(cl_float3);
+	cl_int err = clSetKernelArg(Kernel::constraintTiledEvenKernel, 4, tile_bytes, NULL);
 	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::updatePositionKernel, 1, sizeof(cl_mem), &Kernel::positions);
-	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::updatePositionKernel, 2, sizeof(cl_mem), &Kernel::new_positions);
+	err = clSetKernelArg(Kernel::constraintTiledOddKernel, 4, tile_bytes, NULL);
 	clSetKernelArgAssert(err);
+}
 
-	err = clSetKernelArg(Kernel::updateOldPositionKernel, 0, sizeof(cl_mem), &Kernel::old_positions);
-	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::updateOldPositionKernel, 1, sizeof(cl_mem), &Kernel::positions);
-	clSetKernelArgAssert(err);
+// What the tuning cache keys besides the device and the size: the options
+// the program was built with, the source of every kernel file, and the
+// modes that add work to the same kernels
+std::string tuning_build() {
+	std::stringstream build;
+	size_t size = 0;
+	clGetProgramBuildInfo(Kernel::program, Kernel::devices[0], CL_PROGRAM_BUILD_OPTIONS, 0, NULL, &size);
+	std::string options(size, '\0');
+	if (size)
+		clGetProgramBuildInfo(Kernel::program, Kernel::devices[0], CL_PROGRAM_BUILD_OPTIONS, size, &options[0], NULL);
+	build << options << "\n";
+
+	const char* files[] = { "kernels.cl", "stencil.cl", "implicit.cl", "batch.cl", "mesh.cl", "tear.cl", "config.hpp", "cloth_params.hpp" };
+	for (const char* name : files) {
+		std::stringstream path; path << MY_CUR_DIR << "kernels/" << name;
+		std::ifstream file(path.str().c_str());
+		build << file.rdbuf() << "\n";
+	}
 
-	err = clSetKernelArg(Kernel::constraintOddKernel, 0, sizeof(cl_mem), &Kernel::positions);
-	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::constraintOddKernel, 1, sizeof(cl_mem), &Kernel::new_positions);
-	clSetKernelArgAssert(err);
+	const ClothParams& p = Kernel::params;
+	build << "projective " << p.projective << " xpbd " << p.xpbd << " quadratic " << (p.quadratic_bend != 0.f)
+		<< " tear " << (p.tear_strain > 0.f) << " wind " << p.aerodynamics;
+	return build.str();
+}
 
-	err = clSetKernelArg(Kernel::constraintEvenKernel, 0, sizeof(cl_mem), &Kernel::new_positions);
-	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::constraintEvenKernel, 1, sizeof(cl_mem), &Kernel::positions);
-	clSetKernelArgAssert(err);
+void tune_work_groups() {
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
+	// The graph sweeps have no tiled variant
+	size_t max_tile = csr_topology() ? 0 : max_tile_size();
 
-	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 0, sizeof(cl_mem), &Kernel::positions);
-	clSetKernelArgAssert(err);
-	err = clSetKernelArg(Kernel::calculateNoramlsKernel, 1, sizeof(cl_mem), &Kernel::normals);
-	clSetKernelArgAssert(err);
+	// The batch kernels leave their work-groups to the driver
+	if (batched()) {
+		Kernel::tile_size = 0;
+		return;
+	}
 
-	std::cout << "SUCCESS: Buffers and kernels setting is done...\n" << std::endl;
+	// Rest detection launches whole REST_TILE tiles, see enqueue_grid()
+	if (Kernel::params.rest_tiles) {
+		Kernel::tile_size = 0;
+		std::cout << "Work-groups fixed to the " << REST_TILE << "x" << REST_TILE << " rest detection tiles..." << std::endl;
+		return;
+	}
+
+	// The tiled constraint only runs with square tiles that fit in local memory
+	TuneVariant tiled = { Kernel::constraintTiledEvenKernel, {}, [](const WorkGroup& local) { set_tile_arg(local.x); } };
+	for (size_t b = 8; b <= max_tile; b *= 2)
+		tiled.candidates.push_back({ b, b });
+	std::vector<TuneVariant> constraint = { { Kernel::constraintEvenKernel } };
+	if (!tiled.candidates.empty())
+		constraint.push_back(tiled);
+	std::string constraint_name = constraint.size() > 1 ? "constraint" : "constraint_untiled";
+	cl_kernel normals = Kernel::calculateNoramlsKernel;
+	std::string normals_name = "calculate_normals";
+	if (csr_topology()) {
+		constraint = { { Kernel::meshConstraintEvenKernel } };
+		constraint_name = "mesh_constraint";
+		normals = Kernel::meshNormalsKernel;
+		normals_name = "mesh_normals";
+	}
+
+	if (!Globals::autotune) {
+		LaunchConfig fixed = { 0, { BLOCK_SIZE, BLOCK_SIZE } };
+		Kernel::launch_update = Kernel::launch_old = Kernel::launch_normals = fixed;
+		Kernel::launch_constraint = fixed;
+		if (max_tile) {
+			Kernel::launch_constraint = { 1, { max_tile, max_tile } };
+			set_tile_arg(max_tile);
+		}
+	} else {
+		// Ordered like a step, so every kernel reads initialized positions
+		WorkGroupTuner& tuner = *Kernel::tuner;
+		tuner.set_build(tuning_build());
+		// The other layouts move less memory, they are tuned on their own
+		std::string storage = Globals::storage == STORAGE_FLOAT3 ? "" : std::string("_") + storage_name();
+		Kernel::launch_update = tuner.tune("update_position" + storage, { { Kernel::updatePositionKernel } }, width, height);
+		Kernel::launch_old = tuner.tune("update_old_position" + storage, { { Kernel::updateOldPositionKernel } }, width, height);
+		Kernel::launch_constraint = tuner.tune(constraint_name + storage, constraint, width, height);
+		Kernel::launch_normals = tuner.tune(normals_name + storage, { { normals } }, width, height);
+		tuner.save();
+
+		// The timing runs moved the cloth
+		reset_cloth_buffers();
+	}
+
+	Kernel::tile_size = Kernel::launch_constraint.variant == 1 ? Kernel::launch_constraint.local.x : 0;
+	if (Kernel::tile_size)
+		std::cout << "SUCCESS: tiled constraint kernel enabled (" << Kernel::tile_size << "x" << Kernel::tile_size << ")..." << std::endl;
+	else
+		std::cout << "Tiled constraint kernel disabled..." << std::endl;
 }
 
 void clSetKernelArgAssert(cl_int err) {
@@ -483,117 +2855,360 @@ void clEnqueueNDRangeKernelAssert(cl_int err) {
 	}
 }
 
-void execute_kernel() {
-	const unsigned int work_dim = 2;
-
+void execute_kernel(bool display) {
 	cl_int err;
-	size_t globalWorkSize[work_dim] = { CLOTH_ROW+1, CLOTH_COL+1 };
-	size_t localWorkSize[work_dim] = { BLOCK_SIZE, BLOCK_SIZE };
+	size_t width = size_t(Kernel::params.row + 1);
+	size_t height = size_t(Kernel::params.col + 1);
 
-#ifdef _PINNED
-	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::positions, CL_FALSE, sizeof(cl_float3)*0, sizeof(cl_float3), &Kernel::pos[0], 0, NULL, NULL);
-	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::positions, CL_FALSE, sizeof(cl_float3)*4, sizeof(cl_float3), &Kernel::pos[4], 0, NULL, NULL);
-	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::positions, CL_FALSE, sizeof(cl_float3)*9, sizeof(cl_float3), &Kernel::pos[9], 0, NULL, NULL);
-	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::positions, CL_FALSE, sizeof(cl_float3)*14, sizeof(cl_float3), &Kernel::pos[14], 0, NULL, NULL);
-	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::positions, CL_FALSE, sizeof(cl_float3)*19, sizeof(cl_float3), &Kernel::pos[19], 0, NULL, NULL);
-#endif
+	// The batched cloths keep their own pins where they started
+	if (batched()) {
+		batch_step(width, height, display);
+		return;
+	}
 
-	err = clEnqueueNDRangeKernel(
-		Kernel::commandQueue, Kernel::updatePositionKernel,
-		work_dim, NULL, globalWorkSize, localWorkSize,
-		0, NULL, NULL);
-	clEnqueueNDRangeKernelAssert(err);
-	err = clEnqueueNDRangeKernel(
-		Kernel::commandQueue, Kernel::updateOldPositionKernel,
-		work_dim, NULL, globalWorkSize, localWorkSize,
-		0, NULL, NULL);
-	clEnqueueNDRangeKernelAssert(err);
+	// The pins follow their curves on the device, once the curves have
+	// settled there is nothing to launch
+	bool pins_moving = !Globals::pins_released && !Kernel::targets.empty() && Kernel::pin_time <= Kernel::pin_until;
+	Kernel::pin_time += Kernel::params.time_step;
+	if (pins_moving) {
+		size_t count = Kernel::targets.size();
+		err = clSetKernelArg(Kernel::pinTargetsKernel, 4, sizeof(cl_float), &Kernel::pin_time);
+		clSetKernelArgAssert(err);
+		err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::pinTargetsKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+		clEnqueueNDRangeKernelAssert(err);
+		// The pinned tiles may be sleeping
+		Kernel::rest_wake = std::max(Kernel::rest_wake, 1);
+	}
 
-	assert((SOLVER_ITERATIONS % 2) == 1);
-	for (int i = 0; i < SOLVER_ITERATIONS; i++)
-	{
-		if (i % 2 == 0) {
-			err = clEnqueueNDRangeKernel(
-				Kernel::commandQueue, Kernel::constraintEvenKernel,
-				work_dim, NULL, globalWorkSize, localWorkSize,
-				0, NULL, NULL);
-			clEnqueueNDRangeKernelAssert(err);
-		} else {
+	if (csr_topology()) {
+		graph_step(width, height, display);
+		return;
+	}
+
+	if (Globals::implicit) {
+		implicit_step(width, height);
+		if (!display)
+			return;
+		enqueue_kernel(Kernel::calculateNoramlsKernel, Kernel::launch_normals, width, height);
+		err = clFinish(Kernel::commandQueue);
+		assert(!err);
+		return;
+	}
+
+	if (Kernel::fused_size) {
+		cl_int write_normals = display;
+		err = clSetKernelArg(Kernel::stepFusedKernel, 6, sizeof(cl_int), &write_normals);
+		clSetKernelArgAssert(err);
+		err = clEnqueueNDRangeKernel(
+			Kernel::commandQueue, Kernel::stepFusedKernel,
+			1, NULL, &Kernel::fused_size, &Kernel::fused_size,
+			0, NULL, NULL);
+		clEnqueueNDRangeKernelAssert(err);
+		if (display) {
+			err = clFinish(Kernel::commandQueue);
+			assert(!err);
+		}
+		return;
+	}
+
+	// A settled cloth skips the step, otherwise only the listed tiles run
+	if (Kernel::params.rest_tiles && !update_rest_tiles())
+		return;
+
+	enqueue_grid(Kernel::updatePositionKernel, Kernel::launch_update, width, height);
+	enqueue_grid(Kernel::updateOldPositionKernel, Kernel::launch_old, width, height);
+
+	int iterations = solver_iterations();
+	if (Globals::solver_mode == SOLVER_MULTIGRID) {
+		for (int i = 0; i < iterations; i++)
+			multigrid_cycle(width, height);
+	} else if (Globals::solver_mode == SOLVER_PROJECTIVE) {
+		// The iterate starts at the prediction, which new_positions keeps
+		err = clEnqueueCopyBuffer(
+			Kernel::commandQueue, Kernel::new_positions, Kernel::positions,
+			0, 0, sizeof(cl_float3) * Kernel::pos.size(), 0, NULL, NULL);
+		assert(!err);
+		for (int i = 0; i < iterations; i++) {
+			enqueue_kernel(Kernel::projectiveLocalKernel, Kernel::launch_update, width, height);
 			err = clEnqueueNDRangeKernel(
-				Kernel::commandQueue, Kernel::constraintOddKernel,
-				work_dim, NULL, globalWorkSize, localWorkSize,
+				Kernel::commandQueue, Kernel::projectiveSolveKernel,
+				1, NULL, &Kernel::pd_group, &Kernel::pd_group,
 				0, NULL, NULL);
 			clEnqueueNDRangeKernelAssert(err);
 		}
+	} else {
+		// Whole tiles, the padding work-items only help loading the halo
+		cl_kernel even = Kernel::tile_size ? Kernel::constraintTiledEvenKernel : Kernel::constraintEvenKernel;
+		cl_kernel odd = Kernel::tile_size ? Kernel::constraintTiledOddKernel : Kernel::constraintOddKernel;
+		cl_uint omega_arg = Kernel::tile_size ? 6 : 5;
+		const float rho = chebyshev_rho();
+		const float tolerance = adaptive_tolerance();
+		cl_float omega = 0.f;
+		for (int i = 0; i < iterations; i++) {
+			cl_kernel kernel = i % 2 == 0 ? even : odd;
+			if (rho > 0.f) {
+				omega = chebyshev_omega(i, rho, omega);
+				err = clSetKernelArg(kernel, omega_arg, sizeof(cl_float), &omega);
+				clSetKernelArgAssert(err);
+			}
+			bool measure = tolerance > 0.f && (i + 1) % ADAPTIVE_CHECK_INTERVAL == 0 && i + 1 < iterations;
+			if (measure && Kernel::correction_read) {
+				// The previous check has long finished, the sweeps after it keep the device busy
+				err = clWaitForEvents(1, &Kernel::correction_read);
+				assert(!err);
+				clReleaseEvent(Kernel::correction_read);
+				Kernel::correction_read = NULL;
+				cl_float largest;
+				memcpy(&largest, &Kernel::correction_host, sizeof(largest));
+				if (largest < tolerance) {
+					iterations = i;
+					break;
+				}
+			}
+			if (measure) {
+				static const cl_int zero = 0;
+				err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::correction, CL_FALSE, 0, sizeof(cl_int), &zero, 0, NULL, NULL);
+				assert(!err);
+			}
+			cl_int flag = measure;
+			err = clSetKernelArg(kernel, omega_arg + 2, sizeof(cl_int), &flag);
+			clSetKernelArgAssert(err);
+			enqueue_grid(kernel, Kernel::launch_constraint, width, height);
+			if (measure) {
+				err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::correction, CL_FALSE, 0, sizeof(cl_int),
+					&Kernel::correction_host, 0, NULL, &Kernel::correction_read);
+				assert(!err);
+			}
+		}
+		// A check still in flight says nothing about the next step
+		if (Kernel::correction_read) {
+			clReleaseEvent(Kernel::correction_read);
+			Kernel::correction_read = NULL;
+		}
 	}
 
-	err = clEnqueueNDRangeKernel(
-		Kernel::commandQueue, Kernel::calculateNoramlsKernel,
-		work_dim, NULL, globalWorkSize, localWorkSize,
-		0, NULL, NULL);
-	clEnqueueNDRangeKernelAssert(err);
+	// Multigrid and even Jacobi counts leave the result in new_positions,
+	// Projective Dynamics writes positions
+	if (Kernel::params.rest_tiles && iterations % 2 == 0) {
+		enqueue_grid(Kernel::copyTilesKernel, Kernel::launch_update, width, height);
+	} else if (Globals::solver_mode == SOLVER_MULTIGRID ||
+		(Globals::solver_mode == SOLVER_JACOBI && iterations % 2 == 0)) {
+		err = clEnqueueCopyBuffer(
+			Kernel::commandQueue, Kernel::new_positions, Kernel::positions,
+			0, 0, position_bytes() * Kernel::pos.size(), 0, NULL, NULL);
+		assert(!err);
+	}
+
+	// Substeps that are never displayed need no normals and no wait
+	if (!display)
+		return;
+
+	enqueue_grid(Kernel::calculateNoramlsKernel, Kernel::launch_normals, width, height);
 
 	err = clFinish(Kernel::commandQueue);
 	assert(!err);
 }
 
+// Rest detection: classifies the tiles by the motion of the last step and
+// lists the ones to dispatch. The count is read back without waiting; once a
+// read shows an empty list and nothing woke the cloth since, no tile can move
+// again and the step is skipped (returns false).
+bool update_rest_tiles() {
+	cl_int err;
+	if (Kernel::tiles_read && Kernel::rest_wake == 0) {
+		cl_int status;
+		err = clGetEventInfo(Kernel::tiles_read, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, NULL);
+		assert(!err);
+		if (status == CL_COMPLETE && Kernel::tiles_host == 0)
+			return false;
+	}
+
+	size_t count = Kernel::tile_count;
+	err = clSetKernelArg(Kernel::restClassifyKernel, 3, sizeof(cl_int), &Kernel::rest_wake);
+	clSetKernelArgAssert(err);
+	Kernel::rest_wake = 0;
+	err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::restClassifyKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+
+	static const cl_int zero = 0;
+	err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::tiles, CL_FALSE, 0, sizeof(cl_int), &zero, 0, NULL, NULL);
+	assert(!err);
+	err = clEnqueueNDRangeKernel(Kernel::commandQueue, Kernel::restCompactKernel, 1, NULL, &count, NULL, 0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+
+	if (Kernel::tiles_read)
+		clReleaseEvent(Kernel::tiles_read);
+	err = clEnqueueReadBuffer(Kernel::commandQueue, Kernel::tiles, CL_FALSE, 0, sizeof(cl_int),
+		&Kernel::tiles_host, 0, NULL, &Kernel::tiles_read);
+	assert(!err);
+	return true;
+}
+
+// Launches kernel over the grid, or with rest detection one REST_TILE x
+// REST_TILE work-group per tile. OpenCL 1.x has no indirect dispatch, so
+// every tile gets a group and the ones past the listed count return at once.
+void enqueue_grid(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height) {
+	if (!Kernel::params.rest_tiles) {
+		enqueue_kernel(kernel, config, width, height);
+		return;
+	}
+	LaunchConfig tile = { 0, { REST_TILE, REST_TILE } };
+	enqueue_kernel(kernel, tile, REST_TILE * Kernel::tile_count, REST_TILE);
+}
+
+void enqueue_kernel(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height) {
+	size_t globalWorkSize[2];
+	config.global_size(width, height, globalWorkSize);
+	cl_int err = clEnqueueNDRangeKernel(
+		Kernel::commandQueue, kernel,
+		2, NULL, globalWorkSize, config.local_size(),
+		0, NULL, NULL);
+	clEnqueueNDRangeKernelAssert(err);
+}
+
 void get_result_from_kernel() {
-	TriMesh* fabric = &Globals::meshes[0];
-	
 	cl_int err;
+	// The layouts other than float3 are read as they are and decoded afterwards
+	bool staged = Globals::storage != STORAGE_FLOAT3;
+	if (staged) {
+		Kernel::pos_codes.resize(position_bytes() * Kernel::pos.size());
+		Kernel::prev_codes.resize(position_bytes() * Kernel::prev.size());
+		Kernel::n_codes.resize(normal_bytes() * Kernel::n.size());
+	}
+
 	err = clEnqueueReadBuffer(
 		Kernel::commandQueue, Kernel::positions, CL_FALSE, 
-		0, sizeof(cl_float3) * Kernel::pos.size(), (void*)&Kernel::pos[0],
+		0, position_bytes() * Kernel::pos.size(), staged ? (void*)&Kernel::pos_codes[0] : (void*)&Kernel::pos[0],
+		0, NULL, NULL);
+	assert(!err);
+
+	// update_old_position left the state before the last step here
+	err = clEnqueueReadBuffer(
+		Kernel::commandQueue, Kernel::old_positions, CL_FALSE, 
+		0, position_bytes() * Kernel::prev.size(), staged ? (void*)&Kernel::prev_codes[0] : (void*)&Kernel::prev[0],
 		0, NULL, NULL);
 	assert(!err);
 
 	err = clEnqueueReadBuffer(
 		Kernel::commandQueue, Kernel::normals, CL_FALSE, 
-		0, sizeof(cl_float3) * Kernel::n.size(), (void*)&Kernel::n[0],
+		0, normal_bytes() * Kernel::n.size(), staged ? (void*)&Kernel::n_codes[0] : (void*)&Kernel::n[0],
 		0, NULL, NULL);
 	assert(!err);
 
-	for (int i = 0; i < fabric->vertices.size(); i++) {
-		//std::cout << Kernel::pos[i].x << ", " << Kernel::pos[i].y << ", " << Kernel::pos[i].z << std::endl;
-		//bool pinned = false;
-		/*for (unsigned int& pin : Globals::cloth_pins) {
-			if (pin == i) {
-				pinned = true;
-				break;
-			}
-		}*/
-		//if (pinned) continue;
-		fabric->vertices[i][0] = Kernel::pos[i].x;
-		fabric->vertices[i][1] = Kernel::pos[i].y;
-		fabric->vertices[i][2] = Kernel::pos[i].z;
+	err = clFinish(Kernel::commandQueue);
+	assert(!err);
+
+	if (staged) {
+		decode_positions(Kernel::pos_codes, Kernel::pos);
+		decode_positions(Kernel::prev_codes, Kernel::prev);
+		decode_normals(Kernel::n_codes, Kernel::n);
 	}
+}
 
-	for (int i = 0; i < fabric->normals.size(); i++) {
-		fabric->normals[i][0] = Kernel::n[i].x;
-		fabric->normals[i][1] = Kernel::n[i].y;
-		fabric->normals[i][2] = Kernel::n[i].z;
+void init_cpu_solver() {
+	// The native solver only knows the grid, see parse_args()
+	if (!Globals::mesh_file.empty()) {
+		std::cout << "ERROR: a --mesh cloth needs the opencl backend" << std::endl;
+		exit(1);
 	}
+	Globals::csr = false;
 
-	err = clFinish(Kernel::commandQueue);
-	assert(!err);
+	// Kernel::pos is still the host mirror that move_pins() edits
+	init_host_buffers();
+
+	CPU::solver = create_cpu_solver(Globals::cpu_threads, cpu_simd());
+
+	std::cout << "SUCCESS: CPU solver running on " << CPU::solver->thread_count() << " thread(s) with "
+		<< simd_isa_name(CPU::solver->simd_isa()) << " constraints...\n" << std::endl;
+	cpu_determinism_report();
+}
+
+// CPU solver of the fabric in its rest pose, with the solver options
+ClothSolver* create_cpu_solver(unsigned int threads, SimdIsa isa) {
+	TriMesh* fabric = &Globals::meshes[0];
+
+	ClothSolver* solver = new ClothSolver(
+		Globals::cloth_row, Globals::cloth_col, Globals::cloth_width, Globals::cloth_height,
+		fabric->vertices, Globals::cloth_pins, threads, isa);
+	solver->set_iterations(solver_iterations());
+	solver->set_multigrid(Globals::solver_mode == SOLVER_MULTIGRID);
+	if (Globals::solver_mode == SOLVER_MULTIGRID && solver->multigrid_levels() == 1)
+		std::cout << "WARNING: the cloth is too small for a coarse grid, multigrid runs plain jacobi sweeps..." << std::endl;
+	solver->set_projective(Globals::solver_mode == SOLVER_PROJECTIVE);
+	if (Globals::xpbd)
+		solver->set_xpbd(Globals::compliance[0], Globals::compliance[1], Globals::compliance[2]);
+	solver->set_chebyshev(chebyshev_rho());
+	solver->set_tolerance(adaptive_tolerance());
+	solver->set_rest_detection(rest_detection());
+	if (Globals::implicit)
+		solver->set_implicit(Globals::step_scale);
+	return solver;
+}
+
+void execute_cpu_solver(bool display) {
+	for (unsigned int pin : Globals::cloth_pins)
+		CPU::solver->set_position(pin, Kernel::pos[pin].x, Kernel::pos[pin].y, Kernel::pos[pin].z);
+
+	CPU::solver->step(display);
 }
 
+void get_result_from_cpu_solver() {
+	for (size_t i = 0; i < Kernel::pos.size(); i++) {
+		Float3 pos = CPU::solver->get_position(i);
+		Float3 prev = CPU::solver->get_old_position(i);
+		Float3 n = CPU::solver->get_normal(i);
+		Kernel::pos[i].x = pos.x; Kernel::pos[i].y = pos.y; Kernel::pos[i].z = pos.z;
+		Kernel::prev[i].x = prev.x; Kernel::prev[i].y = prev.y; Kernel::prev[i].z = prev.z;
+		Kernel::n[i].x = n.x; Kernel::n[i].y = n.y; Kernel::n[i].z = n.z;
+	}
+}
 
+void release_cpu_solver() {
+	delete CPU::solver;
+	CPU::solver = nullptr;
+}
 
 void init_meshes() {
 	// 1.fabric
 	TriMesh fabric;
+	if (Globals::mesh_file.empty())
+		build_fabric(fabric);
+	else
+		load_fabric(fabric);
+	fabric.set_colors(Vec3f(0.5f, 0.5f, 0.5f));
+	// translates it to the center
+	fabric.translate(0.f, 0.f, -10.f);
+
+	// 2.sphere
+	std::stringstream obj_file; obj_file << MY_DATA_DIR << "models/sphere.obj";
+	TriMesh sphere(obj_file.str());
+
+	sphere.set_colors(Vec3f(0.8f, 0.f, 0.f));
+	sphere.scale(5);
+	sphere.translate(0.f, 0.f, -10.f);
+
+	// stores the meshes
+	Globals::meshes.push_back(fabric); // meshes[0] is always the cloth
+	Globals::meshes.push_back(sphere); // meshes[1:] are objects
+}
+
+void build_fabric(TriMesh& fabric) {
 	float top = CLOTH_TOP;
-	float w = CLOTH_WIDTH;
-	float h = CLOTH_HEIGHT;
-	unsigned int row = CLOTH_ROW;
-	unsigned int col = CLOTH_COL;
+	float w = Globals::cloth_width;
+	float h = Globals::cloth_height;
+	unsigned int row = Globals::cloth_row;
+	unsigned int col = Globals::cloth_col;
 	float x_delta = w / col;
 	float y_delta = h / row;
 
 	float x_start = -w / 2.f;
 	float y_start = h / 2.f;
 
+	fabric.vertices.clear();
+	fabric.normals.clear();
+	fabric.faces.clear();
+	fabric.uvs.clear();
+
 	// Define vertices
 	for (int i = 0; i < row + 1; i++) {
 		for (int j = 0; j < col + 1; j++) { // top + y_start - 0.2*y_delta*i
@@ -618,22 +3233,84 @@ void init_meshes() {
 		}
 	}
 
+#ifdef _PINNED
+	// curtain rings along the top edge, { 0, 4, 9, 14, 19 } on the default grid
+	if (!Globals::custom_pins) {
+		Globals::cloth_pins.clear();
+		for (unsigned int k = 0; k <= 4; k++)
+			Globals::cloth_pins.push_back(k * col / 4);
+	}
+#endif
+	// drop pins that are not on this grid
+	std::vector<unsigned int> pins;
+	for (unsigned int pin : Globals::cloth_pins)
+		if (pin < fabric.vertices.size()) pins.push_back(pin);
+	Globals::cloth_pins = pins;
+
 	fabric.need_normals();
-	fabric.set_colors(Vec3f(0.5f, 0.5f, 0.5f));
-	// translates it to the center
-	fabric.translate(0.f, 0.f, -10.f);
+}
 
-	// 2.sphere
-	std::stringstream obj_file; obj_file << MY_DATA_DIR << "models/sphere.obj";
-	TriMesh sphere(obj_file.str());
+// --mesh: the cloth from an OBJ file, in its own coordinates
+void load_fabric(TriMesh& fabric) {
+	if (!fabric.load_obj(Globals::mesh_file) || fabric.faces.empty()) {
+		std::cout << "ERROR: cannot load a cloth from " << Globals::mesh_file << std::endl;
+		exit(1);
+	}
+	// The faces have to share their vertices to be held together
+	fabric.weld();
+
+	// The texture spread over the bounding box seen from above
+	float lo[2] = { fabric.vertices[0][0], fabric.vertices[0][2] }, hi[2] = { lo[0], lo[1] };
+	for (Vec3f& v : fabric.vertices) {
+		lo[0] = std::min(lo[0], v[0]); hi[0] = std::max(hi[0], v[0]);
+		lo[1] = std::min(lo[1], v[2]); hi[1] = std::max(hi[1], v[2]);
+	}
+	for (Vec3f& v : fabric.vertices)
+		fabric.uvs.push_back(Vec2f((v[0] - lo[0]) / std::max(hi[0] - lo[0], 1e-6f),
+			(v[2] - lo[1]) / std::max(hi[1] - lo[1], 1e-6f), 0.f));
+
+	// No default pins, --pins indexes the welded vertices
+	std::vector<unsigned int> pins;
+	for (unsigned int pin : Globals::cloth_pins)
+		if (pin < fabric.vertices.size()) pins.push_back(pin);
+	Globals::cloth_pins = pins;
+
+	fabric.need_normals(true);
+	std::cout << "SUCCESS: " << Globals::mesh_file << " welded to " << fabric.vertices.size() << " vertices and "
+		<< fabric.faces.size() << " faces..." << std::endl;
+}
 
-	sphere.set_colors(Vec3f(0.8f, 0.f, 0.f));
-	sphere.scale(5);
-	sphere.translate(0.f, 0.f, -10.f);
+void resize_cloth(int row, int col) {
+	if (!Globals::mesh_file.empty()) {
+		std::cout << "A loaded mesh has no grid to resize" << std::endl;
+		return;
+	}
 
-	// stores the meshes
-	Globals::meshes.push_back(fabric); // meshes[0] is always the cloth
-	Globals::meshes.push_back(sphere); // meshes[1:] are objects
+	row = std::max(2, std::min(2048, row));
+	col = std::max(2, std::min(2048, col));
+	if (row == Globals::cloth_row && col == Globals::cloth_col) return;
+
+	Globals::cloth_row = row;
+	Globals::cloth_col = col;
+	std::cout << "Cloth resized to " << row << "x" << col << std::endl;
+
+	// Rebuild the geometry in place so the GL buffers and texture are kept
+	TriMesh& fabric = Globals::meshes[0];
+	build_fabric(fabric);
+	fabric.set_colors(Vec3f(0.5f, 0.5f, 0.5f));
+	fabric.faces_changed();
+
+	// Only the buffers depend on the grid, the program is not rebuilt
+	if (Globals::backend == BACKEND_OPENCL) {
+		clFinish(Kernel::commandQueue);
+		release_buffer_kernel();
+		limit_projective();
+		set_buffer_kernel();
+	} else {
+		release_cpu_solver();
+		limit_projective();
+		init_cpu_solver();
+	}
 }
 
 void init_mat() {
@@ -782,6 +3459,18 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 			Globals::eye[2] += Globals::v[2];
 			set_view_mat();
 			break;
+		case GLFW_KEY_MINUS:  // - key -> halve the cloth resolution
+			resize_cloth(Globals::cloth_row / 2, Globals::cloth_col / 2);
+			break;
+		case GLFW_KEY_EQUAL:  // = key -> double the cloth resolution
+			resize_cloth(Globals::cloth_row * 2, Globals::cloth_col * 2);
+			break;
+		case GLFW_KEY_P:  // p key -> release the pins or pin them again
+			release_pins();
+			break;
+		case GLFW_KEY_O:  // o key -> pin or free the vertex in the middle of the view
+			toggle_picked_pin();
+			break;
 #ifdef _PINNED
 		case GLFW_KEY_LEFT_BRACKET:
 			move_pins(GLFW_KEY_LEFT_BRACKET);
@@ -802,40 +3491,116 @@ void move_pins(int key) {
 	const float move_dist = 0.1f;
 	const float min_interval = 1.5f;
 	const float max_interval = 5.f;
-	if (key == GLFW_KEY_LEFT_BRACKET) {
-		if (cl_float3_dist(Kernel::pos[0], Kernel::pos[4]) > min_interval) {
-			Kernel::pos[4].x -= move_dist;
-			std::cout << Kernel::pos[4].x << std::endl;
-		}
-		if (cl_float3_dist(Kernel::pos[4], Kernel::pos[9]) > min_interval) {
-			Kernel::pos[9].x -= move_dist;
-		}
-		if (cl_float3_dist(Kernel::pos[9], Kernel::pos[14]) > min_interval) {
-			Kernel::pos[14].x -= move_dist;
-		}
-		if (cl_float3_dist(Kernel::pos[14], Kernel::pos[19]) > min_interval) {
-			Kernel::pos[19].x -= move_dist;
-		}
-		std::cout << "pins pos: " << Kernel::pos[0].x << " " << Kernel::pos[4].x << " ";
-		std::cout << Kernel::pos[9].x << " " << Kernel::pos[14].x << " " << Kernel::pos[19].x << std::endl;
-	} else if (key == GLFW_KEY_RIGHT_BRACKET) {
-		if (cl_float3_dist(Kernel::pos[0], Kernel::pos[4]) < max_interval) {
-			Kernel::pos[4].x += move_dist;
-			std::cout << Kernel::pos[4].x << std::endl;
-		}
-		if (cl_float3_dist(Kernel::pos[4], Kernel::pos[9]) < max_interval) {
-			Kernel::pos[9].x += move_dist;
-		}
-		if (cl_float3_dist(Kernel::pos[9], Kernel::pos[14]) < max_interval) {
-			Kernel::pos[14].x += move_dist;
+	std::vector<unsigned int>& pins = Globals::cloth_pins;
+
+	// The device pins glide from where they are to the ends of their curves,
+	// the CPU solver takes the host mirror as it is
+	bool curves = Globals::backend == BACKEND_OPENCL && !batched();
+	std::vector<cl_float3> ends(pins.size());
+	for (size_t k = 0; k < pins.size(); k++)
+		ends[k] = curves ? pin_target_at(Kernel::targets[k], Kernel::targets[k].t1) : Kernel::pos[pins[k]];
+
+	// the first pin stays, the others slide along the rail
+	for (size_t k = 1; k < pins.size(); k++) {
+		float interval = cl_float3_dist(ends[k - 1], ends[k]);
+		if (key == GLFW_KEY_LEFT_BRACKET && interval > min_interval)
+			ends[k].x -= move_dist;
+		else if (key == GLFW_KEY_RIGHT_BRACKET && interval < max_interval)
+			ends[k].x += move_dist;
+	}
+	if (curves) {
+		for (size_t k = 0; k < pins.size(); k++) {
+			PinTarget& target = Kernel::targets[k];
+			cl_float3 now = pin_target_at(target, Kernel::pin_time);
+			for (int a = 0; a < 3; a++) {
+				target.start[a] = now.s[a];
+				target.end[a] = ends[k].s[a];
+			}
+			target.t0 = Kernel::pin_time;
+			target.t1 = Kernel::pin_time + PIN_MOVE_TIME;
 		}
-		if (cl_float3_dist(Kernel::pos[14], Kernel::pos[19]) < max_interval) {
-			Kernel::pos[19].x += move_dist;
+		upload_pin_targets(Kernel::pin_time + PIN_MOVE_TIME);
+	} else {
+		for (size_t k = 0; k < pins.size(); k++)
+			Kernel::pos[pins[k]] = ends[k];
+	}
+
+	std::cout << "pins pos:";
+	for (const cl_float3& end : ends)
+		std::cout << " " << end.x;
+	std::cout << std::endl;
+}
+
+// Only the opencl jacobi solver of a single cloth reads
+// the weights every step
+bool runtime_pins() {
+	return Globals::backend == BACKEND_OPENCL && !batched() &&
+		Globals::solver_mode != SOLVER_MULTIGRID && Globals::solver_mode != SOLVER_PROJECTIVE;
+}
+
+// Holds any vertex where it is, or lets it go, by writing its weight alone
+void set_pin(size_t vertex, bool pinned) {
+	cl_float weight = pinned ? 0.f : 1.f;
+	Kernel::pin_weights[vertex] = weight;
+	cl_int err = clEnqueueWriteBuffer(Kernel::commandQueue, Kernel::weights, CL_TRUE,
+		sizeof(cl_float) * vertex, sizeof(cl_float), &weight, 0, NULL, NULL);
+	assert(!err);
+	Kernel::rest_wake = std::max(Kernel::rest_wake, 1);
+}
+
+// Vertex of the cloth closest to the line of sight through the middle of
+// the window, in front of the eye
+size_t picked_vertex() {
+	Vec3f dir = -Globals::n;
+	size_t picked = 0;
+	float closest = -1.f;
+	for (size_t k = 0; k < Kernel::pos.size(); k++) {
+		Vec3f to(Kernel::pos[k].x - Globals::eye[0], Kernel::pos[k].y - Globals::eye[1], Kernel::pos[k].z - Globals::eye[2]);
+		float along = to.dot(dir);
+		if (along <= 0.f) continue;
+		float off = float(to.len2()) - along * along;
+		if (closest < 0.f || off < closest) {
+			closest = off;
+			picked = k;
 		}
-		std::cout << "pins pos: " << Kernel::pos[0].x << " " << Kernel::pos[4].x << " ";
-		std::cout << Kernel::pos[9].x << " " << Kernel::pos[14].x << " " << Kernel::pos[19].x << std::endl;
 	}
+	return picked;
+}
+
+// Pins the picked vertex, or lets it go when it is pinned
+void toggle_picked_pin() {
+	if (!runtime_pins()) {
+		std::cout << "Vertices can only be pinned by the opencl jacobi solver without a batch..." << std::endl;
+		return;
+	}
+	size_t vertex = picked_vertex();
+	bool pinned = Kernel::pin_weights[vertex] != 0.f;
+	set_pin(vertex, pinned);
+	std::cout << "vertex " << vertex << (pinned ? " pinned" : " free") << std::endl;
+}
 
+// Lets the cloth go by freeing the pins, or holds the pinned vertices where
+// they are now. Only the weights change; the solvers that build the pins in
+// when they start keep them.
+void release_pins() {
+	if (!runtime_pins()) {
+		std::cout << "The pins can only be released by the opencl jacobi solver without a batch..." << std::endl;
+		return;
+	}
+	Globals::pins_released = !Globals::pins_released;
+	for (unsigned int pin : Globals::cloth_pins)
+		set_pin(pin, !Globals::pins_released);
+	// Held at the positions of the last frame
+	if (!Globals::pins_released) {
+		for (size_t k = 0; k < Kernel::targets.size(); k++) {
+			PinTarget& target = Kernel::targets[k];
+			for (int a = 0; a < 3; a++)
+				target.start[a] = target.end[a] = Kernel::pos[target.vertex].s[a];
+			target.t0 = target.t1 = Kernel::pin_time;
+		}
+		upload_pin_targets(Kernel::pin_time);
+	}
+	std::cout << (Globals::pins_released ? "pins released" : "pins holding") << std::endl;
 }
 
 float cl_float3_dist(cl_float3& v1, cl_float3& v2) {
@@ -0,0 +1,79 @@
+#include "constraint_graph.hpp"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+
+ConstraintGraph::ConstraintGraph(const std::vector<Vec3f>& vertices, const std::vector<Vec3i>& faces) {
+	const int n = int(vertices.size());
+
+	// Every edge once, smaller vertex first, with the vertices opposite it
+	std::map<std::pair<int, int>, std::vector<int>> opposite;
+	for (const Vec3i& f : faces) {
+		for (int k = 0; k < 3; k++) {
+			int a = f[k], b = f[(k + 1) % 3];
+			opposite[std::make_pair(std::min(a, b), std::max(a, b))].push_back(f[(k + 2) % 3]);
+		}
+	}
+
+	std::set<std::pair<int, int>> listed;
+	std::vector<std::pair<int, int>> constraints;
+	for (const auto& e : opposite) {
+		listed.insert(e.first);
+		constraints.push_back(e.first);
+	}
+	edge_count = int(constraints.size());
+
+	// Folds across the edges of two faces, unless the two ends already share one
+	for (const auto& e : opposite) {
+		if (e.second.size() != 2 || e.second[0] == e.second[1]) continue;
+		std::pair<int, int> fold(std::min(e.second[0], e.second[1]), std::max(e.second[0], e.second[1]));
+		if (listed.insert(fold).second)
+			constraints.push_back(fold);
+	}
+	bend_count = int(constraints.size()) - edge_count;
+
+	// Both ends of every constraint, then each row sorted by neighbour
+	std::vector<std::vector<std::pair<int, float>>> rows(n);
+	double edge_sum = 0.0;
+	for (size_t c = 0; c < constraints.size(); c++) {
+		int a = constraints[c].first, b = constraints[c].second;
+		float length = float((vertices[a] - vertices[b]).len());
+		rows[a].push_back(std::make_pair(b, length));
+		rows[b].push_back(std::make_pair(a, length));
+		if (int(c) < edge_count) edge_sum += length;
+	}
+	edge_mean = edge_count ? float(edge_sum / edge_count) : 0.f;
+
+	first.assign(n + 1, 0);
+	for (int v = 0; v < n; v++) {
+		std::sort(rows[v].begin(), rows[v].end());
+		first[v + 1] = first[v] + int(rows[v].size());
+		for (const auto& entry : rows[v]) {
+			adjacent.push_back(entry.first);
+			lengths.push_back(entry.second);
+		}
+	}
+
+	// Faces around the vertices
+	std::vector<std::vector<int>> around(n);
+	for (size_t f = 0; f < faces.size(); f++) {
+		for (int k = 0; k < 3; k++) {
+			around[faces[f][k]].push_back(int(f));
+			corners.push_back(faces[f][k]);
+		}
+	}
+	face_first.assign(n + 1, 0);
+	for (int v = 0; v < n; v++) {
+		face_first[v + 1] = face_first[v] + int(around[v].size());
+		incident.insert(incident.end(), around[v].begin(), around[v].end());
+	}
+}
+
+int ConstraintGraph::max_degree() const {
+	int degree = 0;
+	for (int v = 0; v < size(); v++)
+		degree = std::max(degree, first[v + 1] - first[v]);
+	return degree;
+}
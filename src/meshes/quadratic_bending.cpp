@@ -0,0 +1,90 @@
+#include "quadratic_bending.hpp"
+
+#include <algorithm>
+#include <utility>
+
+#include "config.hpp"
+
+// Neighbours of the grid stencil, bend_di and bend_dj of kernels.cl
+static const int bend_offsets[QUADRATIC_BEND_TERMS][2] = {
+	{ -1, 0 }, { 1, 0 }, { 0, 1 }, { 0, -1 },
+	{ -1, -1 }, { 1, -1 }, { -1, 1 }, { 1, 1 },
+	{ -2, -1 }, { -1, -2 }, { 1, 2 }, { 2, 1 }
+};
+
+// Cotangent of the angle at a of the triangle a, b, c
+static double cotangent(const Vec3f& a, const Vec3f& b, const Vec3f& c) {
+	Vec3f u = b - a, v = c - a;
+	double sine = u.cross(v).len();
+	return sine > 0.0 ? u.dot(v) / sine : 0.0;
+}
+
+QuadraticBending::QuadraticBending(const std::vector<Vec3f>& vertices, const std::vector<Vec3i>& faces)
+	: rows(vertices.size()) {
+	// Every edge once, smaller vertex first, with the vertices opposite it
+	std::map<std::pair<int, int>, std::vector<int>> opposite;
+	for (const Vec3i& f : faces) {
+		for (int k = 0; k < 3; k++) {
+			int a = f[k], b = f[(k + 1) % 3];
+			opposite[std::make_pair(std::min(a, b), std::max(a, b))].push_back(f[(k + 2) % 3]);
+		}
+	}
+
+	for (const auto& e : opposite) {
+		if (e.second.size() != 2) continue;
+		const int x[4] = { e.first.first, e.first.second, e.second[0], e.second[1] };
+		const Vec3f& x0 = vertices[x[0]];
+		const Vec3f& x1 = vertices[x[1]];
+		const Vec3f& x2 = vertices[x[2]];
+		const Vec3f& x3 = vertices[x[3]];
+		double c01 = cotangent(x0, x1, x2), c02 = cotangent(x0, x1, x3);
+		double c03 = cotangent(x1, x0, x2), c04 = cotangent(x1, x0, x3);
+		double area = 0.5 * ((x1 - x0).cross(x2 - x0).len() + (x1 - x0).cross(x3 - x0).len());
+		if (area <= 0.0) continue;
+		const double K[4] = { c03 + c04, c01 + c02, -c01 - c03, -c02 - c04 };
+		for (int a = 0; a < 4; a++)
+			for (int b = 0; b < 4; b++)
+				rows[x[a]][x[b]] += 3.0 / area * K[a] * K[b];
+	}
+}
+
+float QuadraticBending::weight(int v, int u) const {
+	const std::map<int, double>& row = rows[v];
+	auto diagonal = row.find(v);
+	auto entry = row.find(u);
+	if (diagonal == row.end() || diagonal->second <= 0.0 || entry == row.end())
+		return 0.f;
+	return float(entry->second / diagonal->second);
+}
+
+std::vector<float> QuadraticBending::grid_table(int row, int col, float dx, float dy) {
+	// Rows only depend on the class, a grid of at most 4 x 4 quads has them all
+	int r = std::min(row, 4), c = std::min(col, 4);
+	std::vector<Vec3f> vertices;
+	std::vector<Vec3i> faces;
+	for (int i = 0; i <= r; i++)
+		for (int j = 0; j <= c; j++)
+			vertices.push_back(Vec3f(dx * j, 0.f, -dy * i));
+	// triangulated like build_fabric
+	for (int i = 0; i < r; i++) {
+		for (int j = 0; j < c; j++) {
+			faces.push_back(Vec3i(j + i * (c + 1), (i + 1) * (c + 1) + j, (i + 1) * (c + 1) + (j + 1)));
+			faces.push_back(Vec3i(j + i * (c + 1), (i + 1) * (c + 1) + (j + 1), i * (c + 1) + (j + 1)));
+		}
+	}
+	QuadraticBending q(vertices, faces);
+
+	std::vector<float> table(QUADRATIC_BEND_CLASSES * QUADRATIC_BEND_TERMS, 0.f);
+	for (int i = 0; i <= r; i++) {
+		for (int j = 0; j <= c; j++) {
+			// bend_class of kernels.cl
+			int k = (3 * std::min(i, 2) + std::min(r - i, 2)) * 9 + 3 * std::min(j, 2) + std::min(c - j, 2);
+			for (int s = 0; s < QUADRATIC_BEND_TERMS; s++) {
+				int ni = i + bend_offsets[s][0], nj = j + bend_offsets[s][1];
+				if (ni < 0 || ni > r || nj < 0 || nj > c) continue;
+				table[k * QUADRATIC_BEND_TERMS + s] = q.weight(j + i * (c + 1), nj + ni * (c + 1));
+			}
+		}
+	}
+	return table;
+}
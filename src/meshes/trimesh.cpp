@@ -2,12 +2,14 @@
 
 TriMesh::TriMesh() {
 	texture = 0;	// texture is disabled at first
+	faces_dirty = true;
 	scalingVec[0] = 1.f; scalingVec[1] = 1.f; scalingVec[2] = 1.f;
 	translatingVec[0] = 0.f; translatingVec[1] = 0.f; translatingVec[2] = 0.f;
 }
 
 TriMesh::TriMesh(std::string file) {
 	texture = 0;	// texture is disabled at first
+	faces_dirty = true;
 	scalingVec[0] = 1.f; scalingVec[1] = 1.f; scalingVec[2] = 1.f;
 	translatingVec[0] = 0.f; translatingVec[1] = 0.f; translatingVec[2] = 0.f;
 	load_obj(file);
@@ -59,7 +61,15 @@ void TriMesh::bindElementBuffers() {
 	// Bind buffers
 	glBindVertexArray(tris_vao);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, faces_ibo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, faces.size() * sizeof(faces[0]), &faces[0][0], GL_STATIC_DRAW);
+	if (faces_dirty) {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, faces.size() * sizeof(faces[0]), &faces[0][0], GL_STATIC_DRAW);
+		faces_dirty = false;
+	} else {
+		for (size_t slot : dirty_faces)
+			if (slot < faces.size())
+				glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, slot * sizeof(faces[0]), sizeof(faces[0]), &faces[slot][0]);
+	}
+	dirty_faces.clear();
 }
 
 void TriMesh::unbindElementBuffers() {
@@ -296,10 +306,10 @@ bool TriMesh::load_obj(std::string file) {
 					split_str('/', last_vert, &f_vals);
 					assert(f_vals.size() > 0);
 
+					face2[2] = vertices.size();
 					int v_idx = std::stoi(f_vals[0]) - 1;
 					vertices.push_back(temp_verts[v_idx]);
 					colors.push_back(temp_colors[v_idx]);
-					face2[2] = vertices.size();
 
 					// Check for normal
 					if (f_vals.size() > 2) {
@@ -326,6 +336,36 @@ bool TriMesh::load_obj(std::string file) {
 
 } // end load obj
 
+void TriMesh::weld() {
+	std::map<std::tuple<float, float, float>, int> index;
+	std::vector<int> remap(vertices.size());
+	std::vector<Vec3f> welded, welded_colors;
+	for (size_t i = 0; i < vertices.size(); i++) {
+		std::tuple<float, float, float> key(vertices[i][0], vertices[i][1], vertices[i][2]);
+		auto found = index.find(key);
+		if (found == index.end()) {
+			found = index.insert(std::make_pair(key, int(welded.size()))).first;
+			welded.push_back(vertices[i]);
+			if (i < colors.size()) welded_colors.push_back(colors[i]);
+		}
+		remap[i] = found->second;
+	}
+
+	// Faces that collapsed onto an edge are dropped
+	std::vector<Vec3i> welded_faces;
+	for (Vec3i& f : faces) {
+		Vec3i g(remap[f[0]], remap[f[1]], remap[f[2]]);
+		if (g[0] != g[1] && g[1] != g[2] && g[2] != g[0])
+			welded_faces.push_back(g);
+	}
+
+	vertices.swap(welded);
+	colors.swap(welded_colors);
+	faces.swap(welded_faces);
+	normals.clear();
+	uvs.clear();
+} // end weld
+
 void TriMesh::scale(float alpha) {
 	scalingVec[0] = alpha;
 	scalingVec[1] = alpha;
@@ -0,0 +1,182 @@
+#include "work_group_tuner.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+// Launches per timing and timings per candidate, the best one counts
+#define TUNE_LAUNCHES 8
+#define TUNE_ROUNDS 3
+
+static size_t round_up(size_t n, size_t multiple) {
+	return (n + multiple - 1) / multiple * multiple;
+}
+
+void LaunchConfig::global_size(size_t width, size_t height, size_t* global) const {
+	global[0] = local.x ? round_up(width, local.x) : width;
+	global[1] = local.y ? round_up(height, local.y) : height;
+}
+
+const size_t* LaunchConfig::local_size() const {
+	return local.x ? &local.x : NULL;
+}
+
+static std::string device_string(cl_device_id device, cl_device_info param) {
+	size_t size = 0;
+	if (clGetDeviceInfo(device, param, 0, NULL, &size) != CL_SUCCESS || size == 0)
+		return "unknown";
+	std::string value(size, '\0');
+	clGetDeviceInfo(device, param, size, &value[0], NULL);
+	value.resize(strlen(value.c_str()));
+	// tabs and newlines separate the cache fields
+	std::replace(value.begin(), value.end(), '\t', ' ');
+	std::replace(value.begin(), value.end(), '\n', ' ');
+	return value;
+}
+
+WorkGroupTuner::WorkGroupTuner(cl_device_id device_id, cl_command_queue queue, const std::string& cache_file)
+	: device_id(device_id), queue(queue), cache_file(cache_file), build("0"), retune(false), dirty(false) {
+	device = device_string(device_id, CL_DEVICE_NAME) + "\t" + device_string(device_id, CL_DRIVER_VERSION);
+	load();
+}
+
+void WorkGroupTuner::set_build(const std::string& build) {
+	// FNV-1a, the same on every run and platform, unlike std::hash
+	unsigned long long hash = 14695981039346656037ull;
+	for (unsigned char c : build) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	std::stringstream hex;
+	hex << std::hex << hash;
+	this->build = hex.str();
+}
+
+// Cache lines: device \t driver \t build \t kernel \t width \t height \t variant \t local x \t local y
+void WorkGroupTuner::load() {
+	std::ifstream file(cache_file.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		std::vector<std::string> fields;
+		std::stringstream ss(line);
+		std::string field;
+		while (std::getline(ss, field, '\t'))
+			fields.push_back(field);
+		// Lines without the build field predate it, they are tuned again
+		if (fields.size() != 9) continue;
+
+		LaunchConfig config;
+		config.variant = atoi(fields[6].c_str());
+		config.local.x = strtoul(fields[7].c_str(), NULL, 10);
+		config.local.y = strtoul(fields[8].c_str(), NULL, 10);
+		cache[fields[0] + "\t" + fields[1] + "\t" + fields[2] + "\t" + fields[3] + "\t" + fields[4] + "\t" + fields[5]] = config;
+	}
+}
+
+bool WorkGroupTuner::save() const {
+	if (!dirty) return true;
+
+	std::ofstream file(cache_file.c_str());
+	if (!file) {
+		std::cout << "ERROR: cannot write the tuning cache " << cache_file << std::endl;
+		return false;
+	}
+	for (const auto& entry : cache) {
+		const LaunchConfig& config = entry.second;
+		file << entry.first << "\t" << config.variant << "\t"
+			<< config.local.x << "\t" << config.local.y << "\n";
+	}
+	return true;
+}
+
+std::vector<WorkGroup> WorkGroupTuner::default_candidates(cl_kernel kernel) const {
+	size_t max_group = 0;
+	size_t max_items[3] = { 0, 0, 0 };
+	clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+	clGetDeviceInfo(device_id, CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(max_items), max_items, NULL);
+
+	// Dimension 1 walks along a cloth row, i.e. contiguous memory
+	const WorkGroup shapes[] = {
+		{ 1, 16 }, { 1, 32 }, { 1, 64 }, { 1, 128 }, { 1, 256 },
+		{ 2, 32 }, { 2, 64 }, { 4, 16 }, { 4, 32 }, { 4, 64 },
+		{ 8, 8 }, { 8, 16 }, { 8, 32 }, { 16, 4 }, { 16, 8 }, { 16, 16 },
+		{ 32, 4 }, { 32, 8 }, { 64, 1 }, { 64, 4 }
+	};
+
+	std::vector<WorkGroup> candidates;
+	candidates.push_back({ 0, 0 });
+	for (const WorkGroup& shape : shapes)
+		if (shape.x * shape.y <= max_group && shape.x <= max_items[0] && shape.y <= max_items[1])
+			candidates.push_back(shape);
+	return candidates;
+}
+
+double WorkGroupTuner::time_launch(cl_kernel kernel, const LaunchConfig& config, size_t width, size_t height) const {
+	size_t global[2];
+	config.global_size(width, height, global);
+
+	// Warm up, and reject shapes the kernel cannot run with
+	cl_int err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, config.local_size(), 0, NULL, NULL);
+	if (err != CL_SUCCESS || clFinish(queue) != CL_SUCCESS)
+		return -1.0;
+
+	double best = -1.0;
+	for (int round = 0; round < TUNE_ROUNDS; round++) {
+		auto start = std::chrono::steady_clock::now();
+		for (int k = 0; k < TUNE_LAUNCHES; k++)
+			clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, config.local_size(), 0, NULL, NULL);
+		clFinish(queue);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (best < 0.0 || elapsed < best)
+			best = elapsed;
+	}
+	return best / TUNE_LAUNCHES;
+}
+
+LaunchConfig WorkGroupTuner::tune(const std::string& name, const std::vector<TuneVariant>& variants,
+	size_t width, size_t height) {
+	std::stringstream key;
+	key << device << "\t" << build << "\t" << name << "\t" << width << "\t" << height;
+
+	auto cached = cache.find(key.str());
+	if (!retune && cached != cache.end() && cached->second.variant < (int)variants.size()) {
+		const LaunchConfig& config = cached->second;
+		if (variants[config.variant].prepare)
+			variants[config.variant].prepare(config.local);
+		return config;
+	}
+
+	LaunchConfig best = { 0, { 0, 0 } };
+	double best_time = -1.0;
+	for (int v = 0; v < (int)variants.size(); v++) {
+		const TuneVariant& variant = variants[v];
+		std::vector<WorkGroup> candidates = variant.candidates.empty() ?
+			default_candidates(variant.kernel) : variant.candidates;
+		for (const WorkGroup& local : candidates) {
+			if (variant.prepare)
+				variant.prepare(local);
+			LaunchConfig config = { v, local };
+			double time = time_launch(variant.kernel, config, width, height);
+			if (time >= 0.0 && (best_time < 0.0 || time < best_time)) {
+				best_time = time;
+				best = config;
+			}
+		}
+	}
+
+	// Leave the winner's arguments set
+	if (variants[best.variant].prepare)
+		variants[best.variant].prepare(best.local);
+
+	std::cout << "SUCCESS: tuned " << name << " (" << width << "x" << height << "): variant "
+		<< best.variant << ", local " << best.local.x << "x" << best.local.y
+		<< ", " << best_time * 1e6 << " us" << std::endl;
+
+	cache[key.str()] = best;
+	dirty = true;
+	return best;
+}